@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "config.h"
+#include "copy.h"
+#include "dirlist.h"
+#include "du.h"
+#include "rmtree.h"
+#include "search.h"
+#include "sort.h"
+
+#define FORMAT_LINES 0
+#define FORMAT_NUL 1
+#define FORMAT_JSON 2
+
+#define MAX_ARGS 64
+
+static int format = FORMAT_LINES;
+static int nfields;
+
+// Length of the valid UTF-8 sequence starting at p, or 0 if there is none:
+// no overlong forms, surrogates or code points past U+10FFFF.
+static int utf8_len(const unsigned char *p) {
+  int len = p[0] >= 0xf0 ? 4 : p[0] >= 0xe0 ? 3 : p[0] >= 0xc2 ? 2 : 0;
+  if (len == 0 || p[0] > 0xf4)
+    return 0;
+  unsigned char lo = p[0] == 0xe0 ? 0xa0 : p[0] == 0xf0 ? 0x90 : 0x80;
+  unsigned char hi = p[0] == 0xed ? 0x9f : p[0] == 0xf4 ? 0x8f : 0xbf;
+  if (p[1] < lo || p[1] > hi)
+    return 0;
+  for (int k = 2; k < len; k++)
+    if ((p[k] & 0xc0) != 0x80)
+      return 0;
+  return len;
+}
+
+// Records are written field by field. The plain formats separate the
+// values with tabs and drop the keys; JSON keeps both. Names need not be
+// UTF-8, but JSON must be, so a byte that is not part of a valid sequence
+// is written as \u00XX, the code point of that byte value.
+static void json_string(const char *s) {
+  putchar('"');
+  for (const unsigned char *p = (const unsigned char *)s; *p;) {
+    int len = *p >= 0x80 ? utf8_len(p) : 1;
+    if (*p == '"' || *p == '\\')
+      printf("\\%c", *p);
+    else if (*p < 0x20 || len == 0)
+      printf("\\u%04x", *p);
+    else
+      fwrite(p, 1, len, stdout);
+    p += len > 0 ? len : 1;
+  }
+  putchar('"');
+}
+
+static void begin(const char *op) {
+  nfields = 0;
+  if (format == FORMAT_JSON)
+    printf("{\"op\": \"%s\"", op);
+}
+
+static void next_field(const char *key) {
+  if (format == FORMAT_JSON)
+    printf(", \"%s\": ", key);
+  else if (nfields > 0)
+    putchar('\t');
+  nfields++;
+}
+
+static void str_field(const char *key, const char *value) {
+  next_field(key);
+  if (format == FORMAT_JSON)
+    json_string(value);
+  else
+    fputs(value, stdout);
+}
+
+static void num_field(const char *key, uint64_t value) {
+  next_field(key);
+  printf("%llu", (unsigned long long)value);
+}
+
+static void end(void) {
+  if (format == FORMAT_JSON)
+    fputs("}\n", stdout);
+  else
+    putchar(format == FORMAT_NUL ? '\0' : '\n');
+}
+
+// Reports a failure on stderr and, in JSON, as a record of its own so that
+// a consumer reading stdout sees it in order.
+static int fail_msg(const char *op, const char *path, const char *msg) {
+  fprintf(stderr, "fsm: %s: %s%s%s\n", op, path, path[0] ? ": " : "", msg);
+  if (format == FORMAT_JSON) {
+    begin(op);
+    str_field("path", path);
+    str_field("error", msg);
+    end();
+  }
+  return 1;
+}
+
+static int fail(const char *op, const char *path, int err) {
+  return fail_msg(op, path, strerror(err));
+}
+
+// Reports a command given wrongly, which exits with status 2.
+static int usage_msg(const char *op, const char *msg) {
+  fail_msg(op, "", msg);
+  return 2;
+}
+
+static void join(char *buf, size_t size, const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  snprintf(buf, size, "%s%s%s", dir, len > 0 && dir[len - 1] == '/' ? "" : "/", name);
+}
+
+static const char *type_name(dir_listing_t *l, int i) {
+  switch (l->entries[i].d_type) {
+    case DT_DIR:
+      return "dir";
+    case DT_REG:
+      return "file";
+    case DT_LNK:
+      return "link";
+    case DT_UNKNOWN:
+      return dir_listing_is_dir(l, i) ? "dir" : "file";
+  }
+  return "other";
+}
+
+static int cmd_ls(int argc, char **argv) {
+  char path[PATH_MAX];
+  int details = 0, rc = 0;
+  dir_listing_t l;
+
+  if (argc > 0 && strcmp(argv[0], "-l") == 0) {
+    details = 1;
+    argc--;
+    argv++;
+  }
+  for (int a = 0; a < argc; a++) {
+    dir_listing_init(&l, strdup(argv[a]));
+    if (dir_listing_read(&l) < 0) {
+      rc = fail("ls", argv[a], errno);
+      free(l.path);
+      continue;
+    }
+    // Sorting by size or time needs the metadata anyway.
+    if (details || l.sort_mode == SORT_SIZE || l.sort_mode == SORT_MTIME)
+      dir_listing_stat_all(&l);
+    sort_listing(&l);
+    for (int pos = 0; pos < l.len; pos++) {
+      int i = dir_listing_index(&l, pos);
+      const char *name = dir_listing_name(&l, i);
+      if (strcmp(name, "..") == 0)
+        continue;
+      join(path, sizeof(path), argv[a], name);
+      begin("ls");
+      if (details) {
+        dir_meta_t meta = {0};
+        dir_listing_stat(&l, i, &meta);
+        str_field("type", type_name(&l, i));
+        num_field("size", meta.size);
+        num_field("mtime", (uint64_t)meta.mtime);
+        num_field("mode", meta.mode & 07777);
+      }
+      str_field("path", path);
+      end();
+    }
+    dir_listing_clear(&l);
+    free(l.path);
+  }
+  return rc;
+}
+
+static int cmd_du(int argc, char **argv) {
+  du_options_t opt = {0};
+  du_result_t r;
+  int rc = 0;
+
+  for (int a = 0; a < argc; a++) {
+    if (du_walk(argv[a], &opt, &r) < 0) {
+      rc = fail("du", argv[a], errno);
+      continue;
+    }
+    begin("du");
+    num_field("bytes", r.bytes);
+    num_field("disk", r.blocks * 512);
+    num_field("files", r.files);
+    num_field("dirs", r.dirs);
+    num_field("errors", r.errors);
+    str_field("path", argv[a]);
+    end();
+    rc |= r.errors > 0;
+  }
+  return rc;
+}
+
+// Streams the results of a search as they come in.
+static int cmd_search(const char *op, int argc, char **argv) {
+  char hit[PATH_MAX + GREP_LINE_MAX + 32], rel[PATH_MAX], path[PATH_MAX];
+  struct timespec pause = {0, 10 * 1000 * 1000};
+  size_t shown = 0, n = 0, progress;
+  int done = 0, grep = strcmp(op, "grep") == 0;
+
+  if (argc != 2)
+    return usage_msg(op, "expects ROOT and TEXT");
+  search_t *s = grep ? search_grep(argv[0], argv[1]) : search_start(argv[0], argv[1]);
+  if (s == NULL)
+    return fail(op, argv[0], errno ? errno : EINVAL);
+  while (!done || shown < n) {
+    n = search_poll(s, &done, &progress);
+    for (; shown < n; shown++) {
+      if (search_result_path(s, shown, rel, sizeof(rel)) < 0 ||
+          search_result(s, shown, hit, sizeof(hit)) < 0)
+        continue;
+      join(path, sizeof(path), argv[0], rel);
+      begin(op);
+      str_field("path", path);
+      if (grep) {
+        // search_result() gives "path:line: text".
+        char *detail = hit + strlen(rel) + 1, *text = strchr(detail, ':');
+        num_field("line", strtoull(detail, NULL, 10));
+        str_field("text", text != NULL ? text + 2 : "");
+      }
+      end();
+    }
+    fflush(stdout);
+    if (!done)
+      nanosleep(&pause, NULL);
+  }
+  if (n >= SEARCH_MAX_RESULTS)
+    fprintf(stderr, "fsm: %s: stopped at %d results\n", op, SEARCH_MAX_RESULTS);
+  search_stop(s);
+  return 0;
+}
+
+static int cmd_copy(const char *op, int argc, char **argv) {
+  copy_options_t opt = {0};
+  copy_stats_t stats = {0};
+
+  if (argc != 2)
+    return usage_msg(op, "expects SRC and DST");
+  int rc = strcmp(op, "mv") == 0 ? move_tree(argv[0], argv[1], &opt, &stats)
+                                 : copy_tree(argv[0], argv[1], &opt, &stats);
+  if (rc < 0)
+    return fail(op, argv[0], errno);
+  begin(op);
+  num_field("bytes", stats.bytes);
+  num_field("files", stats.files);
+  num_field("dirs", stats.dirs);
+  num_field("errors", stats.errors);
+  str_field("src", argv[0]);
+  str_field("dst", argv[1]);
+  end();
+  return stats.errors > 0;
+}
+
+static int cmd_rm(int argc, char **argv) {
+  rm_options_t opt = {0};
+  rm_result_t r = {0};
+  int rc = 0;
+
+  for (int a = 0; a < argc; a++) {
+    if (rm_tree(argv[a], &opt, &r) < 0) {
+      rc = fail("rm", argv[a], errno);
+      continue;
+    }
+    begin("rm");
+    num_field("files", r.files);
+    num_field("dirs", r.dirs);
+    num_field("errors", r.errors);
+    str_field("path", argv[a]);
+    end();
+    rc |= r.errors > 0;
+  }
+  return rc;
+}
+
+static int run(int argc, char **argv) {
+  int rc;
+
+  if (argc == 0)
+    return 0;
+  errno = 0;
+  if (strcmp(argv[0], "ls") == 0)
+    rc = cmd_ls(argc - 1, argv + 1);
+  else if (strcmp(argv[0], "du") == 0)
+    rc = cmd_du(argc - 1, argv + 1);
+  else if (strcmp(argv[0], "find") == 0 || strcmp(argv[0], "grep") == 0)
+    rc = cmd_search(argv[0], argc - 1, argv + 1);
+  else if (strcmp(argv[0], "cp") == 0 || strcmp(argv[0], "mv") == 0)
+    rc = cmd_copy(argv[0], argc - 1, argv + 1);
+  else if (strcmp(argv[0], "rm") == 0)
+    rc = cmd_rm(argc - 1, argv + 1);
+  else
+    rc = usage_msg(argv[0], "unknown command");
+  fflush(stdout);
+  return rc;
+}
+
+// Splits line into words in place, the way a shell would for plain words,
+// '...', "..." and backslash escapes. Returns the number of words.
+static int split(char *line, char **words) {
+  char *in = line, *out = line;
+  int n = 0;
+
+  for (;;) {
+    while (*in == ' ' || *in == '\t' || *in == '\n')
+      in++;
+    if (*in == '\0' || n == MAX_ARGS)
+      return n;
+    words[n++] = out;
+    char quote = 0;
+    for (; *in != '\0'; in++) {
+      if (quote != 0 && *in == quote) {
+        quote = 0;
+      } else if (quote == 0 && (*in == '\'' || *in == '"')) {
+        quote = *in;
+      } else if (quote != '\'' && *in == '\\' && in[1] != '\0') {
+        *out++ = *++in;
+      } else if (quote == 0 && (*in == ' ' || *in == '\t' || *in == '\n')) {
+        in++;
+        break;
+      } else {
+        *out++ = *in;
+      }
+    }
+    *out++ = '\0';
+  }
+}
+
+// Runs the commands on stdin, one per line, until it ends.
+static int run_stdin(void) {
+  char *line = NULL, *words[MAX_ARGS];
+  size_t cap = 0;
+  int rc = 0;
+
+  // The worst status wins: a usage error over a failure.
+  while (getline(&line, &cap, stdin) > 0) {
+    int r = run(split(line, words), words);
+    if (r > rc)
+      rc = r;
+  }
+  free(line);
+  return rc;
+}
+
+int batch_main(int argc, char **argv) {
+  static char buf[1 << 20];
+
+  setvbuf(stdout, buf, _IOFBF, sizeof(buf));
+  for (; argc > 0 && argv[0][0] == '-' && argv[0][1] != '\0'; argc--, argv++) {
+    if (strcmp(argv[0], "-0") == 0) {
+      format = FORMAT_NUL;
+    } else if (strcmp(argv[0], "-j") == 0) {
+      format = FORMAT_JSON;
+    } else {
+      fprintf(stderr, "usage: fsm --batch [-0|-j] [ls|du|find|grep|cp|mv|rm|-] ARGS...\n"
+                      "  -0  end records with NUL\n"
+                      "  -j  JSON records; name bytes that are not UTF-8 are written as \\u00XX\n");
+      return 2;
+    }
+  }
+  if (argc == 0 || strcmp(argv[0], "-") == 0)
+    return run_stdin();
+  return run(argc, argv);
+}
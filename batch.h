@@ -0,0 +1,23 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+// Runs fsm without a terminal: fsm --batch [-0|-j] COMMAND ARGS...
+//
+//   ls [-l] DIR...     entries of each directory, sorted as in the UI
+//   du PATH...         recursive size of each path
+//   find ROOT TEXT     names below ROOT containing TEXT, as they are found
+//   grep ROOT TEXT     lines holding TEXT in the files below ROOT
+//   cp SRC DST         copy SRC to DST
+//   mv SRC DST         move SRC to DST
+//   rm PATH...         remove each path with everything below it
+//
+// Results are written one record per line, or ended by NUL with -0, or as
+// JSON objects, one per line, with -j; there a byte of a name that is not
+// part of valid UTF-8 is written as \u00XX. With COMMAND "-" (or none), one
+// command per line is read from stdin and run in turn; arguments are split
+// on blanks, with quotes and backslashes as in the shell. Returns the exit
+// status: 0 if everything succeeded, 1 if anything failed and 2 on a usage
+// error.
+int batch_main(int argc, char **argv);
+
+#endif
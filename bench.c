@@ -0,0 +1,523 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/utsname.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "copy.h"
+#include "dirlist.h"
+#include "du.h"
+#include "rmtree.h"
+#include "search.h"
+#include "sort.h"
+
+// Headless benchmark driver. It lays out synthetic trees below a scratch
+// directory, the same ones on every run, and times what the UI does on
+// them through the same modules, without ncurses. Every operation is run
+// a few times; the fastest, median and slowest runs are written as CSV and
+// JSON so that two versions can be compared on the same machine.
+
+#ifndef FSM_VERSION
+#define FSM_VERSION "unknown"
+#endif
+
+#define TREE_FLAT 0
+#define TREE_DEEP 1
+#define TREE_SMALL 2
+#define TREE_HUGE 3
+#define TREE_SPARSE 4
+
+#define MAX_RUNS 32
+#define MAX_RESULTS 512
+#define FILES_PER_DIR 1000
+
+// A synthetic tree. What count and size mean depends on the kind:
+//   flat    count files in one directory, with sizes up to size as holes
+//   deep    a binary tree of directories count levels deep, 4 files in each
+//   small   count files of up to size bytes, FILES_PER_DIR to a directory
+//   huge    count files of size bytes of data
+//   sparse  count files of size bytes, with 1 MB of data in every GB
+// Trees marked full are only made with -s full.
+typedef struct tree_spec_ {
+  const char *name;
+  int kind;
+  uint64_t count, size;
+  int full;
+} tree_spec_t;
+
+static const tree_spec_t trees[] = {
+    {"flat-10k", TREE_FLAT, 10000, 65536, 0},
+    {"flat-100k", TREE_FLAT, 100000, 65536, 0},
+    {"flat-1m", TREE_FLAT, 1000000, 65536, 1},
+    {"flat-5m", TREE_FLAT, 5000000, 65536, 1},
+    {"deep", TREE_DEEP, 14, 0, 0},
+    {"deep-20", TREE_DEEP, 20, 0, 1},
+    {"small-files", TREE_SMALL, 20000, 8192, 0},
+    {"small-files-500k", TREE_SMALL, 500000, 8192, 1},
+    {"huge-files", TREE_HUGE, 2, 128 << 20, 0},
+    {"huge-files-4g", TREE_HUGE, 4, 1ULL << 30, 1},
+    {"sparse", TREE_SPARSE, 4, 16ULL << 30, 0},
+};
+
+#define NTREES (sizeof(trees) / sizeof(trees[0]))
+
+// Timings of one operation on one tree, in seconds.
+typedef struct result_ {
+  const char *tree;
+  const char *op;
+  uint64_t entries, bytes;
+  int runs;
+  double min, median, max;
+} result_t;
+
+static result_t results[MAX_RESULTS];
+static int nresults = 0;
+
+static char root[PATH_MAX - 128];
+static int runs = 3;
+
+static const char *words[] = {"alpha", "Beta", "gamma", "delta", "report",
+                              "IMG", "track", "notes", "build", "log"};
+static const char *exts[] = {"txt", "c", "h", "jpg", "mp3",
+                             "tar.gz", "pdf", "o", "json", "md"};
+
+static void die(const char *what, const char *path) {
+  fprintf(stderr, "fsm-bench: %s %s: %s\n", what, path, strerror(errno));
+  exit(1);
+}
+
+// xorshift64*: the same tree comes out of the same name on every machine.
+static uint64_t next_random(uint64_t *s) {
+  *s ^= *s >> 12;
+  *s ^= *s << 25;
+  *s ^= *s >> 27;
+  return *s * 0x2545F4914F6CDD1DULL;
+}
+
+static uint64_t seed_of(const char *name) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (; *name; name++)
+    h = (h ^ (unsigned char)*name) * 0x100000001b3ULL;
+  return h;
+}
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Writes len bytes of pseudo-random data at off. Text is made of short
+// lines, a few of which hold "needle" for the content search.
+static void fill(int fd, uint64_t off, uint64_t len, int text, uint64_t *s) {
+  static char buf[1 << 20];
+  while (len > 0) {
+    size_t n = len < sizeof(buf) ? len : sizeof(buf);
+    for (size_t i = 0; i < n; i += 8) {
+      uint64_t r = next_random(s);
+      memcpy(buf + i, &r, n - i < 8 ? n - i : 8);
+    }
+    if (text) {
+      for (size_t i = 0; i < n; i++)
+        buf[i] = (i % 64 == 63) ? '\n' : 'a' + (unsigned char)buf[i] % 26;
+      if (next_random(s) % 16 == 0 && n >= 6)
+        memcpy(buf + next_random(s) % (n - 5), "needle", 6);
+    }
+    if (pwrite(fd, buf, n, off) != (ssize_t)n)
+      die("cannot write", "file");
+    off += n;
+    len -= n;
+  }
+}
+
+// Creates one file of the tree in dirfd. Sizes past data are left as a
+// hole; mtimes are spread over the last year so that sorting has work.
+static void make_file(int dirfd, const char *name, uint64_t size, uint64_t data,
+                      int text, uint64_t *s) {
+  int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0)
+    die("cannot create", name);
+  if (data > 0)
+    fill(fd, 0, data, text, s);
+  if (size > data && ftruncate(fd, size) < 0)
+    die("cannot size", name);
+  struct timespec times[2] = {{0, UTIME_OMIT}, {time(NULL) - next_random(s) % 31536000, 0}};
+  futimens(fd, times);
+  close(fd);
+}
+
+static void entry_name(char *buf, size_t size, uint64_t i, uint64_t *s) {
+  uint64_t r = next_random(s);
+  snprintf(buf, size, "%s%llu-%08x.%s", words[r % 10], (unsigned long long)i,
+           (unsigned)(r >> 32), exts[(r >> 8) % 10]);
+}
+
+static int make_dir(int parent, const char *name) {
+  if (mkdirat(parent, name, 0755) < 0 && errno != EEXIST)
+    die("cannot create", name);
+  int fd = openat(parent, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    die("cannot open", name);
+  return fd;
+}
+
+static void make_deep(int dirfd, int levels, uint64_t *s) {
+  char name[64];
+  for (int i = 0; i < 4; i++) {
+    entry_name(name, sizeof(name), i, s);
+    make_file(dirfd, name, 0, 0, 0, s);
+  }
+  if (levels <= 1)
+    return;
+  for (int i = 0; i < 2; i++) {
+    snprintf(name, sizeof(name), "d%d", i);
+    int fd = make_dir(dirfd, name);
+    make_deep(fd, levels - 1, s);
+    close(fd);
+  }
+}
+
+// Lays out t in dirfd.
+static void make_tree(const tree_spec_t *t, int dirfd) {
+  uint64_t s = seed_of(t->name);
+  char name[64];
+  int sub = -1;
+
+  switch (t->kind) {
+    case TREE_FLAT:
+      for (uint64_t i = 0; i < t->count; i++) {
+        entry_name(name, sizeof(name), i, &s);
+        make_file(dirfd, name, next_random(&s) % t->size, 0, 0, &s);
+      }
+      break;
+    case TREE_DEEP:
+      make_deep(dirfd, t->count, &s);
+      break;
+    case TREE_SMALL:
+      for (uint64_t i = 0; i < t->count; i++) {
+        if (i % FILES_PER_DIR == 0) {
+          if (sub >= 0)
+            close(sub);
+          snprintf(name, sizeof(name), "dir%llu", (unsigned long long)(i / FILES_PER_DIR));
+          sub = make_dir(dirfd, name);
+        }
+        entry_name(name, sizeof(name), i, &s);
+        uint64_t size = next_random(&s) % t->size;
+        make_file(sub, name, size, size, 1, &s);
+      }
+      if (sub >= 0)
+        close(sub);
+      break;
+    case TREE_HUGE:
+      for (uint64_t i = 0; i < t->count; i++) {
+        snprintf(name, sizeof(name), "huge%llu.bin", (unsigned long long)i);
+        make_file(dirfd, name, t->size, t->size, 0, &s);
+      }
+      break;
+    case TREE_SPARSE:
+      for (uint64_t i = 0; i < t->count; i++) {
+        snprintf(name, sizeof(name), "sparse%llu.img", (unsigned long long)i);
+        int fd = openat(dirfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || ftruncate(fd, t->size) < 0)
+          die("cannot create", name);
+        for (uint64_t off = 0; off < t->size; off += 1ULL << 30)
+          fill(fd, off, 1 << 20, 0, &s);
+        close(fd);
+      }
+      break;
+  }
+}
+
+// Makes t below root/trees unless a finished copy with the same layout is
+// already there, and puts its path into path.
+static void prepare_tree(const tree_spec_t *t, char *path, size_t size) {
+  char marker[PATH_MAX], want[128], have[128] = "";
+  FILE *f;
+
+  snprintf(path, size, "%s/trees/%s", root, t->name);
+  snprintf(marker, sizeof(marker), "%s.done", path);
+  snprintf(want, sizeof(want), "%d %llu %llu\n", t->kind,
+           (unsigned long long)t->count, (unsigned long long)t->size);
+  if ((f = fopen(marker, "r")) != NULL) {
+    int same = fgets(have, sizeof(have), f) != NULL && strcmp(have, want) == 0;
+    fclose(f);
+    if (same)
+      return;
+  }
+
+  fprintf(stderr, "generating %s...\n", t->name);
+  unlink(marker);
+  rm_tree(path, &(rm_options_t){0}, &(rm_result_t){0});
+  if (mkdir(path, 0755) < 0)
+    die("cannot create", path);
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    die("cannot open", path);
+  make_tree(t, fd);
+  close(fd);
+  sync();
+  if ((f = fopen(marker, "w")) == NULL)
+    die("cannot create", marker);
+  fputs(want, f);
+  fclose(f);
+}
+
+static int compare_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+static void record(const char *tree, const char *op, const du_result_t *size,
+                   double *times, int n) {
+  if (nresults == MAX_RESULTS || n == 0)
+    return;
+  qsort(times, n, sizeof(double), compare_double);
+  result_t *r = &results[nresults++];
+  r->tree = tree;
+  r->op = op;
+  r->entries = size->files + size->dirs;
+  r->bytes = size->bytes;
+  r->runs = n;
+  r->min = times[0];
+  r->median = n % 2 ? times[n / 2] : (times[n / 2 - 1] + times[n / 2]) / 2;
+  r->max = times[n - 1];
+  fprintf(stderr, "  %-14s %10.4f s  (min %.4f, max %.4f)\n", op, r->median,
+          r->min, r->max);
+}
+
+// Runs a search to the end and returns how many results it found.
+static size_t run_search(search_t *search) {
+  int done = 0;
+  size_t n = 0, progress;
+  struct timespec pause = {0, 1000000};
+
+  if (search == NULL)
+    return 0;
+  while (!done) {
+    n = search_poll(search, &done, &progress);
+    if (!done)
+      nanosleep(&pause, NULL);
+  }
+  search_stop(search);
+  return n;
+}
+
+static void bench_tree(const tree_spec_t *t) {
+  char path[PATH_MAX], work[PATH_MAX], moved[PATH_MAX], cache[PATH_MAX];
+  static const int sorts[] = {SORT_NAME, SORT_NATURAL, SORT_SIZE, SORT_MTIME,
+                              SORT_EXTENSION};
+  static const char *sort_ops[] = {"sort-name", "sort-natural", "sort-size",
+                                   "sort-mtime", "sort-extension"};
+  double times[2 + SORT_MODES][MAX_RUNS], start;
+  du_options_t du = {0};
+  du_result_t size = {0};
+  dir_listing_t l;
+
+  prepare_tree(t, path, sizeof(path));
+  fprintf(stderr, "%s\n", t->name);
+  if (du_walk(path, &du, &size) < 0)
+    die("cannot measure", path);
+
+  // Listing and sorting the top directory, as on entering it.
+  for (int r = 0; r < runs; r++) {
+    dir_listing_init(&l, strdup(path));
+    start = now();
+    if (dir_listing_read(&l) < 0)
+      die("cannot list", path);
+    times[0][r] = now() - start;
+    start = now();
+    dir_listing_stat_all(&l);
+    times[1][r] = now() - start;
+    for (int m = 0; m < SORT_MODES; m++) {
+      l.sort_mode = sorts[m];
+      l.dirs_first = SORT_DIRS_FIRST;
+      start = now();
+      sort_listing(&l);
+      times[2 + m][r] = now() - start;
+    }
+    dir_listing_clear(&l);
+    free(l.path);
+  }
+  record(t->name, "list", &size, times[0], runs);
+  record(t->name, "stat", &size, times[1], runs);
+  for (int m = 0; m < SORT_MODES; m++)
+    record(t->name, sort_ops[m], &size, times[2 + m], runs);
+
+  for (int r = 0; r < runs; r++) {
+    du_result_t walked;
+    start = now();
+    du_walk(path, &du, &walked);
+    times[0][r] = now() - start;
+  }
+  record(t->name, "du", &size, times[0], runs);
+
+  // The name index lives under XDG_CACHE_HOME, which points into root.
+  snprintf(cache, sizeof(cache), "%s/cache", root);
+  for (int r = 0; r < runs; r++) {
+    rm_tree(cache, &(rm_options_t){0}, &(rm_result_t){0});
+    start = now();
+    run_search(search_start(path, "00ff"));
+    times[0][r] = now() - start;
+    start = now();
+    run_search(search_start(path, "00ff"));
+    times[1][r] = now() - start;
+  }
+  record(t->name, "search-cold", &size, times[0], runs);
+  record(t->name, "search-warm", &size, times[1], runs);
+
+  if (t->kind == TREE_SMALL) {
+    for (int r = 0; r < runs; r++) {
+      start = now();
+      run_search(search_grep(path, "needle"));
+      times[0][r] = now() - start;
+    }
+    record(t->name, "grep", &size, times[0], runs);
+  }
+
+  // Copy out, move within the filesystem, then delete the copy.
+  snprintf(work, sizeof(work), "%s/work/%s", root, t->name);
+  snprintf(moved, sizeof(moved), "%s.moved", work);
+  rm_tree(work, &(rm_options_t){0}, &(rm_result_t){0});
+  rm_tree(moved, &(rm_options_t){0}, &(rm_result_t){0});
+  for (int r = 0; r < runs; r++) {
+    copy_stats_t stats;
+    rm_result_t removed;
+    start = now();
+    if (copy_tree(path, work, &(copy_options_t){0}, &stats) < 0)
+      die("cannot copy", path);
+    times[0][r] = now() - start;
+    start = now();
+    if (move_tree(work, moved, &(copy_options_t){0}, &stats) < 0)
+      die("cannot move", work);
+    times[1][r] = now() - start;
+    start = now();
+    if (rm_tree(moved, &(rm_options_t){0}, &removed) < 0)
+      die("cannot delete", moved);
+    times[2][r] = now() - start;
+  }
+  record(t->name, "copy", &size, times[0], runs);
+  record(t->name, "move", &size, times[1], runs);
+  record(t->name, "delete", &size, times[2], runs);
+}
+
+static void write_csv(const char *path) {
+  FILE *f = fopen(path, "w");
+  if (f == NULL)
+    die("cannot create", path);
+  fprintf(f, "version,tree,op,entries,bytes,runs,min_s,median_s,max_s\n");
+  for (int i = 0; i < nresults; i++) {
+    result_t *r = &results[i];
+    fprintf(f, "%s,%s,%s,%llu,%llu,%d,%.6f,%.6f,%.6f\n", FSM_VERSION, r->tree,
+            r->op, (unsigned long long)r->entries, (unsigned long long)r->bytes,
+            r->runs, r->min, r->median, r->max);
+  }
+  fclose(f);
+}
+
+static void write_json(const char *path) {
+  struct utsname host;
+  char date[32];
+  time_t t = time(NULL);
+  FILE *f = fopen(path, "w");
+
+  if (f == NULL)
+    die("cannot create", path);
+  uname(&host);
+  strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+  fprintf(f, "{\n  \"version\": \"%s\",\n  \"date\": \"%s\",\n", FSM_VERSION, date);
+  fprintf(f, "  \"host\": {\"name\": \"%s\", \"kernel\": \"%s\", \"cpus\": %ld},\n",
+          host.nodename, host.release, sysconf(_SC_NPROCESSORS_ONLN));
+  fprintf(f, "  \"root\": \"%s\",\n  \"results\": [\n", root);
+  for (int i = 0; i < nresults; i++) {
+    result_t *r = &results[i];
+    fprintf(f,
+            "    {\"tree\": \"%s\", \"op\": \"%s\", \"entries\": %llu, "
+            "\"bytes\": %llu, \"runs\": %d, \"min_s\": %.6f, "
+            "\"median_s\": %.6f, \"max_s\": %.6f}%s\n",
+            r->tree, r->op, (unsigned long long)r->entries,
+            (unsigned long long)r->bytes, r->runs, r->min, r->median, r->max,
+            i + 1 < nresults ? "," : "");
+  }
+  fprintf(f, "  ]\n}\n");
+  fclose(f);
+}
+
+static void usage(void) {
+  fprintf(stderr,
+          "usage: fsm-bench [-d dir] [-s quick|full] [-r runs] [-t tree]... "
+          "[-o prefix]\n"
+          "  -d  where trees are made and worked on (default %s)\n"
+          "  -s  quick skips the trees of a million entries or gigabytes\n"
+          "  -r  runs of each operation, at most %d (default 3)\n"
+          "  -t  only trees whose name contains this; may be repeated\n"
+          "  -o  results go to prefix.csv and prefix.json (default %s)\n",
+          BENCH_DIR, MAX_RUNS, BENCH_OUTPUT);
+  exit(2);
+}
+
+int main(int argc, char **argv) {
+  const char *only[NTREES], *output = BENCH_OUTPUT;
+  char path[PATH_MAX];
+  int nonly = 0, full = 0, c;
+
+  snprintf(root, sizeof(root), "%s", BENCH_DIR);
+  while ((c = getopt(argc, argv, "d:s:r:t:o:")) != -1) {
+    switch (c) {
+      case 'd':
+        snprintf(root, sizeof(root), "%s", optarg);
+        break;
+      case 's':
+        if (strcmp(optarg, "full") != 0 && strcmp(optarg, "quick") != 0)
+          usage();
+        full = strcmp(optarg, "full") == 0;
+        break;
+      case 'r':
+        runs = atoi(optarg);
+        if (runs < 1 || runs > MAX_RUNS)
+          usage();
+        break;
+      case 't':
+        if (nonly < (int)NTREES)
+          only[nonly++] = optarg;
+        break;
+      case 'o':
+        output = optarg;
+        break;
+      default:
+        usage();
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s/trees", root);
+  mkdir(root, 0755);
+  if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    die("cannot create", path);
+  snprintf(path, sizeof(path), "%s/work", root);
+  if (mkdir(path, 0755) < 0 && errno != EEXIST)
+    die("cannot create", path);
+  snprintf(path, sizeof(path), "%s/cache", root);
+  setenv("XDG_CACHE_HOME", path, 1);
+
+  for (size_t i = 0; i < NTREES; i++) {
+    int wanted = nonly == 0;
+    for (int k = 0; k < nonly; k++)
+      wanted |= strstr(trees[i].name, only[k]) != NULL;
+    if (wanted && (full || !trees[i].full))
+      bench_tree(&trees[i]);
+  }
+
+  snprintf(path, sizeof(path), "%s.csv", output);
+  write_csv(path);
+  snprintf(path, sizeof(path), "%s.json", output);
+  write_json(path);
+  fprintf(stderr, "results in %s.csv and %s.json\n", output, output);
+  return 0;
+}
@@ -1,12 +1,6 @@
 #ifndef CONFIG
 #define CONFIG
 
-typedef struct directory_ {
-  char cwd[1000];
-  char *parent_dir;
-  char *files[];
-} directory_t;
-
 #define FILE_OPENER "xdg-open"
 
 #define DIR_COLOR 4
@@ -19,4 +13,190 @@ typedef struct directory_ {
 
 #define KEY_ENTER 10
 
+#define KEY_SORT 'o'
+
+#define KEY_DIRS_FIRST 'f'
+
+#define KEY_DETAILS 'l'
+
+#define DIRCACHE_MAX_DIRS 16
+
+#define DIRENT_BUF_SIZE (256 * 1024)
+
+// Listings with at least DIRLIST_PARALLEL_MIN entries are stat'ed by a pool
+// of DIRLIST_ENRICH_THREADS threads, DIRLIST_ENRICH_CHUNK entries per task.
+// More threads than CPUs pay off when the filesystem is remote.
+#define DIRLIST_PARALLEL_MIN 4096
+
+#define DIRLIST_ENRICH_THREADS 16
+
+#define DIRLIST_ENRICH_CHUNK 512
+
+// One of SORT_NAME, SORT_NATURAL, SORT_SIZE, SORT_MTIME, SORT_EXTENSION.
+#define SORT_DEFAULT_MODE 0
+
+#define SORT_DIRS_FIRST 1
+
+// Threads walking a tree for its size; 0 means one per online CPU.
+#define DU_THREADS 0
+
+// Directory size cache, kept under $XDG_CACHE_HOME/fsm. DUCACHE_SLOTS is the
+// initial number of records and must be a power of two.
+#define DUCACHE_FILE "dusize.cache"
+
+#define DUCACHE_SLOTS 65536
+
+// How often the info pane shows partial totals while a size walk runs, and
+// how long the UI waits for a key before checking for them.
+#define INFO_PROGRESS_MS 100
+
+#define INPUT_POLL_MS 100
+
+// Recursive filename search. The crawl stays on the filesystem of the
+// directory it starts from unless SEARCH_ONE_FILESYSTEM is 0.
+#define KEY_FIND_FILES '/'
+
+#define SEARCH_THREADS 0
+
+#define SEARCH_ONE_FILESYSTEM 1
+
+// Searches stop adding results past this many.
+#define SEARCH_MAX_RESULTS 100000
+
+// Content search ('g'). Files are read GREP_READ_MAX bytes at a time into
+// a buffer. A NUL in the first GREP_BINARY_PROBE bytes marks a file as
+// binary; it is skipped. Matching lines are shown up
+// to GREP_LINE_MAX bytes.
+#define KEY_GREP 'g'
+
+#define GREP_READ_MAX (128 * 1024)
+
+#define GREP_BINARY_PROBE 8192
+
+#define GREP_LINE_MAX 160
+
+// Copies move at most COPY_CHUNK bytes per system call, so that progress
+// and cancellation are noticed; COPY_BUF_SIZE is the buffer used when the
+// kernel cannot copy between the two files itself.
+#define COPY_CHUNK (8 * 1024 * 1024)
+
+#define COPY_BUF_SIZE (1024 * 1024)
+
+// Copies, moves and deletes run as background jobs on JOBS_THREADS
+// workers, at most JOBS_PER_FS at a time on any one filesystem. The job
+// line shows one of them; KEY_NEXT_JOB steps to the next and
+// KEY_CANCEL_JOB cancels the one shown.
+#define KEY_CANCEL_JOB 'x'
+
+#define KEY_NEXT_JOB 'J'
+
+#define JOBS_THREADS 4
+
+#define JOBS_PER_FS 1
+
+// Marked entries: KEY_TOGGLE_MARK marks or unmarks the one under the
+// cursor, KEY_MARK_PATTERN marks those matching a glob ("-glob" unmarks
+// them) and KEY_INVERT_MARKS flips every mark. Copy, move, delete and
+// KEY_CHMOD then act on all of them as one job, JOBS_BATCH_THREADS entries
+// at a time.
+#define KEY_TOGGLE_MARK ' '
+
+#define KEY_MARK_PATTERN '*'
+
+#define KEY_INVERT_MARKS 'i'
+
+#define KEY_CHMOD 'a'
+
+#define JOBS_BATCH_THREADS 4
+
+// Threads removing a tree; 0 means one per online CPU.
+#define RM_THREADS 0
+
+// Where the kernel has io_uring, large listings, size walks, copies and
+// deletes queue their statx, open, read, write, unlink and rename calls on
+// a per-thread ring, up to URING_DEPTH at a time, instead of making them
+// one by one; elsewhere, or with URING_ENABLE 0 or FSM_URING=0 in the
+// environment, they use the thread pools alone. Copies read and write
+// files of up to URING_SMALL_FILE bytes through the ring.
+#define URING_ENABLE 1
+
+#define URING_DEPTH 256
+
+#define URING_SMALL_FILE (64 * 1024)
+
+// Deleting moves an entry into the user's trash: $XDG_DATA_HOME/Trash on
+// the filesystem of the home directory, .fsm-trash-UID at the top of any
+// other. KEY_RESTORE puts the latest one back. The trash keeps the newest
+// entries that fit in TRASH_MAX_BYTES of disk and purges the rest in the
+// background. With TRASH_DELETE 0 entries are removed outright.
+#define TRASH_DELETE 1
+
+#define KEY_RESTORE 'u'
+
+#define TRASH_MAX_BYTES (1024LL * 1024 * 1024)
+
+// File viewer. A NUL in the first VIEW_BINARY_PROBE bytes shows a file as
+// binary. The line index notes where every PAGER_STRIDE-th line starts.
+#define KEY_VIEW_TOP 'g'
+
+#define KEY_VIEW_END 'G'
+
+#define KEY_VIEW_GOTO ':'
+
+#define KEY_VIEW_FOLLOW 'F'
+
+#define VIEW_BINARY_PROBE 8192
+
+#define PAGER_STRIDE 64
+
+// Hex view of binary files. ':' goes to an offset there, and searches read
+// HEX_SEARCH_CHUNK bytes at a time.
+#define KEY_VIEW_SEARCH '/'
+
+#define KEY_VIEW_NEXT 'n'
+
+#define HEX_SEARCH_CHUNK (1024 * 1024)
+
+// File types for the list colours and the info pane, found by
+// FILETYPE_THREADS workers from the first FILETYPE_PROBE bytes of each file
+// on screen. Executables are also coloured by their mode bits.
+#define FILETYPE_COLORS 1
+
+#define FILETYPE_THREADS 2
+
+#define FILETYPE_PROBE 4096
+
+#define FILETYPE_QUEUE 256
+
+#define FILETYPE_CACHE_SLOTS 8192
+
+#define EXEC_COLOR 2
+
+#define IMAGE_COLOR 5
+
+#define MEDIA_COLOR 5
+
+#define ARCHIVE_COLOR 1
+
+#define DOCUMENT_COLOR 3
+
+// Latency overlay, toggled with KEY_OVERLAY: key-to-frame p50/p99 over the
+// last TRACE_LATENCY_SAMPLES key presses, the last frame's spans, and the
+// getdents64/statx calls and allocations it took. Run with FSM_TRACE=file
+// to have the last TRACE_EVENTS spans written there as a Chrome trace on
+// exit. TRACE_COUNT_ALLOCS counts allocations by wrapping malloc().
+#define KEY_OVERLAY 'p'
+
+#define TRACE_LATENCY_SAMPLES 1024
+
+#define TRACE_EVENTS (256 * 1024)
+
+#define TRACE_COUNT_ALLOCS 1
+
+// fsm-bench (make bench) makes its synthetic trees below BENCH_DIR and
+// writes BENCH_OUTPUT.csv and BENCH_OUTPUT.json.
+#define BENCH_DIR "/tmp/fsm-bench"
+
+#define BENCH_OUTPUT "bench-results"
+
 #endif
\ No newline at end of file
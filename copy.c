@@ -0,0 +1,780 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "copy.h"
+#include "du.h"
+#include "uring.h"
+
+// Ways of moving bytes, from the fastest; a file drops to the next one as
+// soon as the current one is refused.
+#define USE_COPY_RANGE 0
+#define USE_SENDFILE 1
+#define USE_READ_WRITE 2
+
+typedef struct copier_ {
+  const copy_options_t *opt;
+  copy_stats_t *stats;
+  char *buf;
+  // Set for a move across filesystems: every entry is made durable at the
+  // destination and then removed from the source.
+  int move;
+  // The top destination directory, which must not be copied into itself
+  // when it lies inside the source.
+  dev_t dst_dev;
+  ino_t dst_ino;
+  int have_dst;
+} copier_t;
+
+static int cancelled(const copier_t *c) {
+  return c->opt->cancel != NULL &&
+         __atomic_load_n(c->opt->cancel, __ATOMIC_RELAXED);
+}
+
+static void report(copier_t *c) {
+  if (c->opt->progress != NULL)
+    c->opt->progress(c->stats, c->opt->progress_arg);
+}
+
+static int write_all(int fd, const char *p, size_t n, off_t off) {
+  while (n > 0) {
+    ssize_t w = pwrite(fd, p, n, off);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p += w;
+    n -= w;
+    off += w;
+  }
+  return 0;
+}
+
+// Copies bytes [off, end) of in to the same offsets in out.
+static int copy_range(copier_t *c, int in, int out, off_t off, off_t end, int *how) {
+  while (off < end) {
+    size_t want = end - off > COPY_CHUNK ? COPY_CHUNK : end - off;
+    ssize_t n;
+
+    if (cancelled(c)) {
+      errno = ECANCELED;
+      return -1;
+    }
+    if (*how == USE_COPY_RANGE) {
+      loff_t from = off, to = off;
+      n = copy_file_range(in, &from, out, &to, want, 0);
+      if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL ||
+                    errno == EOPNOTSUPP || errno == EBADF)) {
+        *how = USE_SENDFILE;
+        continue;
+      }
+    } else if (*how == USE_SENDFILE) {
+      off_t from = off;
+      if (lseek(out, off, SEEK_SET) < 0)
+        return -1;
+      n = sendfile(out, in, &from, want);
+      if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+        *how = USE_READ_WRITE;
+        continue;
+      }
+    } else {
+      if (c->buf == NULL && posix_memalign((void **)&c->buf, 4096, COPY_BUF_SIZE) != 0) {
+        c->buf = NULL;
+        errno = ENOMEM;
+        return -1;
+      }
+      if (want > COPY_BUF_SIZE)
+        want = COPY_BUF_SIZE;
+      n = pread(in, c->buf, want, off);
+      if (n > 0 && write_all(out, c->buf, n, off) < 0)
+        return -1;
+    }
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    // The source shrank under us; copy what there was.
+    if (n == 0)
+      break;
+    off += n;
+    c->stats->bytes += n;
+    report(c);
+  }
+  return 0;
+}
+
+// Copies the contents of in to the empty file out. Only files with fewer
+// blocks than their size can have holes, so only those are walked extent
+// by extent.
+static int copy_data(copier_t *c, int in, int out, const struct stat *st) {
+  int how = USE_COPY_RANGE;
+  off_t size = st->st_size;
+  uint64_t before = c->stats->bytes;
+
+  if (size == 0)
+    return 0;
+  if (ioctl(out, FICLONE, in) == 0) {
+    c->stats->bytes += size;
+    report(c);
+    return 0;
+  }
+  if ((off_t)st->st_blocks * 512 < size) {
+    off_t data = 0, hole;
+    while ((data = lseek(in, data, SEEK_DATA)) >= 0 && data < size) {
+      hole = lseek(in, data, SEEK_HOLE);
+      if (hole < 0 || hole > size)
+        hole = size;
+      if (copy_range(c, in, out, data, hole, &how) < 0)
+        return -1;
+      data = hole;
+    }
+    // ENXIO means no data past the last offset; anything else means the
+    // filesystem cannot tell, so copy everything.
+    if (data >= 0 || errno == ENXIO) {
+      // The holes were skipped, which counts as copying them.
+      c->stats->bytes = before + size;
+      report(c);
+      return ftruncate(out, size);
+    }
+  }
+  return copy_range(c, in, out, 0, size, &how);
+}
+
+static void copy_attrs(int fd, const struct stat *st) {
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  fchmod(fd, st->st_mode & 07777);
+  futimens(fd, times);
+}
+
+static int copy_entry(copier_t *c, int sdir, const char *sname, int ddir,
+                      const char *dname, const struct stat *st);
+
+static int copy_file(copier_t *c, int sdir, const char *sname, int ddir,
+                     const char *dname, const struct stat *st) {
+  char part[NAME_MAX + 1];
+  const char *name = dname;
+  struct stat dst;
+  int in, out, rc;
+
+  // A moved file is written under a temporary name and renamed into place
+  // once synced, so an interrupted move never leaves a partial file under
+  // the real name.
+  if (c->move && snprintf(part, sizeof(part), ".%s.fsm-part", dname) < (int)sizeof(part))
+    name = part;
+  // Truncating the destination must never destroy the source.
+  if (fstatat(ddir, dname, &dst, 0) == 0 && dst.st_dev == st->st_dev &&
+      dst.st_ino == st->st_ino) {
+    errno = EINVAL;
+    return -1;
+  }
+  in = openat(sdir, sname, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (in < 0)
+    return -1;
+  out = openat(ddir, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (out < 0) {
+    close(in);
+    return -1;
+  }
+  rc = copy_data(c, in, out, st);
+  if (rc == 0)
+    copy_attrs(out, st);
+  if (rc == 0 && c->move && fsync(out) < 0)
+    rc = -1;
+  if (close(out) < 0)
+    rc = -1;
+  close(in);
+  if (rc == 0 && name != dname && renameat(ddir, name, ddir, dname) < 0)
+    rc = -1;
+  // Never leave a truncated copy behind, cancelled or not.
+  if (rc < 0) {
+    int err = errno;
+    unlinkat(ddir, name, 0);
+    errno = err;
+  } else {
+    c->stats->files++;
+  }
+  return rc;
+}
+
+static int copy_symlink(copier_t *c, int sdir, const char *sname, int ddir,
+                        const char *dname, const struct stat *st) {
+  char target[PATH_MAX];
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+  ssize_t n = readlinkat(sdir, sname, target, sizeof(target) - 1);
+
+  if (n < 0)
+    return -1;
+  target[n] = '\0';
+  if (symlinkat(target, ddir, dname) < 0) {
+    // Replace a file or link, as for regular files; never a directory.
+    if (errno != EEXIST || unlinkat(ddir, dname, 0) < 0 ||
+        symlinkat(target, ddir, dname) < 0)
+      return -1;
+  }
+  utimensat(ddir, dname, times, AT_SYMLINK_NOFOLLOW);
+  c->stats->bytes += st->st_size;
+  c->stats->files++;
+  return 0;
+}
+
+// Names of the entries of one directory moved so far, removed from the
+// source once their copies are durable, as [is_dir byte][name NUL]. c and
+// dir, the source directory, are set for the removal.
+typedef struct moved_ {
+  char *buf;
+  size_t len, cap;
+  copier_t *c;
+  int dir;
+} moved_t;
+
+static void note_moved(copier_t *c, moved_t *m, const char *name, int is_dir) {
+  size_t n = strlen(name) + 2;
+  if (m->len + n > m->cap) {
+    size_t cap = m->cap ? m->cap * 2 : 4096;
+    while (cap < m->len + n)
+      cap *= 2;
+    char *p = realloc(m->buf, cap);
+    if (p == NULL) {
+      c->stats->errors++;
+      return;
+    }
+    m->buf = p;
+    m->cap = cap;
+  }
+  m->buf[m->len] = is_dir;
+  memcpy(m->buf + m->len + 1, name, n - 1);
+  m->len += n;
+}
+
+// Copies the entry name of in into out. Returns -1 only when cancelled;
+// other failures are counted.
+static int copy_child(copier_t *c, int in, int out, const char *name,
+                      const struct stat *child, moved_t *m) {
+  if (S_ISDIR(child->st_mode) && child->st_dev == c->dst_dev &&
+      child->st_ino == c->dst_ino)
+    return 0;
+  if (copy_entry(c, in, name, out, name, child) < 0) {
+    if (errno == ECANCELED)
+      return -1;
+    c->stats->errors++;
+    return 0;
+  }
+  if (c->move)
+    note_moved(c, m, name, S_ISDIR(child->st_mode));
+  return 0;
+}
+
+// Steps of a small file copied through the ring, kept in the low bits of
+// each request's tag above the entry index.
+#define STEP_OPEN_IN 0
+#define STEP_OPEN_OUT 1
+#define STEP_READ 2
+#define STEP_WRITE 3
+#define STEP_FSYNC 4
+#define STEP_CLOSE 5
+#define STEP_RENAME 6
+#define STEP_BITS 3
+
+#define TAG(i, step) (((uint64_t)(i) << STEP_BITS) | (step))
+
+typedef struct batch_file_ {
+  int in, out;
+  // Requests in flight; the next step starts when they are all done.
+  int ops;
+  int err;
+  int small, created, done;
+  // Set when the file turned out to have changed size since it was
+  // stat'ed; it is then copied again by copy_entry().
+  int eof, retry;
+  size_t off, got;
+} batch_file_t;
+
+// Up to URING_DEPTH entries of a directory copied through the ring: they
+// are stat'ed together, then the small regular files among them are copied
+// together, each opened, read whole into c->buf, written, closed and (for
+// a move) synced and renamed into place, all as queued requests. Every
+// other entry goes through copy_entry() as without a ring.
+typedef struct copy_batch_ {
+  copier_t *c;
+  uring_t *ring;
+  int in, out;
+  // Set when the destination directory was made by this copy, so no file
+  // in it can be the source or need replacing.
+  int fresh;
+  int n, active;
+  size_t names_len, buf_used;
+  uint32_t name_off[URING_DEPTH];
+  char names[URING_DEPTH * (NAME_MAX + 1)];
+  char parts[URING_DEPTH][NAME_MAX + 1];
+  struct stat st[URING_DEPTH];
+  batch_file_t files[URING_DEPTH];
+} copy_batch_t;
+
+static void stat_from_statx(struct stat *st, const struct statx *stx) {
+  memset(st, 0, sizeof(*st));
+  st->st_dev = makedev(stx->stx_dev_major, stx->stx_dev_minor);
+  st->st_ino = stx->stx_ino;
+  st->st_mode = stx->stx_mode;
+  st->st_nlink = stx->stx_nlink;
+  st->st_uid = stx->stx_uid;
+  st->st_gid = stx->stx_gid;
+  st->st_size = stx->stx_size;
+  st->st_blocks = stx->stx_blocks;
+  st->st_atim.tv_sec = stx->stx_atime.tv_sec;
+  st->st_atim.tv_nsec = stx->stx_atime.tv_nsec;
+  st->st_mtim.tv_sec = stx->stx_mtime.tv_sec;
+  st->st_mtim.tv_nsec = stx->stx_mtime.tv_nsec;
+}
+
+static void batch_stat_done(void *arg, uint64_t tag, int res, const struct statx *stx) {
+  copy_batch_t *b = arg;
+
+  if (res < 0)
+    b->files[tag].err = -res;
+  else
+    stat_from_statx(&b->st[tag], stx);
+}
+
+static const char *batch_name(const copy_batch_t *b, int i) {
+  return b->names + b->name_off[i];
+}
+
+static const char *batch_target(const copy_batch_t *b, int i) {
+  return b->c->move ? b->parts[i] : batch_name(b, i);
+}
+
+// Ends the copy of small file i, removing whatever it left behind on
+// failure, as copy_file() does.
+static void small_finish(copy_batch_t *b, int i) {
+  batch_file_t *f = &b->files[i];
+
+  if (f->err != 0) {
+    if (f->in >= 0)
+      close(f->in);
+    if (f->out >= 0)
+      close(f->out);
+    if (f->created)
+      unlinkat(b->out, batch_target(b, i), 0);
+  } else {
+    b->c->stats->files++;
+    report(b->c);
+  }
+  f->in = f->out = -1;
+  f->done = 1;
+  b->active--;
+}
+
+// Queues the next step of small file i after step has completed.
+static void small_step(copy_batch_t *b, int i, int step) {
+  batch_file_t *f = &b->files[i];
+  const struct stat *st = &b->st[i];
+  uring_t *r = b->ring;
+
+  if (f->err != 0) {
+    small_finish(b, i);
+    return;
+  }
+  switch (step) {
+    case STEP_OPEN_IN:
+    case STEP_OPEN_OUT:
+    case STEP_READ:
+      // One byte more than the size is asked for, so that a file that grew
+      // shows up, and a short read goes on from where it stopped.
+      if (f->got > (size_t)st->st_size || (f->eof && f->got < (size_t)st->st_size)) {
+        f->retry = 1;
+        f->err = EAGAIN;
+        small_finish(b, i);
+        return;
+      }
+      if (step != STEP_READ || f->got < (size_t)st->st_size) {
+        f->ops = 1;
+        uring_read(r, f->in, b->c->buf + f->off + f->got, st->st_size + 1 - f->got, f->got,
+                   TAG(i, STEP_READ));
+        return;
+      }
+      if (f->got > 0) {
+        f->ops = 1;
+        uring_write(r, f->out, b->c->buf + f->off, f->got, 0, TAG(i, STEP_WRITE));
+        return;
+      }
+      /* fall through */
+    case STEP_WRITE:
+      b->c->stats->bytes += f->got;
+      copy_attrs(f->out, st);
+      if (b->c->move) {
+        f->ops = 1;
+        uring_fsync(r, f->out, TAG(i, STEP_FSYNC));
+        return;
+      }
+      /* fall through */
+    case STEP_FSYNC:
+      f->ops = 2;
+      uring_close(r, f->in, TAG(i, STEP_CLOSE));
+      uring_close(r, f->out, TAG(i, STEP_CLOSE));
+      f->in = f->out = -1;
+      return;
+    case STEP_CLOSE:
+      if (b->c->move) {
+        f->ops = 1;
+        uring_renameat(r, b->out, b->parts[i], b->out, batch_name(b, i),
+                       TAG(i, STEP_RENAME));
+        return;
+      }
+      /* fall through */
+    case STEP_RENAME:
+      small_finish(b, i);
+  }
+}
+
+static void small_done(void *arg, uint64_t tag, int res, const struct statx *stx) {
+  copy_batch_t *b = arg;
+  int i = tag >> STEP_BITS, step = tag & ((1 << STEP_BITS) - 1);
+  batch_file_t *f = &b->files[i];
+
+  // Dropped by a ring that failed: the file is copied again without it.
+  if (res == -ECANCELED)
+    f->retry = 1;
+  if (res < 0 && f->err == 0)
+    f->err = -res;
+  if (res >= 0) {
+    if (step == STEP_OPEN_IN)
+      f->in = res;
+    else if (step == STEP_OPEN_OUT)
+      f->out = res, f->created = 1;
+    else if (step == STEP_READ)
+      f->got += res, f->eof = res == 0;
+    else if (step == STEP_WRITE && (size_t)res != f->got && f->err == 0)
+      f->err = ENOSPC;
+  }
+  if (--f->ops == 0)
+    small_step(b, i, step);
+}
+
+// Copies the small regular files of the batch through the ring, at most
+// half as many at a time as there are slots, since each holds up to two.
+static void copy_small(copy_batch_t *b) {
+  copier_t *c = b->c;
+  int failed = 0;
+
+  for (int i = 0; i < b->n && !failed; i++) {
+    batch_file_t *f = &b->files[i];
+    const struct stat *st = &b->st[i];
+
+    f->small = f->err == 0 && b->fresh && S_ISREG(st->st_mode) &&
+               st->st_size <= URING_SMALL_FILE && !cancelled(c) &&
+               (!c->move || snprintf(b->parts[i], sizeof(b->parts[i]), ".%s.fsm-part",
+                                     batch_name(b, i)) < (int)sizeof(b->parts[i]));
+    if (!f->small)
+      continue;
+    while (b->active > 0 && (b->active * 2 + 2 > URING_DEPTH ||
+                             b->buf_used + st->st_size + 1 > COPY_BUF_SIZE)) {
+      if (uring_wait(b->ring, 1, small_done, b) < 0) {
+        f->small = 0;
+        failed = 1;
+        break;
+      }
+      if (b->active == 0)
+        b->buf_used = 0;
+    }
+    if (failed)
+      break;
+    f->in = f->out = -1;
+    f->ops = 2;
+    f->off = b->buf_used;
+    b->buf_used += st->st_size + 1;
+    b->active++;
+    uring_openat(b->ring, b->in, batch_name(b, i), O_RDONLY | O_NOFOLLOW | O_CLOEXEC,
+                 0, TAG(i, STEP_OPEN_IN));
+    uring_openat(b->ring, b->out, batch_target(b, i),
+                 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600, TAG(i, STEP_OPEN_OUT));
+  }
+  if (failed || uring_drain(b->ring, small_done, b) < 0) {
+    // The ring failed. Files it left unfinished are removed, which is safe
+    // in a directory this copy made, and copied again without it.
+    for (int i = 0; i < b->n; i++) {
+      batch_file_t *f = &b->files[i];
+      if (f->small && !f->done) {
+        f->retry = f->created = 1;
+        f->err = ECANCELED;
+        small_finish(b, i);
+      }
+    }
+    b->ring = NULL;
+  }
+  b->buf_used = 0;
+}
+
+// Copies the entries collected in b, in order. Returns -1 when cancelled.
+static int copy_batch(copy_batch_t *b, moved_t *m) {
+  copier_t *c = b->c;
+  int rc = 0;
+
+  // Taken afresh, since a ring that failed in a subdirectory is replaced.
+  b->ring = uring_get();
+  if (b->ring != NULL) {
+    for (int i = 0; i < b->n; i++)
+      uring_statx(b->ring, b->in, batch_name(b, i), AT_SYMLINK_NOFOLLOW,
+                  STATX_BASIC_STATS, i);
+    if (uring_drain(b->ring, batch_stat_done, b) < 0)
+      b->ring = NULL;
+  }
+  if (b->ring == NULL) {
+    for (int i = 0; i < b->n; i++)
+      b->files[i].err = fstatat(b->in, batch_name(b, i), &b->st[i],
+                                AT_SYMLINK_NOFOLLOW) < 0 ? errno : 0;
+  } else if (c->buf != NULL || posix_memalign((void **)&c->buf, 4096, COPY_BUF_SIZE) == 0) {
+    copy_small(b);
+  } else {
+    c->buf = NULL;
+  }
+  for (int i = 0; i < b->n && rc == 0; i++) {
+    batch_file_t *f = &b->files[i];
+    if (f->retry) {
+      f->small = 0;
+      f->err = fstatat(b->in, batch_name(b, i), &b->st[i], AT_SYMLINK_NOFOLLOW) < 0 ? errno : 0;
+    }
+    if (f->err != 0)
+      c->stats->errors++;
+    else if (f->small && c->move)
+      note_moved(c, m, batch_name(b, i), 0);
+    else if (!f->small)
+      rc = copy_child(c, b->in, b->out, batch_name(b, i), &b->st[i], m);
+  }
+  b->n = 0;
+  b->names_len = 0;
+  return rc;
+}
+
+// Adds name to b, copying the batch once it is full. Returns -1 when
+// cancelled.
+static int batch_add(copy_batch_t *b, const char *name, moved_t *m) {
+  size_t n = strlen(name) + 1;
+
+  b->name_off[b->n] = b->names_len;
+  memcpy(b->names + b->names_len, name, n);
+  b->names_len += n;
+  memset(&b->files[b->n], 0, sizeof(batch_file_t));
+  b->files[b->n].in = b->files[b->n].out = -1;
+  b->n++;
+  return b->n == URING_DEPTH ? copy_batch(b, m) : 0;
+}
+
+// Completion of an unlinkat removing a moved original; the tag is the
+// offset of its name in m->buf.
+static void moved_done(void *arg, uint64_t tag, int res, const struct statx *stx) {
+  moved_t *m = arg;
+
+  // Dropped by a ring that failed; made here instead.
+  if (res == -ECANCELED)
+    res = unlinkat(m->dir, m->buf + tag, m->buf[tag - 1] ? AT_REMOVEDIR : 0) == 0 ? 0 : -errno;
+  if (res < 0 && res != -ENOTEMPTY)
+    m->c->stats->errors++;
+}
+
+static int copy_dir(copier_t *c, int sdir, const char *sname, int ddir,
+                    const char *dname, const struct stat *st) {
+  struct stat dst;
+  struct dirent *e;
+  moved_t moved = {0};
+  copy_batch_t *b = NULL;
+  uring_t *ring;
+  DIR *d;
+  int in, out, fresh;
+
+  fresh = mkdirat(ddir, dname, 0700) == 0;
+  if (!fresh && errno != EEXIST)
+    return -1;
+  out = openat(ddir, dname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (out < 0)
+    return -1;
+  if (fstat(out, &dst) < 0 || (dst.st_dev == st->st_dev && dst.st_ino == st->st_ino)) {
+    close(out);
+    errno = EINVAL;
+    return -1;
+  }
+  if (!c->have_dst) {
+    c->dst_dev = dst.st_dev;
+    c->dst_ino = dst.st_ino;
+    c->have_dst = 1;
+  }
+  in = openat(sdir, sname, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (in < 0 || (d = fdopendir(in)) == NULL) {
+    if (in >= 0)
+      close(in);
+    close(out);
+    return -1;
+  }
+  // Each level has a batch of its own, since copying a subdirectory in it
+  // starts another.
+  if ((ring = uring_get()) != NULL && (b = malloc(sizeof(copy_batch_t))) != NULL) {
+    b->c = c;
+    b->ring = ring;
+    b->in = in;
+    b->out = out;
+    b->fresh = fresh;
+    b->n = b->active = 0;
+    b->names_len = b->buf_used = 0;
+  }
+  while ((e = readdir(d)) != NULL) {
+    struct stat child;
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+      continue;
+    if (b != NULL) {
+      if (batch_add(b, e->d_name, &moved) < 0)
+        break;
+      continue;
+    }
+    if (fstatat(in, e->d_name, &child, AT_SYMLINK_NOFOLLOW) < 0) {
+      c->stats->errors++;
+      continue;
+    }
+    if (copy_child(c, in, out, e->d_name, &child, &moved) < 0)
+      break;
+  }
+  if (b != NULL && b->n > 0 && !cancelled(c))
+    copy_batch(b, &moved);
+  free(b);
+  // One sync makes every entry created here durable; only then are the
+  // originals removed. A subdirectory with entries that failed to move is
+  // left behind with them.
+  if (moved.len > 0 && fsync(out) == 0) {
+    ring = uring_get();
+    moved.c = c;
+    moved.dir = in;
+    for (size_t off = 0; off < moved.len;) {
+      const char *name = moved.buf + off + 1;
+      int flags = moved.buf[off] ? AT_REMOVEDIR : 0;
+      off += strlen(name) + 2;
+      if (ring != NULL) {
+        while (ring != NULL && uring_unlinkat(ring, in, name, flags, name - moved.buf) < 0)
+          if (uring_wait(ring, 1, moved_done, &moved) < 0)
+            ring = NULL;
+        if (ring != NULL)
+          continue;
+      }
+      if (unlinkat(in, name, flags) < 0 && errno != ENOTEMPTY)
+        c->stats->errors++;
+    }
+    if (ring != NULL)
+      uring_drain(ring, moved_done, &moved);
+  }
+  free(moved.buf);
+  closedir(d);
+  // Last, since creating the entries changed the times.
+  copy_attrs(out, st);
+  close(out);
+  // bytes_total comes from du_walk(), which counts directories too.
+  c->stats->bytes += st->st_size;
+  c->stats->dirs++;
+  if (cancelled(c)) {
+    errno = ECANCELED;
+    return -1;
+  }
+  return 0;
+}
+
+static int copy_entry(copier_t *c, int sdir, const char *sname, int ddir,
+                      const char *dname, const struct stat *st) {
+  if (S_ISREG(st->st_mode))
+    return copy_file(c, sdir, sname, ddir, dname, st);
+  if (S_ISDIR(st->st_mode))
+    return copy_dir(c, sdir, sname, ddir, dname, st);
+  if (S_ISLNK(st->st_mode))
+    return copy_symlink(c, sdir, sname, ddir, dname, st);
+  if (S_ISFIFO(st->st_mode)) {
+    if (mkfifoat(ddir, dname, st->st_mode & 07777) < 0 &&
+        (errno != EEXIST || unlinkat(ddir, dname, 0) < 0 ||
+         mkfifoat(ddir, dname, st->st_mode & 07777) < 0))
+      return -1;
+    c->stats->files++;
+    return 0;
+  }
+  // Devices and sockets are not copied.
+  errno = ENOTSUP;
+  return -1;
+}
+
+static int transfer(const char *src, const char *dst, const copy_options_t *opt,
+                    copy_stats_t *stats, int move) {
+  static const copy_options_t defaults = {0};
+  char sbuf[PATH_MAX], dbuf[PATH_MAX], sname[NAME_MAX + 1], dname[NAME_MAX + 1];
+  copy_stats_t local;
+  copier_t c = {0};
+  struct stat st;
+  int sdir = -1, ddir = -1, rc = -1;
+
+  if (stats == NULL)
+    stats = &local;
+  memset(stats, 0, sizeof(*stats));
+  c.opt = opt != NULL ? opt : &defaults;
+  c.stats = stats;
+  c.move = move;
+  if (lstat(src, &st) < 0)
+    return -1;
+  if (c.opt->progress != NULL) {
+    du_result_t total;
+    du_options_t du = {0};
+    du.use_cache = 1;
+    du.cancel = c.opt->cancel;
+    if (S_ISDIR(st.st_mode) && du_walk(src, &du, &total) == 0)
+      stats->bytes_total = total.bytes;
+    else
+      stats->bytes_total = st.st_size;
+    report(&c);
+  }
+  // Work relative to the two parent directories, as for every level below.
+  snprintf(sbuf, sizeof(sbuf), "%s", src);
+  snprintf(sname, sizeof(sname), "%s", basename(sbuf));
+  snprintf(sbuf, sizeof(sbuf), "%s", src);
+  sdir = open(dirname(sbuf), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  snprintf(dbuf, sizeof(dbuf), "%s", dst);
+  snprintf(dname, sizeof(dname), "%s", basename(dbuf));
+  snprintf(dbuf, sizeof(dbuf), "%s", dst);
+  ddir = open(dirname(dbuf), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (sdir < 0 || ddir < 0)
+    goto out;
+  rc = copy_entry(&c, sdir, sname, ddir, dname, &st);
+  if (rc == 0 && move && fsync(ddir) == 0 &&
+      unlinkat(sdir, sname, S_ISDIR(st.st_mode) ? AT_REMOVEDIR : 0) < 0 &&
+      errno != ENOTEMPTY)
+    stats->errors++;
+  if (rc == 0)
+    report(&c);
+out:
+  if (sdir >= 0)
+    close(sdir);
+  if (ddir >= 0)
+    close(ddir);
+  free(c.buf);
+  return rc;
+}
+
+int copy_tree(const char *src, const char *dst, const copy_options_t *opt,
+              copy_stats_t *stats) {
+  return transfer(src, dst, opt, stats, 0);
+}
+
+int move_tree(const char *src, const char *dst, const copy_options_t *opt,
+              copy_stats_t *stats) {
+  if (stats != NULL)
+    memset(stats, 0, sizeof(*stats));
+  if (rename(src, dst) == 0)
+    return 0;
+  if (errno != EXDEV)
+    return -1;
+  return transfer(src, dst, opt, stats, 1);
+}
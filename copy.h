@@ -0,0 +1,44 @@
+#ifndef COPY_H
+#define COPY_H
+
+#include <stdint.h>
+
+// What a copy has done so far. bytes_total is the apparent size of the
+// source tree, known once the copy has started.
+typedef struct copy_stats_ {
+  uint64_t bytes, bytes_total;
+  uint64_t files, dirs;
+  uint64_t errors;
+} copy_stats_t;
+
+typedef struct copy_options_ {
+  // Polled between chunks; once non-zero the copy stops with ECANCELED.
+  const int *cancel;
+  // Called from the copying thread after every chunk of at most
+  // COPY_CHUNK bytes, and once more at the end.
+  void (*progress)(const copy_stats_t *stats, void *arg);
+  void *progress_arg;
+} copy_options_t;
+
+// Copies src to dst, which must not be src itself or inside it. Files are
+// cloned with FICLONE where the filesystem shares extents, and otherwise
+// copied with copy_file_range(), sendfile() or, as a last resort, read()
+// and write() through an aligned buffer; holes found with SEEK_DATA and
+// SEEK_HOLE stay holes. An existing file at dst is overwritten. Directories
+// are copied recursively, merging into an existing directory; symlinks are
+// recreated, not followed. Mode and timestamps are kept. Returns -1 with
+// errno set if src cannot be copied at all; failures below it only bump
+// stats->errors. stats may be NULL.
+int copy_tree(const char *src, const char *dst, const copy_options_t *opt,
+              copy_stats_t *stats);
+
+// Moves src to dst. Within one filesystem this is a rename(). Across
+// filesystems every entry is copied as by copy_tree(), files through a
+// temporary name, and synced; each directory's originals are removed only
+// after a sync of the directory holding their copies. Entries that fail
+// stay at src. An interrupted move can be rerun: what was moved is gone
+// from src and the rest is merged into dst.
+int move_tree(const char *src, const char *dst, const copy_options_t *opt,
+              copy_stats_t *stats);
+
+#endif
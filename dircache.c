@@ -0,0 +1,160 @@
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dircache.h"
+#include "sort.h"
+
+#define WATCH_MASK                                                  \
+  (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ATTRIB | \
+   IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+static int inotify_fd = -1;
+static dir_listing_t cache[DIRCACHE_MAX_DIRS];
+static int cache_used = 0;
+static unsigned long use_clock = 0;
+
+static int watch_shared(dir_listing_t *l) {
+  for (int i = 0; i < cache_used; i++)
+    if (&cache[i] != l && cache[i].wd == l->wd)
+      return 1;
+  return 0;
+}
+
+static void release(dir_listing_t *l) {
+  // Two paths naming the same directory share one watch descriptor.
+  if (l->wd >= 0 && inotify_fd >= 0 && !watch_shared(l))
+    inotify_rm_watch(inotify_fd, l->wd);
+  dir_listing_clear(l);
+  free(l->path);
+  dir_listing_init(l, NULL);
+}
+
+static dir_listing_t *find_listing(const char *path) {
+  for (int i = 0; i < cache_used; i++)
+    if (cache[i].path != NULL && strcmp(cache[i].path, path) == 0)
+      return &cache[i];
+  return NULL;
+}
+
+// Picks a free cache entry, evicting the least recently used one if full.
+static dir_listing_t *claim_listing(void) {
+  for (int i = 0; i < cache_used; i++)
+    if (cache[i].path == NULL)
+      return &cache[i];
+  if (cache_used < DIRCACHE_MAX_DIRS) {
+    dir_listing_t *l = &cache[cache_used++];
+    dir_listing_init(l, NULL);
+    return l;
+  }
+  dir_listing_t *victim = &cache[0];
+  for (int i = 1; i < cache_used; i++)
+    if (cache[i].last_use < victim->last_use)
+      victim = &cache[i];
+  release(victim);
+  return victim;
+}
+
+int dircache_init(void) {
+  inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  return inotify_fd < 0 ? -1 : 0;
+}
+
+int dircache_fd(void) { return inotify_fd; }
+
+static void apply_event(dir_listing_t *l, struct inotify_event *ev) {
+  if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED)) {
+    l->stale = 1;
+    if (ev->mask & IN_IGNORED)
+      l->wd = -1;
+    return;
+  }
+  if (l->stale || ev->len == 0)
+    return;
+  if (ev->mask & (IN_ATTRIB | IN_CLOSE_WRITE)) {
+    dir_listing_touch(l, ev->name);
+    // Size and mtime orders depend on the metadata that just changed.
+    if (l->sort_mode == SORT_SIZE || l->sort_mode == SORT_MTIME)
+      l->sorted = 0;
+  }
+  if (ev->mask & (IN_DELETE | IN_MOVED_FROM))
+    dir_listing_remove(l, ev->name);
+  if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+    unsigned char d_type = (ev->mask & IN_ISDIR) ? DT_DIR : DT_UNKNOWN;
+    if (dir_listing_add(l, ev->name, d_type) < 0)
+      l->stale = 1;
+  }
+}
+
+void dircache_poll(void) {
+  char buf[64 * 1024]
+      __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t n;
+
+  if (inotify_fd < 0)
+    return;
+  while ((n = read(inotify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *ev = (struct inotify_event *)p;
+      p += sizeof(struct inotify_event) + ev->len;
+
+      if (ev->mask & IN_Q_OVERFLOW) {
+        // Events were lost; only a rescan can tell what changed.
+        for (int i = 0; i < cache_used; i++)
+          cache[i].stale = 1;
+        continue;
+      }
+      for (int i = 0; i < cache_used; i++)
+        if (cache[i].path != NULL && cache[i].wd == ev->wd)
+          apply_event(&cache[i], ev);
+    }
+  }
+}
+
+dir_listing_t *dircache_get(const char *path) {
+  dircache_poll();
+
+  dir_listing_t *l = find_listing(path);
+  if (l == NULL) {
+    char *copy = strdup(path);
+    if (copy == NULL)
+      return NULL;
+    l = claim_listing();
+    dir_listing_init(l, copy);
+    l->stale = 1;
+  }
+  l->last_use = ++use_clock;
+
+  if (l->wd < 0) {
+    // Without a watch the listing cannot be trusted past this call.
+    if (inotify_fd >= 0)
+      l->wd = inotify_add_watch(inotify_fd, path, WATCH_MASK);
+    l->stale = 1;
+  }
+  if (l->stale) {
+    if (dir_listing_read(l) < 0) {
+      release(l);
+      return NULL;
+    }
+    l->stale = l->wd < 0;
+  }
+  return l;
+}
+
+void dircache_invalidate(const char *path) {
+  dir_listing_t *l = find_listing(path);
+  if (l != NULL)
+    l->stale = 1;
+}
+
+void dircache_shutdown(void) {
+  for (int i = 0; i < cache_used; i++)
+    release(&cache[i]);
+  cache_used = 0;
+  if (inotify_fd >= 0)
+    close(inotify_fd);
+  inotify_fd = -1;
+}
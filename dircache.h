@@ -0,0 +1,26 @@
+#ifndef DIRCACHE_H
+#define DIRCACHE_H
+
+#include "dirlist.h"
+
+// Opens the inotify instance backing the cache. Without it every lookup
+// falls back to a full rescan.
+int dircache_init(void);
+
+// Returns the listing for path, scanning it on a cold visit and applying
+// pending inotify updates on a warm one. Returns NULL if the directory cannot
+// be read.
+dir_listing_t *dircache_get(const char *path);
+
+// Drains the inotify queue and applies the events to the cached listings.
+void dircache_poll(void);
+
+// Forces the next dircache_get() of path to rescan it.
+void dircache_invalidate(const char *path);
+
+// File descriptor to poll() on for pending updates, or -1.
+int dircache_fd(void);
+
+void dircache_shutdown(void);
+
+#endif
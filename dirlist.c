@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "dirlist.h"
+#include "pool.h"
+#include "trace.h"
+#include "uring.h"
+
+#define SLOT_EMPTY 0
+#define SLOT_DELETED -1
+
+#define META_BYTES (3 * sizeof(uint64_t) + sizeof(uint32_t) + sizeof(uint16_t))
+
+static uint32_t hash_name(const char *name) {
+  uint32_t h = 2166136261u;
+  while (*name) {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Finds the slot holding name, or -1 when it is not in the listing.
+static long find_slot(const dir_listing_t *l, const char *name) {
+  if (l->nslots == 0)
+    return -1;
+  size_t mask = l->nslots - 1;
+  size_t i = hash_name(name) & mask;
+  while (l->slots[i] != SLOT_EMPTY) {
+    if (l->slots[i] > 0 &&
+        strcmp(dir_listing_name(l, l->slots[i] - 1), name) == 0)
+      return (long)i;
+    i = (i + 1) & mask;
+  }
+  return -1;
+}
+
+static void insert_slot(dir_listing_t *l, int index) {
+  size_t mask = l->nslots - 1;
+  size_t i = hash_name(dir_listing_name(l, index)) & mask;
+  while (l->slots[i] > 0)
+    i = (i + 1) & mask;
+  if (l->slots[i] == SLOT_DELETED)
+    l->slots_dead--;
+  l->slots[i] = index + 1;
+}
+
+// Rebuilds the name index sized for the current number of entries.
+static int rehash(dir_listing_t *l) {
+  size_t n = 64;
+  while (n < (size_t)l->len * 2 + 2)
+    n <<= 1;
+  int *slots = calloc(n, sizeof(int));
+  if (slots == NULL)
+    return -1;
+  free(l->slots);
+  l->slots = slots;
+  l->nslots = n;
+  l->slots_dead = 0;
+  for (int i = 0; i < l->len; i++)
+    insert_slot(l, i);
+  return 0;
+}
+
+// Moves the metadata columns to an allocation for cap entries, keeping the
+// rows of the current entries.
+static int resize_meta(dir_listing_t *l, int cap) {
+  char *block = malloc(cap * META_BYTES);
+  dir_columns_t m;
+
+  if (block == NULL)
+    return -1;
+  // Widest first, so that every column is aligned.
+  m.size = (uint64_t *)block;
+  m.mtime = (int64_t *)(block + cap * sizeof(uint64_t));
+  m.ino = (uint64_t *)(block + cap * 2 * sizeof(uint64_t));
+  m.dev = (uint32_t *)(block + cap * 3 * sizeof(uint64_t));
+  m.mode = (uint16_t *)(block + cap * (3 * sizeof(uint64_t) + sizeof(uint32_t)));
+  if (l->meta.size != NULL) {
+    memcpy(m.size, l->meta.size, l->len * sizeof(uint64_t));
+    memcpy(m.mtime, l->meta.mtime, l->len * sizeof(int64_t));
+    memcpy(m.ino, l->meta.ino, l->len * sizeof(uint64_t));
+    memcpy(m.dev, l->meta.dev, l->len * sizeof(uint32_t));
+    memcpy(m.mode, l->meta.mode, l->len * sizeof(uint16_t));
+    free(l->meta.size);
+  }
+  l->meta = m;
+  return 0;
+}
+
+// Appends name to the arena and the entry array without touching the index.
+static int append(dir_listing_t *l, const char *name, size_t name_len,
+                  unsigned char d_type) {
+  if (l->names_len + name_len + 1 > l->names_cap) {
+    size_t cap = l->names_cap ? l->names_cap : 16 * 1024;
+    while (l->names_len + name_len + 1 > cap)
+      cap *= 2;
+    if (cap > UINT32_MAX) {
+      errno = EOVERFLOW;
+      return -1;
+    }
+    char *names = realloc(l->names, cap);
+    if (names == NULL)
+      return -1;
+    l->names = names;
+    l->names_cap = cap;
+  }
+  if (l->len == l->cap) {
+    int cap = l->cap ? l->cap * 2 : 256;
+    dir_entry_t *entries = realloc(l->entries, cap * sizeof(dir_entry_t));
+    if (entries == NULL)
+      return -1;
+    l->entries = entries;
+    if (l->meta.size != NULL && resize_meta(l, cap) < 0)
+      return -1;
+    l->cap = cap;
+  }
+  dir_entry_t *e = &l->entries[l->len++];
+  e->name_off = (uint32_t)l->names_len;
+  e->name_len = (uint16_t)name_len;
+  e->d_type = d_type;
+  e->flags = 0;
+  memcpy(l->names + l->names_len, name, name_len + 1);
+  l->names_len += name_len + 1;
+  return 0;
+}
+
+// Drops the bytes of removed names once they dominate the arena.
+static int compact(dir_listing_t *l) {
+  char *names = malloc(l->names_cap);
+  size_t off = 0;
+  if (names == NULL)
+    return -1;
+  for (int i = 0; i < l->len; i++) {
+    dir_entry_t *e = &l->entries[i];
+    memcpy(names + off, l->names + e->name_off, e->name_len + 1);
+    e->name_off = (uint32_t)off;
+    off += e->name_len + 1;
+  }
+  free(l->names);
+  l->names = names;
+  l->names_len = off;
+  l->names_dead = 0;
+  return 0;
+}
+
+void dir_listing_init(dir_listing_t *l, char *path) {
+  memset(l, 0, sizeof(*l));
+  l->path = path;
+  l->fd = -1;
+  l->wd = -1;
+  l->sort_mode = SORT_DEFAULT_MODE;
+  l->dirs_first = SORT_DIRS_FIRST;
+}
+
+void dir_listing_clear(dir_listing_t *l) {
+  if (l->fd >= 0)
+    close(l->fd);
+  l->fd = -1;
+  free(l->names);
+  free(l->entries);
+  free(l->meta.size);
+  free(l->slots);
+  free(l->order);
+  memset(&l->meta, 0, sizeof(l->meta));
+  l->order = NULL;
+  l->sorted = 0;
+  l->names = NULL;
+  l->names_len = l->names_cap = l->names_dead = 0;
+  l->entries = NULL;
+  l->len = l->cap = l->marks = 0;
+  l->slots = NULL;
+  l->nslots = l->slots_dead = 0;
+}
+
+int dir_listing_read(dir_listing_t *l) {
+  struct stat st;
+  char *buf;
+  long n;
+  int fd;
+
+  fd = open(l->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  buf = malloc(DIRENT_BUF_SIZE);
+  if (buf == NULL) {
+    close(fd);
+    return -1;
+  }
+  dir_listing_clear(l);
+  l->fd = fd;
+  // The directory's own size is a cheap upper bound for its name bytes on
+  // most filesystems; start the arena there to avoid regrowing it.
+  if (fstat(fd, &st) == 0 && st.st_size > 0 && st.st_size < UINT32_MAX) {
+    l->names = malloc(st.st_size);
+    if (l->names != NULL)
+      l->names_cap = st.st_size;
+  }
+
+  while ((n = getdents64(fd, buf, DIRENT_BUF_SIZE)) > 0) {
+    trace_count(TRACE_GETDENTS, 1);
+    for (long off = 0; off < n;) {
+      struct dirent64 *d = (struct dirent64 *)(buf + off);
+      off += d->d_reclen;
+      if (d->d_name[0] == '.' && d->d_name[1] == '\0')
+        continue;
+      if (append(l, d->d_name, strlen(d->d_name), d->d_type) < 0) {
+        n = -1;
+        break;
+      }
+    }
+    if (n < 0)
+      break;
+  }
+  free(buf);
+  if (n < 0 || rehash(l) < 0) {
+    dir_listing_clear(l);
+    return -1;
+  }
+  return 0;
+}
+
+int dir_listing_find(const dir_listing_t *l, const char *name) {
+  long slot = find_slot(l, name);
+  return slot < 0 ? -1 : l->slots[slot] - 1;
+}
+
+int dir_listing_add(dir_listing_t *l, const char *name, unsigned char d_type) {
+  if (find_slot(l, name) >= 0)
+    return 0;
+  if (append(l, name, strlen(name), d_type) < 0)
+    return -1;
+  l->sorted = 0;
+  if (((size_t)l->len + l->slots_dead) * 2 > l->nslots)
+    return rehash(l);
+  insert_slot(l, l->len - 1);
+  return 0;
+}
+
+void dir_listing_remove(dir_listing_t *l, const char *name) {
+  long slot = find_slot(l, name);
+  if (slot < 0)
+    return;
+  int index = l->slots[slot] - 1;
+  l->slots[slot] = SLOT_DELETED;
+  l->slots_dead++;
+  l->names_dead += l->entries[index].name_len + 1;
+  l->marks -= (l->entries[index].flags & ENTRY_MARKED) != 0;
+  l->len--;
+  if (index != l->len) {
+    // Keep the array dense by moving the last entry into the hole.
+    long moved = find_slot(l, dir_listing_name(l, l->len));
+    l->entries[index] = l->entries[l->len];
+    if (l->meta.size != NULL) {
+      l->meta.size[index] = l->meta.size[l->len];
+      l->meta.mtime[index] = l->meta.mtime[l->len];
+      l->meta.ino[index] = l->meta.ino[l->len];
+      l->meta.dev[index] = l->meta.dev[l->len];
+      l->meta.mode[index] = l->meta.mode[l->len];
+    }
+    l->slots[moved] = index + 1;
+  }
+  l->sorted = 0;
+  if (l->names_dead > l->names_len / 2 && l->names_dead > 64 * 1024)
+    compact(l);
+}
+
+static int alloc_meta(dir_listing_t *l) {
+  return l->meta.size == NULL ? resize_meta(l, l->cap) : 0;
+}
+
+#define STAT_FLAGS (AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC)
+
+#define STAT_MASK (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO)
+
+// Fills meta[i] from stx, or remembers that entry i could not be stat'ed
+// when stx is NULL, so that redraws do not retry it every frame.
+static void set_meta(dir_listing_t *l, int i, const struct statx *stx) {
+  dir_entry_t *e = &l->entries[i];
+
+  if (stx == NULL) {
+    e->flags |= ENTRY_NOMETA;
+    return;
+  }
+  l->meta.size[i] = stx->stx_size;
+  l->meta.mtime[i] = stx->stx_mtime.tv_sec * 1000000000 + stx->stx_mtime.tv_nsec;
+  l->meta.ino[i] = stx->stx_ino;
+  l->meta.dev[i] = stx->stx_dev_major << 20 | stx->stx_dev_minor;
+  l->meta.mode[i] = stx->stx_mode;
+  e->flags |= ENTRY_META;
+}
+
+// Fills meta[i]. Only touches entry i, so workers given disjoint ranges
+// can run it concurrently.
+static void stat_entry(dir_listing_t *l, int i) {
+  struct statx stx;
+
+  trace_count(TRACE_STATX, 1);
+  if (statx(l->fd, dir_listing_name(l, i), STAT_FLAGS, STAT_MASK, &stx) < 0)
+    set_meta(l, i, NULL);
+  else
+    set_meta(l, i, &stx);
+}
+
+int dir_listing_stat(dir_listing_t *l, int i, dir_meta_t *out) {
+  dir_entry_t *e = &l->entries[i];
+
+  if (!(e->flags & ENTRY_META)) {
+    if (l->fd < 0 || (e->flags & ENTRY_NOMETA) || alloc_meta(l) < 0)
+      return -1;
+    stat_entry(l, i);
+    if (!(e->flags & ENTRY_META))
+      return -1;
+  }
+  if (out != NULL) {
+    int64_t t = l->meta.mtime[i];
+    // Times before the epoch round down to the second before.
+    int64_t sec = t / 1000000000 - (t % 1000000000 < 0);
+    out->size = l->meta.size[i];
+    out->dev = makedev(l->meta.dev[i] >> 20, l->meta.dev[i] & 0xfffff);
+    out->ino = l->meta.ino[i];
+    out->mtime = sec;
+    out->mtime_nsec = t - sec * 1000000000;
+    out->mode = l->meta.mode[i];
+  }
+  return 0;
+}
+
+typedef struct enrich_task_ {
+  dir_listing_t *l;
+  int from, to;
+} enrich_task_t;
+
+static void enrich_range(void *arg, int worker) {
+  enrich_task_t *t = arg;
+  for (int i = t->from; i < t->to; i++)
+    if (!(t->l->entries[i].flags & (ENTRY_META | ENTRY_NOMETA)))
+      stat_entry(t->l, i);
+}
+
+static void stat_done(void *arg, uint64_t tag, int res, const struct statx *stx) {
+  // Dropped by a ring that failed; the pool stats it instead.
+  if (res != -ECANCELED)
+    set_meta(arg, (int)tag, stx);
+}
+
+// Keeps the ring full of statx requests for the entries not yet stat'ed.
+// Returns -1 if the ring failed, leaving the rest to the caller.
+static int enrich_uring(dir_listing_t *l, uring_t *r) {
+  uint64_t stats = 0;
+  int rc = 0;
+
+  for (int i = 0; i < l->len && rc == 0; i++) {
+    if (l->entries[i].flags & (ENTRY_META | ENTRY_NOMETA))
+      continue;
+    while (rc == 0 &&
+           uring_statx(r, l->fd, dir_listing_name(l, i), STAT_FLAGS, STAT_MASK, i) < 0)
+      rc = uring_wait(r, 1, stat_done, l) < 0 ? -1 : 0;
+    stats += rc == 0;
+  }
+  if (rc == 0)
+    rc = uring_drain(r, stat_done, l);
+  trace_count(TRACE_STATX, stats);
+  return rc;
+}
+
+int dir_listing_stat_all(dir_listing_t *l) {
+  enrich_task_t *tasks;
+  pool_t *pool;
+  uring_t *ring;
+  int ntasks;
+
+  if (l->fd < 0 || alloc_meta(l) < 0)
+    return -1;
+  if (l->len < DIRLIST_PARALLEL_MIN) {
+    enrich_task_t all = {l, 0, l->len};
+    enrich_range(&all, 0);
+    return 0;
+  }
+  // With io_uring the kernel runs the calls side by side itself, and one
+  // io_uring_enter() collects a whole batch of them.
+  if ((ring = uring_get()) != NULL && enrich_uring(l, ring) == 0)
+    return 0;
+  // Enumeration is done; statx calls are independent, so spread them over
+  // a bounded pool. Small chunks keep the workers balanced when some
+  // entries are much slower to stat than others.
+  ntasks = (l->len + DIRLIST_ENRICH_CHUNK - 1) / DIRLIST_ENRICH_CHUNK;
+  tasks = malloc(ntasks * sizeof(enrich_task_t));
+  pool = tasks != NULL ? pool_create(DIRLIST_ENRICH_THREADS) : NULL;
+  if (pool == NULL) {
+    enrich_task_t all = {l, 0, l->len};
+    free(tasks);
+    enrich_range(&all, 0);
+    return 0;
+  }
+  for (int i = 0; i < ntasks; i++) {
+    tasks[i].l = l;
+    tasks[i].from = i * DIRLIST_ENRICH_CHUNK;
+    tasks[i].to = tasks[i].from + DIRLIST_ENRICH_CHUNK;
+    if (tasks[i].to > l->len)
+      tasks[i].to = l->len;
+    if (pool_submit(pool, enrich_range, &tasks[i]) < 0)
+      enrich_range(&tasks[i], 0);
+  }
+  pool_destroy(pool);
+  free(tasks);
+  return 0;
+}
+
+void dir_listing_prefetch(dir_listing_t *l, int from, int to, int need_meta) {
+  if (to > l->len)
+    to = l->len;
+  for (int pos = from < 0 ? 0 : from; pos < to; pos++) {
+    int i = dir_listing_index(l, pos);
+    if (need_meta || l->entries[i].d_type == DT_UNKNOWN)
+      dir_listing_stat(l, i, NULL);
+  }
+}
+
+void dir_listing_touch(dir_listing_t *l, const char *name) {
+  int i = dir_listing_find(l, name);
+  if (i >= 0)
+    l->entries[i].flags &= ~(ENTRY_META | ENTRY_NOMETA);
+}
+
+int dir_listing_is_dir(dir_listing_t *l, int i) {
+  if (l->entries[i].d_type != DT_UNKNOWN)
+    return l->entries[i].d_type == DT_DIR;
+  return dir_listing_stat(l, i, NULL) == 0 && S_ISDIR(l->meta.mode[i]);
+}
@@ -0,0 +1,112 @@
+#ifndef DIRLIST_H
+#define DIRLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// One directory entry. The name lives in the listing's name arena.
+typedef struct dir_entry_ {
+  uint32_t name_off;
+  uint16_t name_len;
+  uint8_t d_type;
+  uint8_t flags;
+} dir_entry_t;
+
+#define ENTRY_META 0x01
+#define ENTRY_NOMETA 0x02
+#define ENTRY_MARKED 0x04
+
+// Metadata fetched on demand with statx() relative to the listing's fd.
+typedef struct dir_meta_ {
+  uint64_t size;
+  uint64_t dev, ino;
+  int64_t mtime;
+  uint32_t mtime_nsec;
+  uint32_t mode;
+} dir_meta_t;
+
+// The same metadata as stored, one column per field, so that sorting by
+// size or time reads a single dense array; 30 bytes an entry in all. A
+// row is valid once its entry has ENTRY_META. The columns share one
+// allocation, made on first use.
+typedef struct dir_columns_ {
+  uint64_t *size;
+  // Nanoseconds since the epoch.
+  int64_t *mtime;
+  uint64_t *ino;
+  // major << 20 | minor, which holds every Linux device number.
+  uint32_t *dev;
+  uint16_t *mode;
+} dir_columns_t;
+
+// Listing of a single directory: one contiguous, NUL-separated name blob
+// plus a dense entry array and a hash index over the names.
+typedef struct dir_listing_ {
+  char *path;
+  char *names;
+  size_t names_len, names_cap, names_dead;
+  dir_entry_t *entries;
+  dir_columns_t meta;
+  int len, cap;
+  int *slots;
+  size_t nslots, slots_dead;
+  uint32_t *order;
+  int sorted, sort_mode, dirs_first;
+  // Entries with ENTRY_MARKED set.
+  int marks;
+  int fd;
+  int wd;
+  int stale;
+  unsigned long last_use;
+} dir_listing_t;
+
+static inline char *dir_listing_name(const dir_listing_t *l, int i) {
+  return l->names + l->entries[i].name_off;
+}
+
+// Maps a display position to an entry index through the sort order.
+static inline int dir_listing_index(const dir_listing_t *l, int pos) {
+  return l->sorted ? (int)l->order[pos] : pos;
+}
+
+// Prepares an empty listing for path, which is taken over by l.
+void dir_listing_init(dir_listing_t *l, char *path);
+
+// Replaces the contents of l with the entries of l->path, read in a single
+// pass with getdents64. Returns -1 with errno set on failure.
+int dir_listing_read(dir_listing_t *l);
+
+// Adds name unless it is already present. Returns -1 on allocation failure.
+int dir_listing_add(dir_listing_t *l, const char *name, unsigned char d_type);
+
+// Removes name if present; the last entry moves into its place.
+void dir_listing_remove(dir_listing_t *l, const char *name);
+
+// Returns the index of name, or -1.
+int dir_listing_find(const dir_listing_t *l, const char *name);
+
+// Fetches the metadata of entry i with statx() on first use and copies it
+// to out, unless out is NULL. Returns -1 if the entry cannot be stat'ed.
+int dir_listing_stat(dir_listing_t *l, int i, dir_meta_t *out);
+
+// Fetches the metadata of every entry. Large listings are split into
+// chunks stat'ed in parallel, which mostly helps on network filesystems
+// where each call waits on a round trip. Returns -1 on allocation failure.
+int dir_listing_stat_all(dir_listing_t *l);
+
+// Fetches the metadata of the entries at display positions [from, to) in
+// one pass: all of them if need_meta is set, otherwise only those whose
+// d_type the filesystem left unknown.
+void dir_listing_prefetch(dir_listing_t *l, int from, int to, int need_meta);
+
+// Drops the cached metadata of name after it changed on disk.
+void dir_listing_touch(dir_listing_t *l, const char *name);
+
+// Tells whether entry i is a directory, from d_type when the filesystem
+// reports it and from dir_listing_stat() otherwise.
+int dir_listing_is_dir(dir_listing_t *l, int i);
+
+// Releases everything owned by l except the path.
+void dir_listing_clear(dir_listing_t *l);
+
+#endif
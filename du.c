@@ -0,0 +1,499 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "du.h"
+#include "ducache.h"
+#include "pool.h"
+#include "trace.h"
+#include "uring.h"
+
+#define STATX_WANT \
+  (STATX_TYPE | STATX_NLINK | STATX_INO | STATX_SIZE | STATX_BLOCKS | STATX_MTIME)
+
+#define LINK_SHARDS 64
+
+// Directory being walked. Its subdirectory tasks open themselves relative
+// to fd, which is closed once the last of them has started. The node itself
+// lives until its own scan and every child have finished, so that subtree
+// totals can be rolled up into the parent and recorded in the cache.
+typedef struct du_dir_ {
+  struct du_dir_ *parent;
+  int fd;
+  int fd_refs;
+  int pending;
+  int top;
+  ducache_rec_t rec;
+} du_dir_t;
+
+// Per-worker totals, padded so workers never share a cache line.
+typedef struct du_counters_ {
+  uint64_t bytes, blocks, files, dirs, errors;
+  char *buf;
+  char pad[64];
+} du_counters_t;
+
+typedef struct link_shard_ {
+  pthread_mutex_t lock;
+  uint64_t *keys;
+  size_t len, cap;
+} link_shard_t;
+
+typedef struct du_walk_ {
+  pool_t *pool;
+  const du_options_t *opt;
+  dev_t root_dev;
+  int nthreads;
+  du_counters_t *counters;
+  link_shard_t links[LINK_SHARDS];
+} du_walk_t;
+
+typedef struct du_task_ {
+  du_walk_t *w;
+  du_dir_t *parent;
+  struct statx stx;
+  char name[];
+} du_task_t;
+
+static void add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static int cancelled(const du_walk_t *w) {
+  return w->opt->cancel != NULL &&
+         __atomic_load_n(w->opt->cancel, __ATOMIC_RELAXED);
+}
+
+static void release_fd(du_dir_t *d) {
+  if (__atomic_sub_fetch(&d->fd_refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    close(d->fd);
+    d->fd = -1;
+  }
+}
+
+// Drops one pending unit of d. The last one records d in the cache and
+// rolls its totals into the parent, which may complete in turn.
+static void finish_dir(du_walk_t *w, du_dir_t *d) {
+  while (__atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    du_dir_t *p = d->parent;
+    if (d->top)
+      return;
+    if (w->opt->use_cache && !cancelled(w))
+      ducache_put(&d->rec);
+    __atomic_fetch_add(&p->rec.total_bytes, d->rec.total_bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->rec.total_blocks, d->rec.total_blocks, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->rec.total_files, d->rec.total_files, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->rec.total_dirs, d->rec.total_dirs, __ATOMIC_RELAXED);
+    free(d);
+    d = p;
+  }
+}
+
+static uint64_t link_hash(uint64_t dev, uint64_t ino) {
+  uint64_t h = (dev * 0x9E3779B97F4A7C15ull) ^ ino;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Remembers (dev, ino); returns 1 the first time it is seen.
+static int first_link(du_walk_t *w, uint64_t dev, uint64_t ino) {
+  uint64_t h = link_hash(dev, ino);
+  link_shard_t *s = &w->links[h % LINK_SHARDS];
+  int fresh = 1;
+
+  pthread_mutex_lock(&s->lock);
+  if ((s->len + 1) * 2 > s->cap) {
+    size_t cap = s->cap ? s->cap * 2 : 256;
+    uint64_t *keys = calloc(cap * 2, sizeof(uint64_t));
+    if (keys == NULL) {
+      pthread_mutex_unlock(&s->lock);
+      return 1;
+    }
+    for (size_t i = 0; i < s->cap; i++) {
+      if (s->keys[2 * i + 1] == 0)
+        continue;
+      size_t j = link_hash(s->keys[2 * i], s->keys[2 * i + 1] - 1) & (cap - 1);
+      while (keys[2 * j + 1] != 0)
+        j = (j + 1) & (cap - 1);
+      keys[2 * j] = s->keys[2 * i];
+      keys[2 * j + 1] = s->keys[2 * i + 1];
+    }
+    free(s->keys);
+    s->keys = keys;
+    s->cap = cap;
+  }
+  // Inodes are stored off by one so that zero marks an empty slot.
+  size_t j = h & (s->cap - 1);
+  while (s->keys[2 * j + 1] != 0) {
+    if (s->keys[2 * j] == dev && s->keys[2 * j + 1] == ino + 1) {
+      fresh = 0;
+      break;
+    }
+    j = (j + 1) & (s->cap - 1);
+  }
+  if (fresh) {
+    s->keys[2 * j] = dev;
+    s->keys[2 * j + 1] = ino + 1;
+    s->len++;
+  }
+  pthread_mutex_unlock(&s->lock);
+  return fresh;
+}
+
+static void walk_dir(void *arg, int worker);
+
+static void spawn(du_walk_t *w, du_dir_t *parent, const char *name,
+                  const struct statx *stx) {
+  size_t n = strlen(name) + 1;
+  du_task_t *t = malloc(sizeof(du_task_t) + n);
+  if (t == NULL) {
+    add(&w->counters[0].errors, 1);
+    return;
+  }
+  t->w = w;
+  t->parent = parent;
+  t->stx = *stx;
+  memcpy(t->name, name, n);
+  __atomic_add_fetch(&parent->fd_refs, 1, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL);
+  if (pool_submit(w->pool, walk_dir, t) < 0) {
+    release_fd(parent);
+    finish_dir(w, parent);
+    free(t);
+    add(&w->counters[0].errors, 1);
+  }
+}
+
+// Accounts for one entry of d, queueing it if it is a subdirectory.
+static void account(du_walk_t *w, du_dir_t *d, du_counters_t *c, int hit,
+                    const char *name, const struct statx *stx) {
+  ducache_rec_t *r = &d->rec;
+
+  if (S_ISDIR(stx->stx_mode)) {
+    add(&c->dirs, 1);
+    add(&c->bytes, stx->stx_size);
+    add(&c->blocks, stx->stx_blocks);
+    add(&r->total_dirs, 1);
+    add(&r->total_bytes, stx->stx_size);
+    add(&r->total_blocks, stx->stx_blocks);
+    if (!w->opt->one_filesystem ||
+        makedev(stx->stx_dev_major, stx->stx_dev_minor) == w->root_dev)
+      spawn(w, d, name, stx);
+    return;
+  }
+  if (hit)
+    return;
+  add(&c->files, 1);
+  r->files++;
+  if (stx->stx_nlink > 1 &&
+      !first_link(w, makedev(stx->stx_dev_major, stx->stx_dev_minor),
+                  stx->stx_ino))
+    return;
+  add(&c->bytes, stx->stx_size);
+  add(&c->blocks, stx->stx_blocks);
+  r->bytes += stx->stx_size;
+  r->blocks += stx->stx_blocks;
+}
+
+typedef struct du_scan_ {
+  du_walk_t *w;
+  du_dir_t *d;
+  du_counters_t *c;
+  int hit;
+} du_scan_t;
+
+// Completion of a statx queued by scan_dir(); the tag is the entry's name.
+static void stat_done(void *arg, uint64_t tag, int res, const struct statx *stx) {
+  du_scan_t *s = arg;
+  struct statx own;
+
+  // Dropped by a ring that failed; made here instead.
+  if (res == -ECANCELED) {
+    const char *name = (const char *)(uintptr_t)tag;
+    res = statx(s->d->fd, name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC, STATX_WANT, &own);
+    stx = &own;
+  }
+  if (res < 0)
+    add(&s->c->errors, 1);
+  else
+    account(s->w, s->d, s->c, s->hit, (const char *)(uintptr_t)tag, stx);
+}
+
+// Reads one directory, accounts for its entries and queues its children.
+// With a cache hit the non-directory entries are already known and only
+// the subdirectories are examined. With a ring, the entries of each
+// getdents64 batch are stat'ed through it; the names live in c->buf, so
+// every request completes before the next batch is read.
+static void scan_dir(du_walk_t *w, du_dir_t *d, du_counters_t *c, int hit) {
+  du_scan_t scan = {w, d, c, hit};
+  ducache_rec_t *r = &d->rec;
+  uring_t *ring = uring_get();
+  struct statx stx;
+  uint64_t calls = 0, stats = 0;
+  long n;
+
+  while (!cancelled(w) && (n = getdents64(d->fd, c->buf, DIRENT_BUF_SIZE)) > 0) {
+    calls++;
+    for (long off = 0; off < n;) {
+      struct dirent64 *e = (struct dirent64 *)(c->buf + off);
+      off += e->d_reclen;
+      if (e->d_name[0] == '.' &&
+          (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+        continue;
+      if (hit && e->d_type != DT_DIR && e->d_type != DT_UNKNOWN)
+        continue;
+      stats++;
+      if (ring != NULL) {
+        while (ring != NULL &&
+               uring_statx(ring, d->fd, e->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                           STATX_WANT, (uintptr_t)e->d_name) < 0)
+          if (uring_wait(ring, 1, stat_done, &scan) < 0)
+            ring = NULL;
+        if (ring != NULL)
+          continue;
+      }
+      if (statx(d->fd, e->d_name, AT_SYMLINK_NOFOLLOW | AT_STATX_DONT_SYNC,
+                STATX_WANT, &stx) < 0) {
+        add(&c->errors, 1);
+        continue;
+      }
+      account(w, d, c, hit, e->d_name, &stx);
+    }
+    if (ring != NULL && uring_drain(ring, stat_done, &scan) < 0)
+      ring = NULL;
+  }
+  if (n < 0)
+    add(&c->errors, 1);
+  // Counted once per directory so workers do not fight over the counters.
+  trace_count(TRACE_GETDENTS, calls);
+  trace_count(TRACE_STATX, stats);
+  // Direct totals are only final here; fold them into the subtree totals.
+  add(&r->total_bytes, r->bytes);
+  add(&r->total_blocks, r->blocks);
+  add(&r->total_files, r->files);
+}
+
+static void walk_dir(void *arg, int worker) {
+  du_task_t *t = arg;
+  du_walk_t *w = t->w;
+  du_counters_t *c = &w->counters[worker];
+  du_dir_t *d = NULL;
+  int fd = -1, hit = 0;
+
+  if (!cancelled(w))
+    fd = openat(t->parent->fd, t->name,
+                O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  release_fd(t->parent);
+  if (fd < 0) {
+    if (!cancelled(w))
+      add(&c->errors, 1);
+    goto out;
+  }
+  d = calloc(1, sizeof(du_dir_t));
+  if (d == NULL) {
+    close(fd);
+    add(&c->errors, 1);
+    goto out;
+  }
+  d->parent = t->parent;
+  d->fd = fd;
+  d->fd_refs = 1;
+  d->pending = 1;
+  d->rec.dev = makedev(t->stx.stx_dev_major, t->stx.stx_dev_minor);
+  d->rec.ino = t->stx.stx_ino;
+  d->rec.mtime_sec = t->stx.stx_mtime.tv_sec;
+  d->rec.mtime_nsec = t->stx.stx_mtime.tv_nsec;
+  if (w->opt->use_cache) {
+    ducache_rec_t cached;
+    hit = ducache_get(d->rec.dev, d->rec.ino, d->rec.mtime_sec,
+                      d->rec.mtime_nsec, &cached);
+    if (hit) {
+      // Entries are unchanged since the cached scan; trust its file totals.
+      d->rec.bytes = cached.bytes;
+      d->rec.blocks = cached.blocks;
+      d->rec.files = cached.files;
+      add(&c->bytes, cached.bytes);
+      add(&c->blocks, cached.blocks);
+      add(&c->files, cached.files);
+    }
+  }
+  scan_dir(w, d, c, hit);
+  release_fd(d);
+  finish_dir(w, d);
+  free(t);
+  return;
+
+out:
+  finish_dir(w, t->parent);
+  free(t);
+}
+
+static void sum(const du_walk_t *w, du_result_t *out) {
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < w->nthreads; i++) {
+    const du_counters_t *c = &w->counters[i];
+    out->bytes += __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    out->blocks += __atomic_load_n(&c->blocks, __ATOMIC_RELAXED);
+    out->files += __atomic_load_n(&c->files, __ATOMIC_RELAXED);
+    out->dirs += __atomic_load_n(&c->dirs, __ATOMIC_RELAXED);
+    out->errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+  }
+}
+
+// Deep trees keep one descriptor open per directory with pending children.
+static void raise_fd_limit(void) {
+  static int done = 0;
+  struct rlimit rl;
+  if (done)
+    return;
+  done = 1;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+int du_walk(const char *path, const du_options_t *opt, du_result_t *out) {
+  static const du_options_t defaults = {0};
+  struct statx stx;
+  du_walk_t w;
+  du_dir_t *top;
+  int fd, ok = -1;
+
+  memset(out, 0, sizeof(*out));
+  if (opt == NULL)
+    opt = &defaults;
+  if (statx(AT_FDCWD, path, AT_STATX_DONT_SYNC, STATX_WANT, &stx) < 0)
+    return -1;
+  if (!S_ISDIR(stx.stx_mode)) {
+    out->files = 1;
+    out->bytes = stx.stx_size;
+    out->blocks = stx.stx_blocks;
+    return 0;
+  }
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  raise_fd_limit();
+
+  memset(&w, 0, sizeof(w));
+  w.opt = opt;
+  w.root_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+  w.pool = pool_create(opt->threads > 0 ? opt->threads : DU_THREADS);
+  top = calloc(1, sizeof(du_dir_t));
+  if (w.pool == NULL || top == NULL)
+    goto out;
+  if (opt->use_cache)
+    ducache_open();
+  w.nthreads = pool_threads(w.pool);
+  w.counters = calloc(w.nthreads, sizeof(du_counters_t));
+  if (w.counters == NULL)
+    goto out;
+  for (int i = 0; i < w.nthreads; i++) {
+    w.counters[i].buf = malloc(DIRENT_BUF_SIZE);
+    if (w.counters[i].buf == NULL)
+      goto out;
+  }
+  for (int i = 0; i < LINK_SHARDS; i++)
+    pthread_mutex_init(&w.links[i].lock, NULL);
+
+  // The root is scanned like any subdirectory, through a task of its own
+  // under a placeholder parent that just holds the descriptor.
+  top->fd = fd;
+  top->fd_refs = 1;
+  top->pending = 1;
+  top->top = 1;
+  fd = -1;
+  spawn(&w, top, ".", &stx);
+  release_fd(top);
+  finish_dir(&w, top);
+
+  if (opt->progress != NULL) {
+    int interval = opt->progress_ms > 0 ? opt->progress_ms : 100;
+    du_result_t partial;
+    while (!pool_wait(w.pool, interval)) {
+      sum(&w, &partial);
+      opt->progress(&partial, opt->progress_arg);
+    }
+  }
+  pool_wait(w.pool, -1);
+  sum(&w, out);
+  // The root directory itself counts towards the size, as in du(1).
+  out->bytes += stx.stx_size;
+  out->blocks += stx.stx_blocks;
+  for (int i = 0; i < LINK_SHARDS; i++) {
+    pthread_mutex_destroy(&w.links[i].lock);
+    free(w.links[i].keys);
+  }
+  ok = 0;
+
+out:
+  if (w.pool != NULL)
+    pool_destroy(w.pool);
+  if (w.counters != NULL) {
+    for (int i = 0; i < w.nthreads; i++)
+      free(w.counters[i].buf);
+    free(w.counters);
+  }
+  free(top);
+  if (fd >= 0)
+    close(fd);
+  if (ok < 0)
+    errno = ENOMEM;
+  return ok;
+}
+
+int du_lookup_cache(const char *path, du_result_t *out) {
+  struct statx stx;
+  ducache_rec_t rec;
+
+  memset(out, 0, sizeof(*out));
+  if (statx(AT_FDCWD, path, AT_STATX_DONT_SYNC, STATX_WANT, &stx) < 0 ||
+      !S_ISDIR(stx.stx_mode) || ducache_open() < 0)
+    return 0;
+  if (!ducache_get(makedev(stx.stx_dev_major, stx.stx_dev_minor), stx.stx_ino,
+                   stx.stx_mtime.tv_sec, stx.stx_mtime.tv_nsec, &rec))
+    return 0;
+  out->bytes = rec.total_bytes + stx.stx_size;
+  out->blocks = rec.total_blocks + stx.stx_blocks;
+  out->files = rec.total_files;
+  out->dirs = rec.total_dirs;
+  return 1;
+}
+
+char *du_format_size(uint64_t bytes, char *buf, size_t size) {
+  static const char *units[] = {"B", "KB", "MB", "GB", "TB", "PB", "EB"};
+  double v = (double)bytes;
+  int u = 0;
+  while (v >= 1024 && u < 6) {
+    v /= 1024;
+    u++;
+  }
+  if (u == 0)
+    snprintf(buf, size, "%llu B", (unsigned long long)bytes);
+  else
+    snprintf(buf, size, "%.1f %s", v, units[u]);
+  return buf;
+}
+
+char *du_format_count(uint64_t n, char *buf, size_t size) {
+  if (n < 10000)
+    snprintf(buf, size, "%llu", (unsigned long long)n);
+  else if (n < 10000000)
+    snprintf(buf, size, "%lluk", (unsigned long long)(n / 1000));
+  else
+    snprintf(buf, size, "%.1fM", n / 1e6);
+  return buf;
+}
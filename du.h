@@ -0,0 +1,51 @@
+#ifndef DU_H
+#define DU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Aggregate usage of a tree. bytes is the apparent size, blocks counts
+// 512-byte units actually allocated. Hard-linked files are counted once.
+typedef struct du_result_ {
+  uint64_t bytes;
+  uint64_t blocks;
+  uint64_t files;
+  uint64_t dirs;
+  uint64_t errors;
+} du_result_t;
+
+typedef struct du_options_ {
+  // Worker threads; <= 0 means one per online CPU.
+  int threads;
+  // Do not descend into directories on other filesystems.
+  int one_filesystem;
+  // Reuse and update the persistent per-directory cache (see ducache.h).
+  // Directories whose mtime is unchanged are read, but their files are not
+  // stat'ed again; a file growing in place is not noticed.
+  int use_cache;
+  // Polled by the walkers; once non-zero the walk stops early.
+  const int *cancel;
+  // Called from the thread running du_walk() every progress_ms with the
+  // totals so far.
+  void (*progress)(const du_result_t *partial, void *arg);
+  void *progress_arg;
+  int progress_ms;
+} du_options_t;
+
+// Walks path in parallel and fills out. A non-directory path yields its own
+// size. Returns -1 with errno set if path itself cannot be examined;
+// unreadable entries below it only bump out->errors.
+int du_walk(const char *path, const du_options_t *opt, du_result_t *out);
+
+// Fills out from the size cache if it has a record for path that is still
+// current at the top level. Returns 1 on a hit. Deeper changes are not
+// checked, so this is only an estimate until du_walk() confirms it.
+int du_lookup_cache(const char *path, du_result_t *out);
+
+// Formats bytes as a short human-readable size, e.g. "12.3 GB".
+char *du_format_size(uint64_t bytes, char *buf, size_t size);
+
+// Formats a count compactly, e.g. "840k".
+char *du_format_count(uint64_t n, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,221 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ducache.h"
+
+#define DUCACHE_MAGIC 0x3130434455444d46ull /* "FMDUDC01" */
+
+typedef struct ducache_header_ {
+  uint64_t magic;
+  uint64_t nslots;
+  uint64_t used;
+  uint64_t reserved;
+} ducache_header_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static ducache_header_t *header = NULL;
+static ducache_rec_t *slots = NULL;
+static size_t map_size = 0;
+
+static size_t file_size(uint64_t nslots) {
+  return sizeof(ducache_header_t) + nslots * sizeof(ducache_rec_t);
+}
+
+static uint64_t key_hash(uint64_t dev, uint64_t ino) {
+  uint64_t h = (dev * 0x9E3779B97F4A7C15ull) ^ ino;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  return h;
+}
+
+// Slot holding (dev, ino), or the empty slot where it would go.
+static ducache_rec_t *probe(ducache_rec_t *table, uint64_t nslots,
+                            uint64_t dev, uint64_t ino) {
+  uint64_t i = key_hash(dev, ino) & (nslots - 1);
+  while (table[i].used && (table[i].dev != dev || table[i].ino != ino))
+    i = (i + 1) & (nslots - 1);
+  return &table[i];
+}
+
+int ducache_path(char *buf, size_t size, const char *name) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[PATH_MAX - 64];
+
+  if (base != NULL && base[0] == '/')
+    snprintf(dir, sizeof(dir), "%s/fsm", base);
+  else if (home != NULL)
+    snprintf(dir, sizeof(dir), "%s/.cache/fsm", home);
+  else
+    return -1;
+  // Create the parent too; ~/.cache may not exist yet.
+  char *slash = strrchr(dir, '/');
+  *slash = '\0';
+  mkdir(dir, 0700);
+  *slash = '/';
+  if (mkdir(dir, 0700) < 0 && errno != EEXIST)
+    return -1;
+  snprintf(buf, size, "%s/%s", dir, name);
+  return 0;
+}
+
+static void *map_file(int fd, size_t size) {
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  return p == MAP_FAILED ? NULL : p;
+}
+
+// Writes a fresh table of nslots next to path, copying over the records of
+// the current one, and renames it into place. Returns the new descriptor.
+static int rebuild(const char *path, uint64_t nslots) {
+  char tmp[PATH_MAX];
+  ducache_header_t *h;
+  ducache_rec_t *table;
+  int fd;
+
+  if (ducache_path(tmp, sizeof(tmp), DUCACHE_FILE ".tmp") < 0)
+    return -1;
+  fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    return -1;
+  if (ftruncate(fd, file_size(nslots)) < 0 ||
+      (h = map_file(fd, file_size(nslots))) == NULL) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  table = (ducache_rec_t *)(h + 1);
+  h->nslots = nslots;
+  if (header != NULL) {
+    for (uint64_t i = 0; i < header->nslots; i++) {
+      if (!slots[i].used)
+        continue;
+      *probe(table, nslots, slots[i].dev, slots[i].ino) = slots[i];
+      h->used++;
+    }
+  }
+  // The magic goes in last so a torn rebuild is never mistaken for a table.
+  h->magic = DUCACHE_MAGIC;
+  munmap(h, file_size(nslots));
+  if (rename(tmp, path) < 0) {
+    close(fd);
+    unlink(tmp);
+    return -1;
+  }
+  return fd;
+}
+
+int ducache_open(void) {
+  char path[PATH_MAX];
+  struct stat st;
+  int fd;
+
+  pthread_mutex_lock(&lock);
+  if (header != NULL) {
+    pthread_mutex_unlock(&lock);
+    return 0;
+  }
+  if (ducache_path(path, sizeof(path), DUCACHE_FILE) < 0)
+    goto fail;
+  fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+  if (fd < 0)
+    goto fail;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(ducache_header_t)) {
+    header = map_file(fd, st.st_size);
+    if (header != NULL &&
+        (header->magic != DUCACHE_MAGIC || header->nslots == 0 ||
+         header->used >= header->nslots ||
+         (header->nslots & (header->nslots - 1)) != 0 ||
+         file_size(header->nslots) != (size_t)st.st_size)) {
+      munmap(header, st.st_size);
+      header = NULL;
+    }
+  }
+  if (header != NULL) {
+    map_size = st.st_size;
+    slots = (ducache_rec_t *)(header + 1);
+    if (header->used * 2 <= header->nslots) {
+      close(fd);
+      pthread_mutex_unlock(&lock);
+      return 0;
+    }
+  }
+
+  // Missing, corrupt or more than half full: write a new, larger table.
+  close(fd);
+  uint64_t nslots = DUCACHE_SLOTS;
+  while (header != NULL && header->used * 4 > nslots)
+    nslots *= 2;
+  fd = rebuild(path, nslots);
+  if (header != NULL)
+    munmap(header, map_size);
+  header = NULL;
+  slots = NULL;
+  if (fd < 0)
+    goto fail;
+  header = map_file(fd, file_size(nslots));
+  close(fd);
+  if (header == NULL)
+    goto fail;
+  map_size = file_size(nslots);
+  slots = (ducache_rec_t *)(header + 1);
+  pthread_mutex_unlock(&lock);
+  return 0;
+
+fail:
+  pthread_mutex_unlock(&lock);
+  return -1;
+}
+
+int ducache_get(uint64_t dev, uint64_t ino, int64_t mtime_sec,
+                int64_t mtime_nsec, ducache_rec_t *out) {
+  int hit = 0;
+
+  pthread_mutex_lock(&lock);
+  if (header != NULL) {
+    ducache_rec_t *r = probe(slots, header->nslots, dev, ino);
+    if (r->used && r->mtime_sec == mtime_sec && r->mtime_nsec == mtime_nsec) {
+      *out = *r;
+      hit = 1;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  return hit;
+}
+
+void ducache_put(const ducache_rec_t *rec) {
+  pthread_mutex_lock(&lock);
+  if (header != NULL) {
+    ducache_rec_t *r = probe(slots, header->nslots, rec->dev, rec->ino);
+    if (r->used) {
+      *r = *rec;
+      r->used = 1;
+    } else if ((header->used + 1) * 10 <= header->nslots * 9) {
+      *r = *rec;
+      r->used = 1;
+      header->used++;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+void ducache_close(void) {
+  pthread_mutex_lock(&lock);
+  if (header != NULL) {
+    msync(header, map_size, MS_ASYNC);
+    munmap(header, map_size);
+  }
+  header = NULL;
+  slots = NULL;
+  map_size = 0;
+  pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,39 @@
+#ifndef DUCACHE_H
+#define DUCACHE_H
+
+#include <stdint.h>
+
+// Cached usage of one directory, keyed by (dev, ino) and valid while the
+// directory's mtime is unchanged. The direct fields cover only the
+// non-directory entries of the directory itself, which is what lets a
+// revisit skip stat'ing them; the total fields cover the whole subtree.
+typedef struct ducache_rec_ {
+  uint64_t dev, ino;
+  int64_t mtime_sec, mtime_nsec;
+  uint64_t bytes, blocks, files;
+  uint64_t total_bytes, total_blocks, total_files, total_dirs;
+  uint64_t used;
+} ducache_rec_t;
+
+// Maps the cache file, creating or growing it as needed. The file lives in
+// $XDG_CACHE_HOME/fsm (or ~/.cache/fsm). Returns -1 if no cache is usable;
+// lookups then simply miss.
+int ducache_open(void);
+
+// Copies the record for (dev, ino) into out if there is one whose mtime
+// matches. Returns 1 on a hit.
+int ducache_get(uint64_t dev, uint64_t ino, int64_t mtime_sec,
+                int64_t mtime_nsec, ducache_rec_t *out);
+
+// Stores rec, replacing any older record for the same directory. Dropped
+// silently when the table is full; it is grown on the next open.
+void ducache_put(const ducache_rec_t *rec);
+
+// Puts the path of name inside the cache directory into buf, creating the
+// directory if needed. Returns -1 if there is nowhere to keep a cache.
+int ducache_path(char *buf, size_t size, const char *name);
+
+// Flushes and unmaps the cache.
+void ducache_close(void);
+
+#endif
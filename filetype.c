@@ -0,0 +1,319 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <magic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+#include "filetype.h"
+#include "trace.h"
+
+// Ways of each set of the cache. A file can be kept in any way of its set,
+// so a few files on screen that hash alike do not push each other out.
+#define CACHE_WAYS 4
+
+// One classified file, or one waiting for a worker. last_use orders the
+// ways of a set for replacement.
+typedef struct slot_ {
+  uint64_t dev, ino;
+  int64_t mtime_sec, mtime_nsec;
+  int used;
+  unsigned long last_use;
+  filetype_t type;
+} slot_t;
+
+typedef struct request_ {
+  uint64_t dev, ino;
+  int64_t mtime_sec, mtime_nsec;
+  char path[PATH_MAX];
+} request_t;
+
+static pthread_t workers[FILETYPE_THREADS];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static int nworkers = 0, quit = 0;
+static slot_t slots[FILETYPE_CACHE_SLOTS];
+// Ring of requests; workers take the newest first, which is what is on
+// screen now, and the oldest is dropped when it is full.
+static request_t queue[FILETYPE_QUEUE];
+static int tail = 0, queued = 0;
+static unsigned long generation = 0, uses = 0;
+
+static const struct {
+  const char *prefix;
+  int kind;
+} kinds[] = {
+    {"text/", FILETYPE_TEXT},
+    {"image/", FILETYPE_IMAGE},
+    {"audio/", FILETYPE_MEDIA},
+    {"video/", FILETYPE_MEDIA},
+    {"application/x-executable", FILETYPE_EXEC},
+    {"application/x-pie-executable", FILETYPE_EXEC},
+    {"application/x-sharedlib", FILETYPE_EXEC},
+    {"application/x-mach-binary", FILETYPE_EXEC},
+    {"application/x-dosexec", FILETYPE_EXEC},
+    {"application/zip", FILETYPE_ARCHIVE},
+    {"application/gzip", FILETYPE_ARCHIVE},
+    {"application/x-tar", FILETYPE_ARCHIVE},
+    {"application/x-xz", FILETYPE_ARCHIVE},
+    {"application/x-bzip2", FILETYPE_ARCHIVE},
+    {"application/zstd", FILETYPE_ARCHIVE},
+    {"application/x-lz4", FILETYPE_ARCHIVE},
+    {"application/x-lzma", FILETYPE_ARCHIVE},
+    {"application/x-compress", FILETYPE_ARCHIVE},
+    {"application/x-7z-compressed", FILETYPE_ARCHIVE},
+    {"application/x-rar", FILETYPE_ARCHIVE},
+    {"application/vnd.rar", FILETYPE_ARCHIVE},
+    {"application/java-archive", FILETYPE_ARCHIVE},
+    {"application/vnd.debian.binary-package", FILETYPE_ARCHIVE},
+    {"application/x-rpm", FILETYPE_ARCHIVE},
+    {"application/pdf", FILETYPE_DOCUMENT},
+    {"application/postscript", FILETYPE_DOCUMENT},
+    {"application/epub", FILETYPE_DOCUMENT},
+    {"application/msword", FILETYPE_DOCUMENT},
+    {"application/vnd.ms-", FILETYPE_DOCUMENT},
+    {"application/vnd.openxmlformats", FILETYPE_DOCUMENT},
+    {"application/vnd.oasis.opendocument", FILETYPE_DOCUMENT},
+};
+
+static slot_t *set_for(uint64_t dev, uint64_t ino) {
+  uint64_t h = (dev * 0x9E3779B97F4A7C15ull) ^ ino;
+  h ^= h >> 29;
+  return &slots[h % (FILETYPE_CACHE_SLOTS / CACHE_WAYS) * CACHE_WAYS];
+}
+
+static int same(const slot_t *s, uint64_t dev, uint64_t ino, int64_t mtime_sec,
+                int64_t mtime_nsec) {
+  return s->used && s->dev == dev && s->ino == ino &&
+         s->mtime_sec == mtime_sec && s->mtime_nsec == mtime_nsec;
+}
+
+static slot_t *find(uint64_t dev, uint64_t ino, int64_t mtime_sec, int64_t mtime_nsec) {
+  slot_t *set = set_for(dev, ino);
+  for (int i = 0; i < CACHE_WAYS; i++)
+    if (same(&set[i], dev, ino, mtime_sec, mtime_nsec))
+      return &set[i];
+  return NULL;
+}
+
+// Picks the way for a file not in the cache: the one holding it as it was
+// before it changed, else a free one, else the least recently used one.
+// Ways waiting for a worker are never taken, so that a request is not lost
+// to another file of the same set; returns NULL if all of them are.
+static slot_t *victim(uint64_t dev, uint64_t ino) {
+  slot_t *set = set_for(dev, ino), *v = NULL;
+  for (int i = 0; i < CACHE_WAYS; i++) {
+    slot_t *s = &set[i];
+    if (s->used && s->dev == dev && s->ino == ino)
+      return s->type.kind == FILETYPE_PENDING ? NULL : s;
+    if (!s->used)
+      v = s;
+    else if (s->type.kind != FILETYPE_PENDING &&
+             (v == NULL || (v->used && s->last_use < v->last_use)))
+      v = s;
+  }
+  return v;
+}
+
+// Bytes below 0x20 that text may hold: \b \t \n \v \f \r and escape.
+static int text_control(unsigned char c) {
+  return (c >= 8 && c <= 13) || c == 27;
+}
+
+int filetype_is_text(const unsigned char *p, size_t n) {
+  size_t i = 0;
+
+  while (i < n) {
+    size_t stop = n;
+#if defined(__x86_64__)
+    // The signed compare flags control characters and every byte from
+    // 0x80 up; taking out the controls text may hold leaves a clean vector
+    // for ASCII text.
+    const __m128i space = _mm_set1_epi8(0x20), esc = _mm_set1_epi8(27);
+    const __m128i bs = _mm_set1_epi8(7), cr = _mm_set1_epi8(14);
+    for (; i + 16 <= n; i += 16) {
+      __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+      __m128i ok = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi8(v, bs), _mm_cmplt_epi8(v, cr)),
+                                _mm_cmpeq_epi8(v, esc));
+      if (_mm_movemask_epi8(_mm_andnot_si128(ok, _mm_cmplt_epi8(v, space))) != 0)
+        break;
+    }
+    stop = i + 16 < n ? i + 16 : n;
+#endif
+    while (i < stop) {
+      unsigned char c = p[i];
+      if (c < 0x80) {
+        if (c < 0x20 && !text_control(c))
+          return 0;
+        i++;
+        continue;
+      }
+      int len = c >= 0xf0 ? 4 : c >= 0xe0 ? 3 : c >= 0xc2 ? 2 : 0;
+      if (len == 0 || c > 0xf4)
+        return 0;
+      // The second byte excludes overlong forms, surrogates and code
+      // points past U+10FFFF.
+      unsigned char lo = c == 0xe0 ? 0xa0 : c == 0xf0 ? 0x90 : 0x80;
+      unsigned char hi = c == 0xed ? 0x9f : c == 0xf4 ? 0x8f : 0xbf;
+      if (i + 1 < n && (p[i + 1] < lo || p[i + 1] > hi))
+        return 0;
+      for (int k = 2; k < len && i + k < n; k++)
+        if ((p[i + k] & 0xc0) != 0x80)
+          return 0;
+      i += len;
+    }
+  }
+  return 1;
+}
+
+// Classifies the file at path from its first bytes. Text is recognised
+// without libmagic; the database is loaded into *magic on first need.
+static void classify(magic_t *magic, int *tried, const char *path,
+                     unsigned char *buf, filetype_t *t) {
+  const char *mime = NULL;
+  ssize_t n;
+
+  memset(t, 0, sizeof(*t));
+  int fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_NOATIME | O_CLOEXEC);
+  if (fd < 0 && errno == EPERM)
+    fd = open(path, O_RDONLY | O_NOFOLLOW | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0)
+    return;
+  n = pread(fd, buf, FILETYPE_PROBE, 0);
+  close(fd);
+  if (n < 0)
+    return;
+  if (filetype_is_text(buf, n)) {
+    t->kind = FILETYPE_TEXT;
+    snprintf(t->mime, sizeof(t->mime), n == 0 ? "inode/x-empty" : "text/plain");
+    return;
+  }
+  if (*magic == NULL && !*tried) {
+    *tried = 1;
+    *magic = magic_open(MAGIC_MIME_TYPE | MAGIC_ERROR);
+    if (*magic != NULL && magic_load(*magic, NULL) < 0) {
+      magic_close(*magic);
+      *magic = NULL;
+    }
+  }
+  if (*magic != NULL)
+    mime = magic_buffer(*magic, buf, n);
+  snprintf(t->mime, sizeof(t->mime), "%s", mime ? mime : "application/octet-stream");
+  t->kind = FILETYPE_BINARY;
+  for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); i++) {
+    if (strncmp(t->mime, kinds[i].prefix, strlen(kinds[i].prefix)) == 0) {
+      t->kind = kinds[i].kind;
+      break;
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  unsigned char buf[FILETYPE_PROBE];
+  magic_t magic = NULL;
+  request_t r;
+  int tried = 0;
+  filetype_t t;
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!quit && queued == 0)
+      pthread_cond_wait(&wake, &lock);
+    if (quit)
+      break;
+    r = queue[(tail + --queued) % FILETYPE_QUEUE];
+    pthread_mutex_unlock(&lock);
+
+    uint64_t start = trace_now();
+    classify(&magic, &tried, r.path, buf, &t);
+    trace_span("filetype", start);
+
+    // Only a file still waiting for its type changes what is shown.
+    pthread_mutex_lock(&lock);
+    slot_t *s = find(r.dev, r.ino, r.mtime_sec, r.mtime_nsec);
+    if (s != NULL && s->type.kind == FILETYPE_PENDING) {
+      s->type = t;
+      generation++;
+    }
+  }
+  pthread_mutex_unlock(&lock);
+  if (magic != NULL)
+    magic_close(magic);
+  return NULL;
+}
+
+int filetype_init(void) {
+  for (int i = 0; i < FILETYPE_THREADS; i++) {
+    if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0)
+      break;
+    nworkers++;
+  }
+  return nworkers > 0 ? 0 : -1;
+}
+
+int filetype_get(uint64_t dev, uint64_t ino, int64_t mtime_sec,
+                 int64_t mtime_nsec, const char *path, filetype_t *out) {
+  int hit = 0;
+
+  pthread_mutex_lock(&lock);
+  slot_t *s = find(dev, ino, mtime_sec, mtime_nsec);
+  if (s != NULL) {
+    s->last_use = ++uses;
+    hit = s->type.kind != FILETYPE_PENDING;
+    if (hit)
+      *out = s->type;
+  } else if (nworkers > 0 && (s = victim(dev, ino)) != NULL) {
+    if (queued == FILETYPE_QUEUE) {
+      // Forget the oldest request so it is asked for again if still wanted.
+      request_t *old = &queue[tail];
+      slot_t *o = find(old->dev, old->ino, old->mtime_sec, old->mtime_nsec);
+      if (o != NULL && o->type.kind == FILETYPE_PENDING)
+        o->used = 0;
+      tail = (tail + 1) % FILETYPE_QUEUE;
+      queued--;
+    }
+    request_t *r = &queue[(tail + queued++) % FILETYPE_QUEUE];
+    r->dev = dev;
+    r->ino = ino;
+    r->mtime_sec = mtime_sec;
+    r->mtime_nsec = mtime_nsec;
+    snprintf(r->path, sizeof(r->path), "%s", path);
+    s->dev = dev;
+    s->ino = ino;
+    s->mtime_sec = mtime_sec;
+    s->mtime_nsec = mtime_nsec;
+    s->used = 1;
+    s->last_use = ++uses;
+    s->type.kind = FILETYPE_PENDING;
+    pthread_cond_signal(&wake);
+  }
+  pthread_mutex_unlock(&lock);
+  return hit;
+}
+
+unsigned long filetype_generation(void) {
+  pthread_mutex_lock(&lock);
+  unsigned long g = generation;
+  pthread_mutex_unlock(&lock);
+  return g;
+}
+
+void filetype_shutdown(void) {
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  queued = 0;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(workers[i], NULL);
+  nworkers = 0;
+}
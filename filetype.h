@@ -0,0 +1,47 @@
+#ifndef FILETYPE_H
+#define FILETYPE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FILETYPE_PENDING -1
+#define FILETYPE_UNKNOWN 0
+#define FILETYPE_TEXT 1
+#define FILETYPE_BINARY 2
+#define FILETYPE_EXEC 3
+#define FILETYPE_IMAGE 4
+#define FILETYPE_MEDIA 5
+#define FILETYPE_ARCHIVE 6
+#define FILETYPE_DOCUMENT 7
+
+// What a file holds, judged from its first FILETYPE_PROBE bytes. kind is
+// FILETYPE_UNKNOWN if it could not be read.
+typedef struct filetype_ {
+  int kind;
+  char mime[64];
+} filetype_t;
+
+// Starts FILETYPE_THREADS workers. Each loads its own libmagic database on
+// its first file, since a magic_t cannot be shared between threads.
+int filetype_init(void);
+
+// Copies the type of the regular file at path, known by (dev, ino) and its
+// mtime, into out if it has been classified since it last changed. Returns
+// 1 then; otherwise queues it for a worker and returns 0. Never blocks on
+// the file.
+int filetype_get(uint64_t dev, uint64_t ino, int64_t mtime_sec,
+                 int64_t mtime_nsec, const char *path, filetype_t *out);
+
+// Changes whenever a worker classifies a file, so callers can redraw.
+unsigned long filetype_generation(void);
+
+// Returns 1 if the n bytes at p look like text: valid UTF-8 with no control
+// characters other than whitespace, backspace and escape. A sequence cut
+// off at the end is allowed. Runs of ASCII are checked 16 bytes at a time
+// with SSE2 on x86-64.
+int filetype_is_text(const unsigned char *p, size_t n);
+
+// Drops queued work and joins the workers.
+void filetype_shutdown(void);
+
+#endif
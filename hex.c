@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#include <emmintrin.h>
+#endif
+
+#include "config.h"
+#include "hex.h"
+#include "match.h"
+
+// Columns before the first byte: offset and two spaces.
+#define OFFSET_COLS 14
+
+static const char digits[] = "0123456789abcdef";
+
+int hex_bytes_per_row(int width) {
+  int bpr = HEX_MAX_ROW;
+  while (bpr > 8 && hex_row_len(bpr) > width)
+    bpr -= 8;
+  return bpr;
+}
+
+int hex_row_len(int bpr) {
+  return hex_text_column(bpr, bpr) + 1;
+}
+
+int hex_column(int bpr, int i) {
+  (void)bpr;
+  return OFFSET_COLS + 3 * i + i / 8;
+}
+
+int hex_text_column(int bpr, int i) {
+  return hex_column(bpr, bpr) + 1 + i;
+}
+
+void hex_encode(const unsigned char *p, size_t n, char *out) {
+  size_t i = 0;
+#if defined(__x86_64__)
+  // Each nibble becomes '0' + n, plus 39 more to reach 'a' when n > 9.
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  const __m128i nine = _mm_set1_epi8(9);
+  const __m128i zero = _mm_set1_epi8('0');
+  const __m128i gap = _mm_set1_epi8('a' - '0' - 10);
+  for (; i + 16 <= n; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), mask);
+    __m128i lo = _mm_and_si128(v, mask);
+    hi = _mm_add_epi8(_mm_add_epi8(hi, zero), _mm_and_si128(_mm_cmpgt_epi8(hi, nine), gap));
+    lo = _mm_add_epi8(_mm_add_epi8(lo, zero), _mm_and_si128(_mm_cmpgt_epi8(lo, nine), gap));
+    _mm_storeu_si128((__m128i *)(out + 2 * i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128((__m128i *)(out + 2 * i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+#endif
+  for (; i < n; i++) {
+    out[2 * i] = digits[p[i] >> 4];
+    out[2 * i + 1] = digits[p[i] & 15];
+  }
+}
+
+void hex_format_row(char *out, uint64_t off, const unsigned char *p, int n, int bpr) {
+  char pairs[2 * HEX_MAX_ROW];
+  int len = hex_row_len(bpr);
+
+  memset(out, ' ', len);
+  for (int shift = 44, i = 0; shift >= 0; shift -= 4, i++)
+    out[i] = digits[(off >> shift) & 15];
+  hex_encode(p, n, pairs);
+  for (int i = 0; i < n; i++) {
+    memcpy(out + hex_column(bpr, i), pairs + 2 * i, 2);
+    out[hex_text_column(bpr, i)] = p[i] >= 32 && p[i] < 127 ? p[i] : '.';
+  }
+  out[hex_text_column(bpr, 0) - 1] = '|';
+  out[len - 1] = '|';
+  out[len] = '\0';
+}
+
+static int nibble(char c) {
+  if (c >= '0' && c <= '9')
+    return c - '0';
+  if (c >= 'a' && c <= 'f')
+    return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F')
+    return c - 'A' + 10;
+  return -1;
+}
+
+int hex_parse_pattern(const char *in, unsigned char *out, int size) {
+  int n = 0;
+
+  if (in[0] == '"') {
+    n = strlen(in + 1);
+    if (n > 0 && in[n] == '"')
+      n--;
+    if (n == 0 || n > size)
+      return -1;
+    memcpy(out, in + 1, n);
+    return n;
+  }
+  while (*in != '\0') {
+    if (*in == ' ') {
+      in++;
+      continue;
+    }
+    int hi = nibble(in[0]), lo = hi >= 0 ? nibble(in[1]) : -1;
+    if (lo < 0 || n == size)
+      return -1;
+    out[n++] = hi << 4 | lo;
+    in += 2;
+  }
+  return n > 0 ? n : -1;
+}
+
+int64_t hex_search(int fd, uint64_t from, uint64_t size, const unsigned char *pat,
+                   int m, int (*keep_going)(uint64_t pos, void *arg), void *arg) {
+  // Each read repeats the last m - 1 bytes of the one before, so a match
+  // across two chunks is still found.
+  char *buf = malloc(HEX_SEARCH_CHUNK + m);
+  uint64_t pos = from;
+  int64_t found = -1;
+
+  if (buf == NULL)
+    return -2;
+  while (pos + m <= size) {
+    size_t want = size - pos < (uint64_t)HEX_SEARCH_CHUNK + m - 1
+                      ? size - pos
+                      : (size_t)HEX_SEARCH_CHUNK + m - 1;
+    ssize_t got = pread(fd, buf, want, pos);
+    if (got < m) {
+      found = got < 0 ? -2 : -1;
+      break;
+    }
+    const char *hit = match_find(buf, got, (const char *)pat, m);
+    if (hit != NULL) {
+      found = pos + (hit - buf);
+      break;
+    }
+    pos += got - m + 1;
+    if (!keep_going(pos, arg)) {
+      found = -2;
+      break;
+    }
+  }
+  free(buf);
+  return found;
+}
@@ -0,0 +1,42 @@
+#ifndef HEX_H
+#define HEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Rows show a 12-digit offset, the bytes in hex with a wider gap every 8,
+// and the same bytes as text between bars.
+#define HEX_MAX_ROW 64
+
+// Bytes per row that fit in width columns: a multiple of 8 from 8 to
+// HEX_MAX_ROW.
+int hex_bytes_per_row(int width);
+
+// Columns taken by a row of bpr bytes, and where byte i of it starts in the
+// hex part and in the text part.
+int hex_row_len(int bpr);
+int hex_column(int bpr, int i);
+int hex_text_column(int bpr, int i);
+
+// Writes 2 * n hex digits for the n bytes at p to out. Sixteen bytes at a
+// time are converted with SSE2 on x86-64.
+void hex_encode(const unsigned char *p, size_t n, char *out);
+
+// Formats the n <= bpr bytes at p, found at off, as one row of
+// hex_row_len(bpr) columns into out, NUL-terminated.
+void hex_format_row(char *out, uint64_t off, const unsigned char *p, int n, int bpr);
+
+// Parses a byte pattern typed by the user: text after a leading '"', or
+// otherwise pairs of hex digits, spaces allowed between them. Returns its
+// length, or -1 if it is empty, malformed or longer than size.
+int hex_parse_pattern(const char *in, unsigned char *out, int size);
+
+// Finds the first occurrence of the m bytes of pat in fd at or after from,
+// reading it with pread() HEX_SEARCH_CHUNK bytes at a time. keep_going is
+// called with the offset reached after every chunk and stops the search by
+// returning 0. Returns the offset found, -1 if there is none and -2 if the
+// search was stopped or a read failed.
+int64_t hex_search(int fd, uint64_t from, uint64_t size, const unsigned char *pat,
+                   int m, int (*keep_going)(uint64_t pos, void *arg), void *arg);
+
+#endif
@@ -0,0 +1,132 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "config.h"
+#include "info.h"
+#include "trace.h"
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static char wanted[PATH_MAX];
+static int have_request = 0, quit = 0, started = 0;
+static int cancel = 0;
+static unsigned long generation = 0;
+static info_t current;
+
+// Runs on the du_walk() thread with the totals gathered so far.
+static void progress(const du_result_t *partial, void *arg) {
+  pthread_mutex_lock(&lock);
+  if (!__atomic_load_n(&cancel, __ATOMIC_RELAXED)) {
+    current.totals = *partial;
+    current.generation = ++generation;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void compute(const char *path) {
+  du_options_t opt = {0};
+  du_result_t totals, estimate;
+  struct stat st;
+  int cached = 0, rc, err = 0;
+
+  if (lstat(path, &st) < 0) {
+    err = errno;
+  } else {
+    if (S_ISDIR(st.st_mode))
+      cached = du_lookup_cache(path, &estimate);
+    pthread_mutex_lock(&lock);
+    if (!cancel) {
+      current.st = st;
+      current.cached = cached;
+      if (cached)
+        current.estimate = estimate;
+      current.generation = ++generation;
+    }
+    pthread_mutex_unlock(&lock);
+
+    opt.use_cache = 1;
+    opt.cancel = &cancel;
+    opt.progress = progress;
+    opt.progress_ms = INFO_PROGRESS_MS;
+    uint64_t t = trace_now();
+    rc = du_walk(path, &opt, &totals);
+    trace_span("info", t);
+    if (rc < 0)
+      err = errno;
+  }
+
+  pthread_mutex_lock(&lock);
+  if (!cancel) {
+    current.state = err ? INFO_ERROR : INFO_DONE;
+    current.error = err;
+    if (!err)
+      current.totals = totals;
+    current.generation = ++generation;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void *worker_main(void *arg) {
+  char path[PATH_MAX];
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!have_request && !quit)
+      pthread_cond_wait(&wake, &lock);
+    if (quit)
+      break;
+    memcpy(path, wanted, sizeof(path));
+    have_request = 0;
+    __atomic_store_n(&cancel, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&lock);
+    compute(path);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int info_init(void) {
+  if (pthread_create(&worker, NULL, worker_main, NULL) != 0)
+    return -1;
+  started = 1;
+  return 0;
+}
+
+void info_request(const char *path) {
+  pthread_mutex_lock(&lock);
+  if (strcmp(current.path, path) == 0 && current.state != INFO_IDLE) {
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  __atomic_store_n(&cancel, 1, __ATOMIC_RELAXED);
+  snprintf(wanted, sizeof(wanted), "%s", path);
+  have_request = 1;
+  memset(&current, 0, sizeof(current));
+  snprintf(current.path, sizeof(current.path), "%s", path);
+  current.state = INFO_RUNNING;
+  current.generation = ++generation;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+}
+
+void info_snapshot(info_t *out) {
+  pthread_mutex_lock(&lock);
+  *out = current;
+  pthread_mutex_unlock(&lock);
+}
+
+void info_shutdown(void) {
+  if (!started)
+    return;
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  __atomic_store_n(&cancel, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(worker, NULL);
+  started = 0;
+}
@@ -0,0 +1,42 @@
+#ifndef INFO_H
+#define INFO_H
+
+#include <limits.h>
+#include <sys/stat.h>
+
+#include "du.h"
+
+#define INFO_IDLE 0
+#define INFO_RUNNING 1
+#define INFO_DONE 2
+#define INFO_ERROR 3
+
+// State of the info pane computation for one path. totals holds partial
+// results while state is INFO_RUNNING. cached is set when the size cache
+// already had an answer for the directory, which is then in estimate.
+typedef struct info_ {
+  char path[PATH_MAX];
+  int state;
+  int error;
+  int cached;
+  struct stat st;
+  du_result_t totals;
+  du_result_t estimate;
+  unsigned long generation;
+} info_t;
+
+// Starts the background worker.
+int info_init(void);
+
+// Asks for the info of path. A different path cancels the walk in progress;
+// the same path again is a no-op.
+void info_request(const char *path);
+
+// Copies the current state into out. The generation changes whenever the
+// state does, so callers can skip redrawing an unchanged pane.
+void info_snapshot(info_t *out);
+
+// Cancels any walk and joins the worker.
+void info_shutdown(void);
+
+#endif
@@ -0,0 +1,431 @@
+#include <errno.h>
+#include <libgen.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "copy.h"
+#include "jobs.h"
+#include "pool.h"
+#include "rmtree.h"
+#include "trace.h"
+
+typedef struct job_ {
+  job_info_t info;
+  char src[PATH_MAX];
+  char dst[PATH_MAX];
+  dev_t dev;
+  int cancel;
+  struct timespec started;
+  // A batch works on names in src, going to dst if it copies or moves.
+  char **names;
+  mode_t mode;
+  struct job_ *next;
+} job_t;
+
+// One entry of a batch, with where it lives on disk.
+typedef struct batch_item_ {
+  job_t *j;
+  int dirfd;
+  const char *name;
+  dev_t dev;
+  ino_t ino;
+} batch_item_t;
+
+// A batch being run: its entries in inode order, and the next one a free
+// worker takes.
+typedef struct batch_ {
+  batch_item_t *items;
+  int n, next;
+} batch_t;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[JOBS_THREADS];
+static int nworkers = 0, quit = 0, next_id = 1;
+static job_t *queue = NULL;
+static job_info_t last_done;
+static int have_done = 0;
+static unsigned long generation = 0;
+
+static double elapsed(const struct timespec *since) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) + (now.tv_nsec - since->tv_nsec) / 1e9;
+}
+
+// Runs on the job's worker after every chunk it copies.
+static void progress(const copy_stats_t *stats, void *arg) {
+  job_t *j = arg;
+  double secs = elapsed(&j->started);
+
+  pthread_mutex_lock(&lock);
+  j->info.bytes = stats->bytes;
+  j->info.bytes_total = stats->bytes_total;
+  j->info.files = stats->files;
+  j->info.errors = stats->errors;
+  j->info.rate = secs > 0.5 ? stats->bytes / secs : -1;
+  j->info.eta = j->info.rate > 0 && stats->bytes_total > stats->bytes
+                    ? (long)((stats->bytes_total - stats->bytes) / j->info.rate)
+                    : -1;
+  generation++;
+  pthread_mutex_unlock(&lock);
+}
+
+// Runs on the thread deleting a tree, every INFO_PROGRESS_MS.
+static void rm_progress(const rm_result_t *partial, void *arg) {
+  job_t *j = arg;
+  pthread_mutex_lock(&lock);
+  j->info.files = partial->files + partial->dirs;
+  j->info.errors = partial->errors;
+  generation++;
+  pthread_mutex_unlock(&lock);
+}
+
+static int by_inode(const void *a, const void *b) {
+  const batch_item_t *x = a, *y = b;
+  if (x->dev != y->dev)
+    return x->dev < y->dev ? -1 : 1;
+  return (x->ino > y->ino) - (x->ino < y->ino);
+}
+
+// Applies the batch's job to one entry.
+static void batch_entry(batch_item_t *it) {
+  job_t *j = it->j;
+  copy_options_t opt = {0};
+  rm_options_t rm = {0};
+  rm_result_t removed;
+  char src[PATH_MAX], dst[PATH_MAX];
+  int rc = 0;
+
+  if (__atomic_load_n(&j->cancel, __ATOMIC_RELAXED))
+    return;
+  snprintf(src, sizeof(src), "%s/%s", j->src, it->name);
+  snprintf(dst, sizeof(dst), "%s/%s", j->dst, it->name);
+  opt.cancel = &j->cancel;
+  rm.cancel = &j->cancel;
+  // Each worker already has an entry of its own to remove.
+  rm.threads = 1;
+  switch (j->info.kind) {
+    case JOB_COPY:
+      rc = copy_tree(src, dst, &opt, NULL);
+      break;
+    case JOB_MOVE:
+      rc = move_tree(src, dst, &opt, NULL);
+      break;
+    case JOB_DELETE:
+      rc = rm_tree(src, &rm, &removed);
+      break;
+    case JOB_CHMOD:
+      rc = fchmodat(it->dirfd, it->name, j->mode, 0);
+      break;
+  }
+
+  pthread_mutex_lock(&lock);
+  j->info.files++;
+  if (rc < 0)
+    j->info.errors++;
+  generation++;
+  pthread_mutex_unlock(&lock);
+}
+
+// Runs on each batch pool worker. Entries are taken one at a time from a
+// shared cursor, so they are started in inode order whichever worker is
+// free.
+static void batch_task(void *arg, int worker) {
+  batch_t *b = arg;
+  int i;
+
+  while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->n)
+    batch_entry(&b->items[i]);
+}
+
+// Works through a batch in inode order on a pool of its own.
+static int run_batch(job_t *j) {
+  struct stat st;
+  int n = j->info.count, dirfd = open(j->src, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  batch_item_t *items = calloc(n, sizeof(batch_item_t));
+  pool_t *pool = items != NULL ? pool_create(JOBS_BATCH_THREADS) : NULL;
+
+  if (dirfd < 0 || pool == NULL) {
+    int err = dirfd < 0 ? errno : ENOMEM;
+    if (dirfd >= 0)
+      close(dirfd);
+    free(items);
+    errno = err;
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    items[i].j = j;
+    items[i].dirfd = dirfd;
+    items[i].name = j->names[i];
+    if (fstatat(dirfd, j->names[i], &st, AT_SYMLINK_NOFOLLOW) == 0) {
+      items[i].dev = st.st_dev;
+      items[i].ino = st.st_ino;
+    }
+  }
+  qsort(items, n, sizeof(batch_item_t), by_inode);
+  batch_t b = {items, n, 0};
+  int started = 0;
+  for (int i = 0; i < pool_threads(pool); i++)
+    started += pool_submit(pool, batch_task, &b) == 0;
+  if (started == 0)
+    batch_task(&b, 0);
+  pool_destroy(pool);
+  close(dirfd);
+  free(items);
+  if (j->cancel) {
+    errno = ECANCELED;
+    return -1;
+  }
+  return 0;
+}
+
+static int run(job_t *j) {
+  copy_options_t opt = {0};
+  copy_stats_t stats;
+  rm_options_t rm = {0};
+  rm_result_t removed;
+
+  opt.cancel = &j->cancel;
+  opt.progress = progress;
+  opt.progress_arg = j;
+  if (j->names != NULL)
+    return run_batch(j);
+  switch (j->info.kind) {
+    case JOB_COPY:
+      return copy_tree(j->src, j->dst, &opt, &stats);
+    case JOB_MOVE:
+      return move_tree(j->src, j->dst, &opt, &stats);
+    case JOB_DELETE:
+      rm.cancel = &j->cancel;
+      rm.progress = rm_progress;
+      rm.progress_arg = j;
+      rm.progress_ms = INFO_PROGRESS_MS;
+      int rc = rm_tree(j->src, &rm, &removed);
+      rm_progress(&removed, j);
+      return rc;
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+// First queued job whose filesystem has a free slot.
+static job_t *runnable(void) {
+  for (job_t *j = queue; j != NULL; j = j->next) {
+    if (j->info.state != JOB_QUEUED)
+      continue;
+    int busy = 0;
+    for (job_t *k = queue; k != NULL; k = k->next)
+      busy += k->info.state == JOB_RUNNING && k->dev == j->dev;
+    if (busy < JOBS_PER_FS)
+      return j;
+  }
+  return NULL;
+}
+
+static void free_job(job_t *j) {
+  for (int i = 0; j->names != NULL && i < j->info.count; i++)
+    free(j->names[i]);
+  free(j->names);
+  free(j);
+}
+
+static void unlink_job(job_t *j) {
+  job_t **p = &queue;
+  while (*p != j)
+    p = &(*p)->next;
+  *p = j->next;
+}
+
+static void *worker_main(void *arg) {
+  job_t *j;
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!quit && (j = runnable()) == NULL)
+      pthread_cond_wait(&wake, &lock);
+    if (quit)
+      break;
+    j->info.state = JOB_RUNNING;
+    clock_gettime(CLOCK_MONOTONIC, &j->started);
+    generation++;
+    pthread_mutex_unlock(&lock);
+
+    static const char *spans[] = {"copy", "move", "delete", "chmod"};
+    uint64_t t = trace_now();
+    int rc = run(j);
+    int err = errno;
+    trace_span(spans[j->info.kind], t);
+
+    pthread_mutex_lock(&lock);
+    if (rc < 0)
+      j->info.state = err == ECANCELED || j->cancel ? JOB_CANCELLED : JOB_FAILED;
+    else
+      j->info.state = JOB_DONE;
+    j->info.error = rc < 0 ? err : 0;
+    j->info.eta = -1;
+    unlink_job(j);
+    last_done = j->info;
+    have_done = 1;
+    generation++;
+    free_job(j);
+    // A slot on this filesystem just came free.
+    pthread_cond_broadcast(&wake);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int jobs_init(void) {
+  for (int i = 0; i < JOBS_THREADS; i++) {
+    if (pthread_create(&workers[i], NULL, worker_main, NULL) != 0)
+      break;
+    nworkers++;
+  }
+  return nworkers > 0 ? 0 : -1;
+}
+
+// Links j into the queue and wakes a worker for it.
+static int enqueue(job_t *j) {
+  pthread_mutex_lock(&lock);
+  j->info.id = next_id++;
+  job_t **p = &queue;
+  while (*p != NULL)
+    p = &(*p)->next;
+  *p = j;
+  generation++;
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+  return j->info.id;
+}
+
+int job_submit(int kind, const char *src, const char *dst) {
+  char dir[PATH_MAX];
+  struct stat st;
+  job_t *j = calloc(1, sizeof(job_t));
+
+  if (j == NULL || nworkers == 0) {
+    free(j);
+    return -1;
+  }
+  snprintf(j->src, sizeof(j->src), "%s", src);
+  snprintf(j->dst, sizeof(j->dst), "%s", dst ? dst : "");
+  snprintf(dir, sizeof(dir), "%s", src);
+  snprintf(j->info.name, sizeof(j->info.name), "%s", basename(dir));
+  j->info.kind = kind;
+  j->info.state = JOB_QUEUED;
+  j->info.count = 1;
+  j->info.rate = -1;
+  j->info.eta = -1;
+  // Jobs are limited by the filesystem they write to.
+  if (kind == JOB_DELETE) {
+    if (lstat(src, &st) == 0)
+      j->dev = st.st_dev;
+  } else {
+    snprintf(dir, sizeof(dir), "%s", dst);
+    if (stat(dirname(dir), &st) == 0)
+      j->dev = st.st_dev;
+  }
+  return enqueue(j);
+}
+
+int job_submit_batch(int kind, const char *dir, char *const *names, int n,
+                     const char *dst_dir, mode_t mode) {
+  struct stat st;
+  job_t *j = calloc(1, sizeof(job_t));
+
+  if (j == NULL || nworkers == 0 || n <= 0 ||
+      (j->names = calloc(n, sizeof(char *))) == NULL) {
+    free(j);
+    return -1;
+  }
+  for (int i = 0; i < n; i++) {
+    if ((j->names[i] = strdup(names[i])) == NULL) {
+      j->info.count = i;
+      free_job(j);
+      return -1;
+    }
+  }
+  snprintf(j->src, sizeof(j->src), "%s", dir);
+  snprintf(j->dst, sizeof(j->dst), "%s", dst_dir ? dst_dir : "");
+  snprintf(j->info.name, sizeof(j->info.name), "%d entries", n);
+  j->info.kind = kind;
+  j->info.state = JOB_QUEUED;
+  j->info.count = n;
+  j->info.rate = -1;
+  j->info.eta = -1;
+  j->mode = mode;
+  if (stat(kind == JOB_COPY || kind == JOB_MOVE ? j->dst : j->src, &st) == 0)
+    j->dev = st.st_dev;
+  return enqueue(j);
+}
+
+void job_cancel(int id) {
+  pthread_mutex_lock(&lock);
+  for (job_t *j = queue; j != NULL; j = j->next) {
+    if (j->info.id != id)
+      continue;
+    if (j->info.state == JOB_QUEUED) {
+      j->info.state = JOB_CANCELLED;
+      unlink_job(j);
+      last_done = j->info;
+      have_done = 1;
+      free_job(j);
+    } else {
+      __atomic_store_n(&j->cancel, 1, __ATOMIC_RELAXED);
+    }
+    generation++;
+    break;
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+int jobs_list(job_info_t *out, int max) {
+  int n = 0;
+  pthread_mutex_lock(&lock);
+  for (job_t *j = queue; j != NULL; j = j->next, n++)
+    if (n < max)
+      out[n] = j->info;
+  pthread_mutex_unlock(&lock);
+  return n;
+}
+
+int jobs_last_done(job_info_t *out) {
+  pthread_mutex_lock(&lock);
+  int have = have_done;
+  if (have)
+    *out = last_done;
+  pthread_mutex_unlock(&lock);
+  return have;
+}
+
+unsigned long jobs_generation(void) {
+  pthread_mutex_lock(&lock);
+  unsigned long g = generation;
+  pthread_mutex_unlock(&lock);
+  return g;
+}
+
+void jobs_shutdown(void) {
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  for (job_t *j = queue; j != NULL; j = j->next)
+    __atomic_store_n(&j->cancel, 1, __ATOMIC_RELAXED);
+  pthread_cond_broadcast(&wake);
+  pthread_mutex_unlock(&lock);
+  for (int i = 0; i < nworkers; i++)
+    pthread_join(workers[i], NULL);
+  nworkers = 0;
+  while (queue != NULL) {
+    job_t *j = queue;
+    queue = j->next;
+    free_job(j);
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define JOB_COPY 0
+#define JOB_MOVE 1
+#define JOB_DELETE 2
+#define JOB_CHMOD 3
+
+#define JOB_QUEUED 0
+#define JOB_RUNNING 1
+#define JOB_DONE 2
+#define JOB_FAILED 3
+#define JOB_CANCELLED 4
+
+// State of one job as shown in the status line. rate is in bytes per
+// second and eta in seconds, -1 while unknown. A batch covers count
+// entries, of which files are done so far.
+typedef struct job_info_ {
+  int id;
+  int kind;
+  int state;
+  int error;
+  char name[NAME_MAX + 1];
+  uint64_t bytes, bytes_total;
+  uint64_t files, errors;
+  int count;
+  double rate;
+  long eta;
+} job_info_t;
+
+// Starts the worker threads.
+int jobs_init(void);
+
+// Queues an operation on src: copying or moving it to the full path dst,
+// or deleting it (dst unused). Jobs run in the background, at most
+// JOBS_PER_FS at a time on each filesystem. Returns the job id, or -1.
+int job_submit(int kind, const char *src, const char *dst);
+
+// Queues one operation on n entries of dir as a single job: copying or
+// moving them into dst_dir, deleting them, or setting their permissions to
+// mode. The entries are worked through in device and inode order, for
+// locality on disk, JOBS_BATCH_THREADS at a time. Returns the job id, or -1.
+int job_submit_batch(int kind, const char *dir, char *const *names, int n,
+                     const char *dst_dir, mode_t mode);
+
+// Stops a queued or running job. A cancelled copy keeps the files it had
+// finished and removes the one in progress.
+void job_cancel(int id);
+
+// Copies up to max unfinished jobs, oldest first, into out. Returns how
+// many unfinished jobs there are in all.
+int jobs_list(job_info_t *out, int max);
+
+// Copies the most recently finished job into out. Returns 0 if no job has
+// finished yet.
+int jobs_last_done(job_info_t *out);
+
+// Changes whenever any job does, so callers can skip redrawing.
+unsigned long jobs_generation(void);
+
+// Cancels every job and joins the workers.
+void jobs_shutdown(void);
+
+#endif
@@ -1,10 +1,14 @@
+#include <errno.h>
 #include <fcntl.h>   
+#include <fnmatch.h>
 #include <limits.h>  
 #include <locale.h>  
 #include <magic.h>
+#include <poll.h>
 #include <pwd.h>      
 #include <stdlib.h>
 #include <sys/types.h>  
+#include <time.h>
 #include <sys/wait.h>    
 
 // Feature: ncurses UI
@@ -24,7 +28,7 @@
 
 // Feature: Directory navigation
 // Description: Allows users to navigate through directories using arrow keys and enter key.
-// Functions used: get_no_files_in_directory(), get_files(), handle_enter(), show_file_info()
+// Functions used: dircache_get(), dir_listing_read(), handle_enter(), show_file_info()
 #include <dirent.h> 
 #include <sys/stat.h>   
 #include <unistd.h>    
@@ -35,7 +39,22 @@
 // Functions used: malloc(), free()
 #include <stdlib.h>
 
+#include "batch.h"
 #include "config.h"
+#include "copy.h"
+#include "dircache.h"
+#include "du.h"
+#include "ducache.h"
+#include "filetype.h"
+#include "hex.h"
+#include "info.h"
+#include "jobs.h"
+#include "pager.h"
+#include "paths.h"
+#include "search.h"
+#include "sort.h"
+#include "trace.h"
+#include "trash.h"
 
 #define isDir(mode) (S_ISDIR(mode))
 
@@ -47,263 +66,122 @@ void init_curses() {
   start_color();
   init_pair(1, DIR_COLOR, 0);
   init_pair(3, STATUS_SELECTED_COLOR, 0);
+  init_pair(10 + FILETYPE_EXEC, EXEC_COLOR, 0);
+  init_pair(10 + FILETYPE_IMAGE, IMAGE_COLOR, 0);
+  init_pair(10 + FILETYPE_MEDIA, MEDIA_COLOR, 0);
+  init_pair(10 + FILETYPE_ARCHIVE, ARCHIVE_COLOR, 0);
+  init_pair(10 + FILETYPE_DOCUMENT, DOCUMENT_COLOR, 0);
 }
 
 struct stat file_stats;
 WINDOW *current_win, *info_win, *path_win;
 int selection, maxx, maxy, len = 0, start = 0;
-size_t total_files = 0;
+
+// The directory on screen. Its path is interned, so going up follows the
+// parent link; cwd spells it out with a trailing '/'.
+typedef struct directory_ {
+  path_t *dir;
+  char *cwd;
+} directory_t;
+
 directory_t *current_directory_ = NULL;
+unsigned long info_shown = 0;
+unsigned long jobs_shown = 0;
+int job_focus = 0;
+unsigned long types_shown = 0;
+int show_details = 0;
+int show_overlay = 0;
+
+// What the last frame cost, for the overlay.
+typedef struct frame_stats_ {
+  uint64_t list, sort, stat, render, total;
+  uint64_t counts[TRACE_COUNTERS];
+} frame_stats_t;
+
+frame_stats_t last_frame;
 
 void init() {
-  current_directory_ = (directory_t *)malloc(sizeof(directory_t));
+  current_directory_ = (directory_t *)calloc(1, sizeof(directory_t));
   if (current_directory_ == NULL) {
     printf("Error Occured.\n");
     exit(0);
   }
 }
 
-void init_windows() {
+// Longest row of the list pane, in bytes.
+#define LIST_ROW_MAX 512
+
+// What a row of the list pane showed when it was last drawn.
+typedef struct list_row_ {
+  char text[LIST_ROW_MAX];
+  attr_t attr;
+  short color;
+  int marked;
+} list_row_t;
+
+list_row_t *drawn_rows = NULL;
+int rows_valid = 0;
+
+// Creates the panes to fit the terminal, at start and whenever it has been
+// resized or a viewer has resized them. Otherwise they are kept, so that
+// curses only sends what changed between frames.
+void layout_windows() {
+  int h, w, cy = 0, cx = 0;
+  getmaxyx(stdscr, h, w);
+  if (current_win != NULL)
+    getmaxyx(current_win, cy, cx);
+  if (current_win != NULL && h - 2 == maxy && w == maxx && cy == maxy &&
+      cx == maxx / 2)
+    return;
+  if (current_win != NULL) {
+    delwin(current_win);
+    delwin(path_win);
+    delwin(info_win);
+  }
+  maxy = h - 2;
+  maxx = w;
   current_win = newwin(maxy, maxx / 2, 0, 0);
-  refresh();
   path_win = newwin(2, maxx, maxy, 0);
-  refresh();
   info_win = newwin(maxy, maxx / 2, 0, maxx / 2);
-  refresh();
   keypad(current_win, TRUE);
+  wtimeout(current_win, INPUT_POLL_MS);
+  free(drawn_rows);
+  drawn_rows = calloc(maxy > 0 ? maxy : 1, sizeof(list_row_t));
+  rows_valid = 0;
+  // Keep the cursor in view of the new height.
+  if (selection >= start + maxy - 2 || selection < start)
+    start = selection > maxy / 2 ? selection - maxy / 2 : 0;
 }
 
-void refreshWindows() {
-  box(current_win, '|', '-');
-  box(info_win, '|', '-');
-  wrefresh(current_win);
-  wrefresh(path_win);
-  wrefresh(info_win);
-}
-
-typedef struct {
-    char* directory;
-    char** target;
-    int* len;
-} ThreadData;
-
-void* scan_directory(void* arg) {
-    ThreadData* data = (ThreadData*)arg;
-    DIR* dir_;
-    struct dirent* dir_entry;
-
-    dir_ = opendir(data->directory);
-    if (dir_ == NULL) {
-        pthread_exit(NULL);
-    }
-
-    while ((dir_entry = readdir(dir_)) != NULL) {
-        if (strcmp(dir_entry->d_name, ".") != 0) {
-            data->target[(*data->len)++] = strdup(dir_entry->d_name);
-        }
-    }
-
-    closedir(dir_);
-    pthread_exit(NULL);
-}
-
-// Scans the specified directory and retrieves the names of all files and directories in it using multiple threads for parallel processing.
-int get_files_multithreaded(char* directory, char* target[], int* len) {
-    const int NUM_THREADS = 4;
-    pthread_t threads[NUM_THREADS];
-    ThreadData thread_data[NUM_THREADS];
-    int *thread_len = malloc(NUM_THREADS * sizeof(int));
-    if (thread_len == NULL) {
-        fprintf(stderr, "Memory allocation failed\n");
-        exit(EXIT_FAILURE);
-    }
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        thread_len[i] = 0;
-    }
-
-    int segment_size = (*len) / NUM_THREADS;
-    int remainder = (*len) % NUM_THREADS;
-
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        thread_data[i].directory = directory;
-        thread_data[i].target = target;
-        thread_data[i].len = &thread_len[i];
-
-        int size = (i == NUM_THREADS - 1) ? segment_size + remainder : segment_size;
-
-        pthread_create(&threads[i], NULL, scan_directory, &thread_data[i]);
-
-        directory += size;
-    }
-
-    for (int i = 0; i < NUM_THREADS; ++i) {
-        pthread_join(threads[i], NULL);
-        (*len) += thread_len[i];
-    }
-
-    free(thread_len); 
-
-    return 1;
-}
-
-// Gets the number of files in a directory.
-int get_no_files_in_directory(char *directory) {
-  int len = 0;
-  DIR *dir_;
-  struct dirent *dir_entry;
-
-  dir_ = opendir(directory);
-  if (dir_ == NULL) {
-    return -1;
-  }
-
-  while ((dir_entry = readdir(dir_)) != NULL) {
-    if (strcmp(dir_entry->d_name, ".") != 0) {
-      len++;
-    }
-  }
-  closedir(dir_);
-  return len;
-}
-
-// Retrieves the names of all files in a directory.
-int get_files(char *directory, char *target[]) {
-  int i = 0;
-  DIR *dir_;
-  struct dirent *dir_entry;
-
-  dir_ = opendir(directory);
-  if (dir_ == NULL) {
-    return -1;
-  }
-
-  while ((dir_entry = readdir(dir_)) != NULL) {
-    if (strcmp(dir_entry->d_name, ".") != 0) {
-      target[i++] = strdup(dir_entry->d_name);
-    }
-  }
-  closedir(dir_);
-  return 1;
+// Sends whatever changed in the panes to the terminal in one update.
+void refresh_windows() {
+  wnoutrefresh(current_win);
+  wnoutrefresh(path_win);
+  wnoutrefresh(info_win);
+  doupdate();
 }
 
 // Scrolls up through the list of files in the current window.
 void scroll_up() {
   selection--;
   selection = (selection < 0) ? 0 : selection;
-  if (len >= maxy - 1)
-    if (selection <= start + maxy / 2) {
-      if (start == 0)
-        wclear(current_win);
-      else {
-        start--;
-        wclear(current_win);
-      }
-    }
+  if (len >= maxy - 1 && selection <= start + maxy / 2 && start > 0)
+    start--;
 }
 // Scrolls down through the list of files in the current window.
 void scroll_down() {
   selection++;
   selection = (selection > len - 1) ? len - 1 : selection;
-  if (len >= maxy - 1)
-    if (selection - 1 > maxy / 2) {
-      if (start + maxy - 2 != len) {
-        start++;
-        wclear(current_win);
-      }
-    }
-}
-
-// Sorts an array of file names alphabetically.
-void sort(char *files_[], int n) {
-  char temp[1000];
-  for (int i = 0; i < n - 1; i++) {
-    for (int j = i + 1; j < n; j++) {
-      if (strcmp(files_[i], files_[j]) > 0) {
-        strcpy(temp, files_[i]);
-        strcpy(files_[i], files_[j]);
-        strcpy(files_[j], temp);
-      }
-    }
-  }
-}
-
-// Checks if a file contains only ASCII characters.
-int check_text(char *path) {
-  FILE *ptr;
-  ptr = fopen(path, "r");
-  int c;
-  while ((c = fgetc(ptr)) != EOF) {
-    if (c < 0 || c > 127) {
-      fclose(ptr);
-      return 0;
-    }
-  }
-  fclose(ptr);
-  return 1;
-}
-
-// Reads and displays the contents of a file in the current window.
-void read_(char *path) {
-  unsigned char buffer[256];
-  int ch;
-  wclear(current_win);
-  wclear(info_win);
-  wresize(current_win, maxy, maxx);
-
-  FILE *ptr;
-  printf("%s\n", path);
-  ptr = fopen(path, "rb");
-  if (ptr == NULL) {
-    perror("Error");
-  }
-  int t = 2, pos = 0, lines = 0, count;
-
-  do {
-    wmove(current_win, 1, 2);
-    wprintw(current_win, "Press \"E\" to Exit (Caps Lock off)");
-    if (check_text(path)) {
-      count = 0;
-      while (fgets(buffer, sizeof(buffer), ptr)) {
-        if (count < pos) {
-          count++;
-          continue;
-        }
-        wmove(current_win, ++t, 1);
-        wprintw(current_win, "%.*s", maxx - 2, buffer);
-      }
-    } else {
-      while (!feof(ptr)) {
-        fread(&buffer, sizeof(unsigned char), maxx - 2, ptr);
-        wmove(current_win, ++t, 1);
-        for (int i = 0; i < maxx - 2; i += 2) {
-          wprintw(current_win, "%02x%02x ", (unsigned int)buffer[i],
-                  (unsigned int)buffer[i + 1]);
-        }
-      }
-    }
-    box(current_win, '|', '-');
-    wrefresh(current_win);
-    ch = wgetch(current_win);
-    wclear(current_win);
-    switch (ch) {
-      case 259:
-        pos = pos == 0 ? 0 : pos - 1;
-        break;
-      case 258:
-        pos++;
-        break;
-    }
-  } while (ch != 'e');
-
-  endwin();
+  if (len >= maxy - 1 && selection - 1 > maxy / 2 && start + maxy - 2 != len)
+    start++;
 }
 
 // Renames a file.
-void rename_file(char *files[]) {
+void rename_file(char *name) {
     char new_name[100];
     int i = 0, c;
 
-    wclear(path_win);
+    werase(path_win);
     wmove(path_win, 1, 0);
     wprintw(path_win, "Rename to: ");
     wrefresh(path_win);
@@ -316,14 +194,14 @@ void rename_file(char *files[]) {
             new_name[i++] = c;
             new_name[i] = '\0';
         }
-        wclear(path_win);
+        werase(path_win);
         wmove(path_win, 1, 0);
         wprintw(path_win, "Rename to: %s", new_name);
         wrefresh(path_win);
     }
 
     if (i == 0) {
-        wclear(path_win);
+        werase(path_win);
         wmove(path_win, 1, 0);
         wprintw(path_win, "Name cannot be empty.");
         wrefresh(path_win);
@@ -331,12 +209,12 @@ void rename_file(char *files[]) {
         return;
     }
 
-    char old_path[1000], new_path[1000];
-    snprintf(old_path, sizeof(old_path), "%s%s", current_directory_->cwd, files[selection]);
+    char old_path[PATH_MAX], new_path[PATH_MAX];
+    snprintf(old_path, sizeof(old_path), "%s%s", current_directory_->cwd, name);
     snprintf(new_path, sizeof(new_path), "%s%s", current_directory_->cwd, new_name);
 
     if (rename(old_path, new_path) == 0) {
-        wclear(path_win);
+        werase(path_win);
         wmove(path_win, 1, 0);
         wprintw(path_win, "Renamed to: %s", new_name);
         wrefresh(path_win);
@@ -345,237 +223,883 @@ void rename_file(char *files[]) {
   wgetch(path_win);
 }
 
-// Retrieves the parent directory of a given directory.f
-char *get_parent_directory(char *cwd) {
-  char *a;
-  a = strdup(cwd);
-  int i = strlen(a) - 1;
-  while (a[--i] != '/')
-    ;
-  a[++i] = '\0';
-  return a;
+// Makes dir the current directory. Returns -1 if there is no memory to
+// spell out its path.
+int set_directory(path_t *dir) {
+  char *cwd = malloc(dir->len + 1);
+  if (cwd == NULL)
+    return -1;
+  path_format(dir, cwd, dir->len + 1);
+  free(current_directory_->cwd);
+  current_directory_->cwd = cwd;
+  current_directory_->dir = dir;
+  return 0;
 }
 
-// Deletes a file.
-void delete_(char *files[]) {
-  char curr_path[1000];
-  snprintf(curr_path, sizeof(curr_path), "%s%s", current_directory_->cwd,
-           files[selection]);
-  remove(curr_path);
+// Colour pair of an entry: directories in DIR_COLOR, and files by their
+// mode bits or, once a worker has classified them, by their type.
+short entry_color(dir_listing_t *listing, int index) {
+  char path[PATH_MAX];
+  filetype_t type;
+  dir_meta_t meta;
+
+  if (dir_listing_is_dir(listing, index))
+    return 1;
+  if (!FILETYPE_COLORS || dir_listing_stat(listing, index, &meta) < 0 ||
+      !S_ISREG(meta.mode))
+    return 0;
+  if (meta.mode & 0111)
+    return 10 + FILETYPE_EXEC;
+  snprintf(path, sizeof(path), "%s%s", current_directory_->cwd,
+           dir_listing_name(listing, index));
+  if (!filetype_get(meta.dev, meta.ino, meta.mtime, meta.mtime_nsec, path, &type))
+    return 0;
+  return type.kind >= FILETYPE_EXEC ? 10 + type.kind : 0;
 }
 
-// Prompts the user to confirm file deletion.
-void delete_file(char *files[]) {
-  int c;
-  wclear(path_win);
-  wmove(path_win, 1, 0);
-  wprintw(path_win, "Are you sure to delete? (y/n)");
-
-LOOP_:
-  c = wgetch(path_win);
-  wclear(path_win);
-  wmove(path_win, 1, 0);
-  wprintw(path_win, "Are you sure to delete? (y/n) %c", c);
-  switch (c) {
-    case 'y':
-    case 'Y':
-      delete_(files);
-      break;
-    case 'n':
-    case 'N':
-      break;
-    default:
-      goto LOOP_;
+// Formats a row of the detailed listing: name, size and modification time.
+void format_details(dir_listing_t *listing, int index, int width, char *out,
+                    size_t size) {
+  char bytes[32] = "", when[32] = "";
+  dir_meta_t meta;
+  if (dir_listing_stat(listing, index, &meta) == 0) {
+    time_t mtime = meta.mtime;
+    if (!isDir(meta.mode))
+      du_format_size(meta.size, bytes, sizeof(bytes));
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+  }
+  int name_width = width - 27;
+  if (name_width < 8) {
+    snprintf(out, size, "%.*s", width, dir_listing_name(listing, index));
+    return;
+  }
+  snprintf(out, size, "%-*.*s %9s %16s", name_width, name_width,
+           dir_listing_name(listing, index), bytes, when);
+}
+
+// Draws the visible part of the listing. Each row is formatted and compared
+// with what the row last showed, and only rows that differ are repainted:
+// moving the cursor touches the row it left and the row it landed on.
+void draw_list(dir_listing_t *listing) {
+  int rows = maxy - 2, width = maxx / 2 - 4;
+  list_row_t row;
+
+  if (width > LIST_ROW_MAX - 1)
+    width = LIST_ROW_MAX - 1;
+  for (int r = 0; r < rows; r++) {
+    int i = start + r;
+    memset(&row, 0, sizeof(row));
+    if (i < len) {
+      int index = listing ? dir_listing_index(listing, i) : -1;
+      if (show_details && listing != NULL)
+        format_details(listing, index, width, row.text, sizeof(row.text));
+      else
+        snprintf(row.text, sizeof(row.text), "%.*s", width,
+                 listing ? dir_listing_name(listing, index) : "..");
+      row.marked = listing && (listing->entries[index].flags & ENTRY_MARKED);
+      row.attr = (i == selection ? A_STANDOUT : A_NORMAL) | (row.marked ? A_BOLD : 0);
+      row.color = listing ? entry_color(listing, index) : 1;
+    }
+    list_row_t *drawn = &drawn_rows[r];
+    if (rows_valid && drawn->attr == row.attr && drawn->color == row.color &&
+        drawn->marked == row.marked && strcmp(drawn->text, row.text) == 0)
+      continue;
+    mvwaddch(current_win, r + 1, 1, row.marked ? '*' : ' ');
+    wattrset(current_win, row.attr);
+    wcolor_set(current_win, row.color, NULL);
+    waddstr(current_win, row.text);
+    wattrset(current_win, A_NORMAL);
+    wclrtoeol(current_win);
+    mvwaddch(current_win, r + 1, maxx / 2 - 1, '|');
+    *drawn = row;
+  }
+  rows_valid = 1;
+}
+
+// Re-sorts the listing, keeping the cursor on the entry it was on.
+void resort(dir_listing_t *listing) {
+  int selected = dir_listing_index(listing, selection);
+  uint64_t t = trace_now();
+  sort_listing(listing);
+  trace_span("sort", t);
+  for (int i = 0; i < listing->len; i++) {
+    if (dir_listing_index(listing, i) == selected) {
+      selection = i;
       break;
+    }
   }
+  start = selection >= maxy - 1 ? selection - maxy / 2 : 0;
 }
 
-// Copies a file to a new location.
-void copy_files(char *files[]) {
-  char new_path[1000];
+// Asks a yes/no question on path_win until it gets an answer.
+int confirm(const char *question) {
+  int c;
+  werase(path_win);
+  mvwprintw(path_win, 1, 0, "%s", question);
+  wrefresh(path_win);
+  for (;;) {
+    c = wgetch(path_win);
+    if (c == 'y' || c == 'Y')
+      return 1;
+    if (c == 'n' || c == 'N')
+      return 0;
+  }
+}
+
+// Deletes a file. It goes to the trash if it can; otherwise, once the user
+// agrees, it is removed for good by a background job.
+void delete_(char *name) {
+  char curr_path[PATH_MAX], question[PATH_MAX + 100];
+  snprintf(curr_path, sizeof(curr_path), "%s%s", current_directory_->cwd,
+           name);
+  if (TRASH_DELETE) {
+    uint64_t t = trace_now();
+    int trashed = trash_put(curr_path) == 0;
+    trace_span("trash", t);
+    if (trashed)
+      return;
+    snprintf(question, sizeof(question), "Cannot move %s to trash: %s. Delete permanently? (y/n)",
+             name, strerror(errno));
+    if (!confirm(question))
+      return;
+  }
+  job_submit(JOB_DELETE, curr_path, NULL);
+}
+
+// Prompts the user to confirm file deletion.
+void delete_file(char *name) {
+  if (confirm(TRASH_DELETE ? "Move to trash? (y/n)" : "Are you sure to delete? (y/n)"))
+    delete_(name);
+}
+
+// Reads a line typed after label into term. Returns -1 if escape is hit.
+int prompt_term(const char *label, char *term, int size) {
   int i = 0, c;
-  wclear(path_win);
-  wmove(path_win, 1, 0);
+
+  term[0] = '\0';
+  werase(path_win);
+  mvwprintw(path_win, 1, 0, "%s: ", label);
+  wrefresh(path_win);
   while ((c = wgetch(path_win)) != '\n') {
-    if (c == 127 || c == 8) {
-      new_path[--i] = '\0';
-      i = i < 0 ? 0 : i;
-    } else {
-      new_path[i++] = c;
-      new_path[i] = '\0';
+    if (c == 27)
+      return -1;
+    if (c == 127 || c == 8 || c == KEY_BACKSPACE) {
+      if (i > 0)
+        term[--i] = '\0';
+    } else if (c != ERR && i < size - 1) {
+      term[i++] = c;
+      term[i] = '\0';
     }
-    wclear(path_win);
-    wmove(path_win, 1, 0);
-    wprintw(path_win, "%s", new_path);
-  }
-  FILE *new_file, *old_file;
-  strcat(new_path, files[selection]);
-  char curr_path[1000];
-  snprintf(curr_path, sizeof(curr_path), "%s%s", current_directory_->cwd,
-           files[selection]);
-  old_file = fopen(curr_path, "r");
-  new_file = fopen(new_path, "a");
-  wmove(current_win, 10, 10);
-  wprintw(current_win, "%.*s,%s", maxx, curr_path, new_path);
-  printf("%s %s", curr_path, new_path);
-  while ((c = fgetc(old_file)) != EOF) {
-    fprintf(new_file, "%c", c);
+    werase(path_win);
+    mvwprintw(path_win, 1, 0, "%s: %s", label, term);
+    wrefresh(path_win);
   }
-  fclose(old_file);
-  fclose(new_file);
+  return 0;
 }
 
-// Moves a file to a new location.
-void move_file(char *files[]) {
-    char target_directory[1000];
-    int i = 0, c;
+// Puts the path name would get in the directory target into buf. A relative
+// target is taken from the current directory.
+void target_path(char *buf, size_t size, const char *target, const char *name) {
+  size_t len = strlen(target);
+  snprintf(buf, size, "%s%s%s%s", target[0] == '/' ? "" : current_directory_->cwd,
+           target, len > 0 && target[len - 1] == '/' ? "" : "/", name);
+}
 
-    wclear(path_win);
-    wmove(path_win, 1, 0);
-    wprintw(path_win, "Enter target directory: ");
+// Shows how far a search in the hex view has got, and stops it when a key
+// is hit.
+int search_progress(uint64_t pos, void *arg) {
+  uint64_t size = *(uint64_t *)arg;
+  mvwprintw(current_win, 1, 2, "Searching... %d%%  (any key stops)",
+            size ? (int)(pos * 100 / size) : 100);
+  wrefresh(current_win);
+  return wgetch(current_win) == ERR;
+}
+
+// Shows a binary file as rows of hex and text. Only the rows on screen are
+// read, with pread(), so any part of a file or device of any size shows at
+// once. ':' goes to an offset and '/' finds a byte pattern from the top row.
+void read_binary(char *path) {
+  int ch = ERR, rows = maxy - 4, bpr = hex_bytes_per_row(maxx - 4), mlen = 0;
+  uint64_t size, top = 0;
+  int64_t match = -1;
+  unsigned char *buf = NULL, pat[64];
+  char line[hex_row_len(HEX_MAX_ROW) + 1], status[200];
+  const char *why = NULL;
+  struct stat st;
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (rows <= 0)
+    why = "the window is too small";
+  else if (fd < 0 || fstat(fd, &st) < 0 || (buf = malloc((size_t)rows * bpr)) == NULL)
+    why = strerror(errno);
+  if (why != NULL) {
+    if (fd >= 0)
+      close(fd);
+    werase(path_win);
+    mvwprintw(path_win, 1, 0, "Cannot show %s: %s", path, why);
     wrefresh(path_win);
+    wgetch(path_win);
+    return;
+  }
+  size = S_ISBLK(st.st_mode) ? (uint64_t)lseek(fd, 0, SEEK_END) : (uint64_t)st.st_size;
+  uint64_t screen = (uint64_t)rows * bpr;
+  uint64_t last = size > screen ? ((size - 1) / bpr + 1) * bpr - screen : 0;
+  status[0] = '\0';
+  wtimeout(current_win, -1);
 
-    while ((c = wgetch(path_win)) != '\n') {
-        if (c == 127 || c == 8) { 
-            target_directory[--i] = '\0';
-            i = i < 0 ? 0 : i;
+  do {
+    if (ch != ERR && ch != KEY_VIEW_SEARCH && ch != KEY_VIEW_NEXT)
+      status[0] = '\0';
+    switch (ch) {
+      case KEY_UP:
+      case KEY_NAVUP:
+        top = top >= (uint64_t)bpr ? top - bpr : 0;
+        break;
+      case KEY_DOWN:
+      case KEY_NAVDOWN:
+        top += bpr;
+        break;
+      case KEY_PPAGE:
+      case 'b':
+        top = top >= screen ? top - screen : 0;
+        break;
+      case KEY_NPAGE:
+      case ' ':
+        top += screen;
+        break;
+      case KEY_HOME:
+      case KEY_VIEW_TOP:
+        top = 0;
+        break;
+      case KEY_END:
+      case KEY_VIEW_END:
+        top = last;
+        break;
+      case KEY_VIEW_GOTO: {
+        char term[32], *end;
+        if (prompt_term("Go to offset", term, sizeof(term)) == 0 && term[0] != '\0') {
+          uint64_t off = strtoull(term, &end, 0);
+          if (*end == '\0')
+            top = off / bpr * bpr;
+        }
+        break;
+      }
+      case KEY_VIEW_SEARCH:
+      case KEY_VIEW_NEXT: {
+        char term[100];
+        if (ch == KEY_VIEW_SEARCH) {
+          if (prompt_term("Find (hex bytes, or \"text)", term, sizeof(term)) < 0)
+            break;
+          mlen = hex_parse_pattern(term, pat, sizeof(pat));
+          match = -1;
+          if (mlen < 0) {
+            snprintf(status, sizeof(status), "Bad pattern");
+            break;
+          }
+        }
+        if (mlen <= 0)
+          break;
+        wtimeout(current_win, 0);
+        int64_t at = hex_search(fd, match >= 0 ? (uint64_t)match + 1 : top, size, pat,
+                                mlen, search_progress, &size);
+        wtimeout(current_win, -1);
+        if (at >= 0) {
+          match = at;
+          top = (uint64_t)at / bpr * bpr;
+          if (top > screen / 2)
+            top -= screen / 2 / bpr * bpr;
+          status[0] = '\0';
         } else {
-            target_directory[i++] = c;
-            target_directory[i] = '\0';
+          snprintf(status, sizeof(status), at == -1 ? "Not found" : "Search stopped");
         }
-        wclear(path_win);
-        wmove(path_win, 1, 0);
-        wprintw(path_win, "Enter target directory: %s", target_directory);
-        wrefresh(path_win);
+        break;
+      }
+    }
+    if (top > last)
+      top = last;
+
+    werase(current_win);
+    mvwprintw(current_win, 1, 2, "%s  %llx / %llx (%d%%)  %s", strrchr(path, '/') + 1,
+              (unsigned long long)top, (unsigned long long)size,
+              size ? (int)(top * 100 / size) : 100, status);
+    mvwprintw(current_win, 1, maxx - 14, "e: exit");
+    ssize_t got = pread(fd, buf, screen, top);
+    for (int r = 0; r < rows && (ssize_t)r * bpr < got; r++) {
+      int n = got - (ssize_t)r * bpr < bpr ? got - r * bpr : bpr;
+      hex_format_row(line, top + (uint64_t)r * bpr, buf + (size_t)r * bpr, n, bpr);
+      mvwaddstr(current_win, 3 + r, 2, line);
+      // The bytes of the last match that are on this row.
+      uint64_t row = top + (uint64_t)r * bpr;
+      for (int i = 0; match >= 0 && i < n; i++) {
+        if (row + i >= (uint64_t)match && row + i < (uint64_t)match + mlen) {
+          mvwchgat(current_win, 3 + r, 2 + hex_column(bpr, i), 2, A_STANDOUT, 0, NULL);
+          mvwchgat(current_win, 3 + r, 2 + hex_text_column(bpr, i), 1, A_STANDOUT, 0, NULL);
+        }
+      }
     }
+    box(current_win, '|', '-');
+    wrefresh(current_win);
+    ch = wgetch(current_win);
+  } while (ch != 'e' && ch != 'q' && ch != 27);
 
-    if (i == 0) {
-        wclear(path_win);
-        wmove(path_win, 1, 0);
-        wprintw(path_win, "Directory cannot be empty.");
-        wrefresh(path_win);
-        wgetch(path_win);
-        return;
+  free(buf);
+  close(fd);
+}
+
+// Copies as much of a line as fits in width columns into out, which must
+// hold 4 * width + 1 bytes. Tabs are expanded, other control characters
+// shown as '.', and a UTF-8 sequence is kept whole in one column. Bytes
+// that cannot start or continue a sequence are shown as '.' too, so no
+// column takes more than 4 bytes.
+void fit_line(const char *s, size_t n, char *out, int width) {
+  size_t i = 0, o = 0;
+  int col = 0, cont = 0;
+
+  if (n > 0 && s[n - 1] == '\r')
+    n--;
+  for (; i < n && (col < width || cont > 0); i++) {
+    unsigned char c = s[i];
+    if ((c & 0xc0) == 0x80 && cont > 0) {
+      out[o++] = c;
+      cont--;
+      continue;
     }
+    if (col == width)
+      break;
+    cont = 0;
+    if (c == '\t') {
+      do
+        out[o++] = ' ';
+      while (++col % 8 != 0 && col < width);
+    } else if (c < 32 || c == 127 || (c >= 0x80 && c < 0xc0) || c >= 0xf8) {
+      out[o++] = '.';
+      col++;
+    } else {
+      out[o++] = c;
+      col++;
+      cont = c >= 0xf0 ? 3 : c >= 0xe0 ? 2 : c >= 0xc0 ? 1 : 0;
+    }
+  }
+  out[o] = '\0';
+}
 
-    if (target_directory[strlen(target_directory) - 1] != '/') {
-        strcat(target_directory, "/");
+// Offset of the top line when the last line of the file is on the bottom
+// row.
+uint64_t view_end(pager_t *pager, int rows) {
+  uint64_t size = pager_size(pager);
+  uint64_t top = size > 0 ? pager_line_start(pager, size - 1) : 0;
+  for (int r = 1; r < rows && top > 0; r++)
+    top = pager_prev_line(pager, top);
+  return top;
+}
+
+// Shows a text file a screen at a time. The view is kept as the offset of
+// its top line, so moving anywhere costs one screen of work however large
+// the file is; line numbers come from the pager's index as it is built.
+// With follow on, data appended to the file is shown as it arrives.
+void read_(char *path) {
+  int ch = ERR, follow = 0, rows, width;
+  uint64_t top = 0, want = 0, lines, indexed, line;
+  int have_want = 0;
+  char *buf, status[200];
+
+  werase(current_win);
+  werase(info_win);
+  wresize(current_win, maxy, maxx);
+
+  // A disk is never text, and reading it to find out would take forever.
+  if (stat(path, &file_stats) == 0 && S_ISBLK(file_stats.st_mode)) {
+    read_binary(path);
+    endwin();
+    return;
+  }
+  pager_t *pager = pager_open(path);
+  if (pager == NULL) {
+    werase(path_win);
+    mvwprintw(path_win, 1, 0, "Cannot open %s: %s", path, strerror(errno));
+    wrefresh(path_win);
+    wgetch(path_win);
+    endwin();
+    return;
+  }
+  if (pager_is_binary(pager)) {
+    pager_close(pager);
+    read_binary(path);
+    endwin();
+    return;
+  }
+  rows = maxy - 4;
+  width = maxx - 4;
+  buf = rows > 0 && width > 0 ? malloc(4 * width + 1) : NULL;
+  if (buf == NULL) {
+    pager_close(pager);
+    werase(path_win);
+    mvwprintw(path_win, 1, 0, "Cannot show %s: %s", path,
+              rows > 0 && width > 0 ? strerror(errno) : "the window is too small");
+    wrefresh(path_win);
+    wgetch(path_win);
+    endwin();
+    return;
+  }
+
+  do {
+    switch (ch) {
+      case KEY_UP:
+      case KEY_NAVUP:
+        top = pager_prev_line(pager, top);
+        break;
+      case KEY_DOWN:
+      case KEY_NAVDOWN:
+        if (top < view_end(pager, rows))
+          top = pager_next_line(pager, top);
+        break;
+      case KEY_PPAGE:
+      case 'b':
+        for (int r = 1; r < rows; r++)
+          top = pager_prev_line(pager, top);
+        break;
+      case KEY_NPAGE:
+      case ' ': {
+        uint64_t end = view_end(pager, rows);
+        for (int r = 1; r < rows && top < end; r++)
+          top = pager_next_line(pager, top);
+        break;
+      }
+      case KEY_HOME:
+      case KEY_VIEW_TOP:
+        top = 0;
+        break;
+      case KEY_END:
+      case KEY_VIEW_END:
+        top = view_end(pager, rows);
+        break;
+      case KEY_VIEW_FOLLOW:
+        follow = !follow;
+        break;
+      case KEY_VIEW_GOTO: {
+        char term[32];
+        if (prompt_term("Go to line", term, sizeof(term)) == 0 && atoll(term) > 0) {
+          want = atoll(term) - 1;
+          have_want = 1;
+        }
+        break;
+      }
+    }
+    if (ch != ERR && ch != KEY_VIEW_FOLLOW)
+      follow = follow && (ch == KEY_END || ch == KEY_VIEW_END);
+    int changed = pager_refresh(pager);
+    if (changed == 2 || top > pager_size(pager))
+      top = 0;
+    int done = pager_progress(pager, &lines, &indexed);
+    if (have_want && pager_line_offset(pager, want, &top) == 0)
+      have_want = 0;
+    else if (have_want && done)
+      have_want = 0;
+    if (follow)
+      top = view_end(pager, rows);
+
+    werase(current_win);
+    int n = snprintf(status, sizeof(status), " %s", strrchr(path, '/') ? strrchr(path, '/') + 1 : path);
+    if (pager_line_number(pager, top, &line) == 0)
+      n += snprintf(status + n, sizeof(status) - n, "  line %llu", (unsigned long long)line + 1);
+    n += snprintf(status + n, sizeof(status) - n, done ? " of %llu" : " of %llu+ (indexing %d%%)",
+                  (unsigned long long)lines,
+                  pager_size(pager) ? (int)(indexed * 100 / pager_size(pager)) : 100);
+    if (have_want)
+      snprintf(status + n, sizeof(status) - n, "  going to line %llu", (unsigned long long)want + 1);
+    else if (follow)
+      snprintf(status + n, sizeof(status) - n, "  [following]");
+    mvwprintw(current_win, 1, 2, "%.*s", width, status);
+    mvwprintw(current_win, 1, maxx - 14 > n + 4 ? maxx - 14 : n + 4, "e: exit");
+
+    uint64_t off = top, size = pager_size(pager);
+    const char *data = pager_data(pager);
+    for (int r = 0; r < rows && off < size; r++) {
+      uint64_t next = pager_next_line(pager, off);
+      fit_line(data + off, next - off - (data[next - 1] == '\n'), buf, width);
+      mvwaddstr(current_win, 3 + r, 2, buf);
+      off = next;
     }
+    box(current_win, '|', '-');
+    wrefresh(current_win);
+    wtimeout(current_win, INPUT_POLL_MS);
+    ch = wgetch(current_win);
+  } while (ch != 'e' && ch != 'q' && ch != 27);
 
-    char new_path[1000];
-    snprintf(new_path, sizeof(new_path), "%s%s", target_directory, files[selection]);
+  free(buf);
+  pager_close(pager);
+  endwin();
+}
 
-    char curr_path[1000];
-    snprintf(curr_path, sizeof(curr_path), "%s%s", current_directory_->cwd, files[selection]);
+// Queues a copy of the selected entry, with everything below it, into a
+// directory.
+void copy_files(char *name) {
+  char target[1000], label[1100], src[PATH_MAX], dst[PATH_MAX];
+
+  snprintf(label, sizeof(label), "Copy %s to", name);
+  if (prompt_term(label, target, sizeof(target)) < 0 || target[0] == '\0')
+    return;
+  snprintf(src, sizeof(src), "%s%s", current_directory_->cwd, name);
+  target_path(dst, sizeof(dst), target, name);
+  job_submit(JOB_COPY, src, dst);
+}
 
-    if (rename(curr_path, new_path) == 0) {
-        wclear(path_win);
-        wmove(path_win, 1, 0);
-        wprintw(path_win, "File moved to: %s", new_path);
-        wrefresh(path_win);
-    } else {
-        wclear(path_win);
-        wmove(path_win, 1, 0);
-        wprintw(path_win, "Error moving file.");
-        wrefresh(path_win);
+// Queues a move of the selected entry into another directory.
+void move_file(char *name) {
+  char target[1000], label[1100], src[PATH_MAX], dst[PATH_MAX];
+
+  snprintf(label, sizeof(label), "Move %s to", name);
+  if (prompt_term(label, target, sizeof(target)) < 0 || target[0] == '\0')
+    return;
+  snprintf(src, sizeof(src), "%s%s", current_directory_->cwd, name);
+  target_path(dst, sizeof(dst), target, name);
+  job_submit(JOB_MOVE, src, dst);
+}
+
+int count_marks(dir_listing_t *listing) {
+  return listing != NULL ? listing->marks : 0;
+}
+
+// Collects the names of the marked entries of listing into names, which
+// must hold listing->len of them. They point into the listing.
+int marked_names(dir_listing_t *listing, char **names) {
+  int n = 0;
+  for (int i = 0; count_marks(listing) > 0 && i < listing->len; i++)
+    if (listing->entries[i].flags & ENTRY_MARKED)
+      names[n++] = dir_listing_name(listing, i);
+  return n;
+}
+
+// Marks or unmarks entry index. ".." cannot be marked.
+void set_mark(dir_listing_t *listing, int index, int on) {
+  dir_entry_t *e = &listing->entries[index];
+  if (!on == !(e->flags & ENTRY_MARKED) || strcmp(dir_listing_name(listing, index), "..") == 0)
+    return;
+  e->flags ^= ENTRY_MARKED;
+  listing->marks += on ? 1 : -1;
+}
+
+// Marks the entries whose names match a glob, or unmarks them if it starts
+// with '-'.
+void mark_pattern(dir_listing_t *listing) {
+  char glob[256];
+  if (prompt_term("Mark matching (-glob unmarks)", glob, sizeof(glob)) < 0 ||
+      glob[0] == '\0')
+    return;
+  int on = glob[0] != '-';
+  for (int i = 0; i < listing->len; i++)
+    if (fnmatch(on ? glob : glob + 1, dir_listing_name(listing, i), FNM_PERIOD) == 0)
+      set_mark(listing, i, on);
+}
+
+void invert_marks(dir_listing_t *listing) {
+  for (int i = 0; i < listing->len; i++)
+    set_mark(listing, i, !(listing->entries[i].flags & ENTRY_MARKED));
+}
+
+// Applies copy, move, delete or chmod to every marked entry, or to name
+// when nothing is marked, as a single background job. The marks are
+// cleared once it is queued.
+void bulk_op(dir_listing_t *listing, int kind, char *name) {
+  char target[1000], label[1100], dst[PATH_MAX] = "", path[PATH_MAX];
+  static const char *verbs[] = {"Copy", "Move", "Delete", "Chmod"};
+  char **names = malloc((listing ? listing->len : 1) * sizeof(char *));
+  int n = marked_names(listing, names);
+  mode_t mode = 0;
+
+  if (names == NULL)
+    return;
+  if (n == 0 && strcmp(name, "..") == 0)
+    goto out;
+  if (n == 0) {
+    names[n++] = name;
+    snprintf(label, sizeof(label), "%s", name);
+  } else {
+    snprintf(label, sizeof(label), "%d marked entries", n);
+  }
+  if (kind == JOB_COPY || kind == JOB_MOVE) {
+    snprintf(path, sizeof(path), "%s %s to", verbs[kind], label);
+    if (prompt_term(path, target, sizeof(target)) < 0 || target[0] == '\0')
+      goto out;
+    target_path(dst, sizeof(dst), target, "");
+  } else if (kind == JOB_CHMOD) {
+    char *end;
+    snprintf(path, sizeof(path), "Mode for %s (octal)", label);
+    if (prompt_term(path, target, sizeof(target)) < 0 || target[0] == '\0')
+      goto out;
+    mode = strtol(target, &end, 8);
+    if (*end != '\0' || mode > 07777)
+      goto out;
+  } else {
+    snprintf(path, sizeof(path), "%s %s? (y/n)",
+             TRASH_DELETE ? "Move to trash:" : "Delete", label);
+    if (!confirm(path))
+      goto out;
+    // Trashing is a rename each; what cannot be trashed is only deleted
+    // if the user agrees.
+    int left = 0, err = 0;
+    for (int i = 0; i < n; i++) {
+      snprintf(path, sizeof(path), "%s%s", current_directory_->cwd, names[i]);
+      if (!TRASH_DELETE || trash_put(path) < 0) {
+        err = errno;
+        names[left++] = names[i];
+      }
+    }
+    if (TRASH_DELETE && left > 0) {
+      snprintf(path, sizeof(path), "Cannot move %d of them to trash: %s. Delete permanently? (y/n)",
+               left, strerror(err));
+      if (!confirm(path))
+        left = 0;
     }
+    n = left;
+  }
+  if (n > 0)
+    job_submit_batch(kind, current_directory_->cwd, names, n, dst, mode);
+  for (int i = 0; listing != NULL && i < listing->len; i++)
+    set_mark(listing, i, 0);
+out:
+  free(names);
+}
 
-    wgetch(path_win);
+// Tells whether a batch job is queued or running. Its changes to the
+// listing are left until it is over.
+int batch_busy() {
+  job_info_t jobs[16];
+  int n = jobs_list(jobs, 16);
+  for (int i = 0; i < n && i < 16; i++)
+    if (jobs[i].count > 1)
+      return 1;
+  return 0;
 }
 
- // Handles the Enter key press action.
-void handle_enter(char *files[]) {
-  char *temp, *a;
-  a = strdup(current_directory_->cwd);
-  endwin();
-  if (strcmp(files[selection], "..") == 0) {
+// Tells whether a batch job has finished since the last call.
+int batch_finished() {
+  static int seen = 0;
+  job_info_t done;
+  if (!jobs_last_done(&done) || done.count <= 1 || done.id == seen)
+    return 0;
+  seen = done.id;
+  return 1;
+}
+
+ // Handles the Enter key press action. Returns 1 if it changed directory and
+// 0 if it opened a file.
+int handle_enter(char *name) {
+  char path[PATH_MAX];
+  path_t *dir;
+
+  if (strcmp(name, "..") == 0) {
+    dir = path_parent(current_directory_->dir);
+  } else {
+    snprintf(path, sizeof(path), "%s%s", current_directory_->cwd, name);
+    stat(path, &file_stats);
+    if (!isDir(file_stats.st_mode)) {
+      read_(path);
+      return 0;
+    }
+    dir = path_child(current_directory_->dir, name);
+  }
+  if (dir != NULL && set_directory(dir) == 0) {
     start = 0;
     selection = 0;
-    strcpy(current_directory_->cwd, current_directory_->parent_dir);
-    current_directory_->parent_dir =
-        strdup(get_parent_directory(current_directory_->cwd));
-  } else {
-    temp = malloc(strlen(files[selection]) + 1);
-    snprintf(temp, strlen(files[selection]) + 2, "%s", files[selection]);
-    strcat(a, temp);
-    stat(a, &file_stats);
-    if (isDir(file_stats.st_mode)) {
-      start = 0;
-      selection = 0;
-      current_directory_->parent_dir = strdup(current_directory_->cwd);
-      strcat(current_directory_->cwd, temp);
-      strcat(current_directory_->cwd, "/");
-    } else {
-      char temp_[1000];
-      snprintf(temp_, sizeof(temp_), "%s%s", current_directory_->cwd,
-               files[selection]);
+  }
+  return 1;
+}
 
-      read_(temp_);
-    }
+// Displays information about a file, as far as the background walk got.
+void show_file_info(char *name) {
+  char temp_address[PATH_MAX], size[32], used[32], count[32];
+  info_t info;
+  wmove(info_win, 1, 1);
+  if (strcmp(name, "..") == 0) {
+    wprintw(info_win, "Press Enter to go back\n");
+    info_shown = 0;
+    return;
   }
-  refresh();
-}
-
-// Calculates the total size of a directory recursively.
-float get_recursive_size_directory(char *path) {
-  float directory_size = 0;
-  DIR *dir_ = NULL;
-  struct dirent *dir_entry;
-  struct stat file_stat;
-  char temp_path[1000];
-  dir_ = opendir(path);
-  if (dir_ == NULL) {
-    perror(path);
-    exit(0);
-    return -1;
+  snprintf(temp_address, sizeof(temp_address), "%s%s",
+           current_directory_->cwd, name);
+  info_request(temp_address);
+  info_snapshot(&info);
+  info_shown = info.generation;
+
+  if (info.state == INFO_ERROR) {
+    wprintw(info_win, "Name: %s\n %s\n", name, strerror(info.error));
+    return;
   }
-  while ((dir_entry = readdir(dir_)) != NULL) {
-    if (strcmp(dir_entry->d_name, ".") != 0 &&
-        strcmp(dir_entry->d_name, "..") != 0) {
-      snprintf(temp_path, sizeof(temp_path), "%s/%s", path, dir_entry->d_name);
-      if (dir_entry->d_type != DT_DIR) {
-        stat(temp_path, &file_stat);
-        total_files++;
-        directory_size += (float)(file_stat.st_size) / (float)1024;
-      } else {
-        total_files++;
-        directory_size += (float)4;
-        directory_size += get_recursive_size_directory(temp_path);
-      }
+  filetype_t type;
+  int typed = S_ISREG(info.st.st_mode) &&
+              filetype_get(info.st.st_dev, info.st.st_ino, info.st.st_mtim.tv_sec,
+                           info.st.st_mtim.tv_nsec, temp_address, &type) &&
+              type.kind != FILETYPE_UNKNOWN;
+  wprintw(info_win, "Name: %s\n Type: %s\n", name,
+          info.st.st_mode == 0       ? "..."
+          : isDir(info.st.st_mode) ? "Folder"
+          : typed                  ? type.mime
+                                   : "File");
+  if (info.state == INFO_DONE) {
+    wprintw(info_win, " Size: %s\n Disk usage: %s\n",
+            du_format_size(info.totals.bytes, size, sizeof(size)),
+            du_format_size(info.totals.blocks * 512, used, sizeof(used)));
+    if (isDir(info.st.st_mode)) {
+      wprintw(info_win, " No. Files: %llu\n No. Folders: %llu\n",
+              (unsigned long long)info.totals.files,
+              (unsigned long long)info.totals.dirs);
+      if (info.totals.errors > 0)
+        wprintw(info_win, " Unreadable: %llu\n",
+                (unsigned long long)info.totals.errors);
     }
+    return;
   }
-  closedir(dir_);
-  return directory_size;
+  if (info.cached)
+    wprintw(info_win, " Size: ~%s, %s files (cached)\n",
+            du_format_size(info.estimate.bytes, size, sizeof(size)),
+            du_format_count(info.estimate.files, count, sizeof(count)));
+  wprintw(info_win, " Size: >= %s, %s files so far...\n",
+          du_format_size(info.totals.bytes, size, sizeof(size)),
+          du_format_count(info.totals.files, count, sizeof(count)));
 }
 
-// Displays information about a file.
-void show_file_info(char *files[]) {
-  wmove(info_win, 1, 1);
-  char temp_address[1000];
-  total_files = 0;
-  if (strcmp(files[selection], "..") != 0) {
-    snprintf(temp_address, sizeof(temp_address), "%s%s",
-             current_directory_->cwd, files[selection]);
-    stat(temp_address, &file_stats);
-
-    wprintw(info_win, "Name: %s\n Type: %s\n Size: %.2f KB\n", files[selection],
-            isDir(file_stats.st_mode) ? "Folder" : "File",
-            isDir(file_stats.st_mode)
-                ? get_recursive_size_directory(temp_address)
-                : (float)file_stats.st_size / (float)1024);
-    wprintw(info_win, " No. Files: %zu\n",
-            isDir(file_stats.st_mode) ? total_files : 1);
-  } else {
-    wprintw(info_win, "Press Enter to go back\n");
+// Draws the latency overlay over the bottom of the info pane.
+void draw_overlay() {
+  char line[200];
+  uint64_t p50, p99;
+  int y = maxy - 5, width = maxx / 2 - 3;
+
+  if (!show_overlay || y < 1)
+    return;
+  size_t n = trace_latency_stats(&p50, &p99);
+  mvwhline(info_win, y, 1, '-', maxx / 2 - 2);
+  if (n > 0)
+    snprintf(line, sizeof(line), "key to frame: p50 %.2f ms, p99 %.2f ms (%zu keys)",
+             p50 / 1e6, p99 / 1e6, n);
+  else
+    snprintf(line, sizeof(line), "key to frame: no keys yet");
+  mvwaddnstr(info_win, y + 1, 2, line, width);
+  snprintf(line, sizeof(line), "frame %.2f ms: list %.2f, sort %.2f, stat %.2f, draw %.2f",
+           last_frame.total / 1e6, last_frame.list / 1e6, last_frame.sort / 1e6,
+           last_frame.stat / 1e6, last_frame.render / 1e6);
+  mvwaddnstr(info_win, y + 2, 2, line, width);
+  snprintf(line, sizeof(line), "getdents %llu, statx %llu, allocs %llu",
+           (unsigned long long)last_frame.counts[TRACE_GETDENTS],
+           (unsigned long long)last_frame.counts[TRACE_STATX],
+           (unsigned long long)last_frame.counts[TRACE_ALLOCS]);
+  mvwaddnstr(info_win, y + 3, 2, line, width);
+}
+
+// Redraws the info pane if the background walk has reported since.
+void update_file_info(char *name) {
+  info_t info;
+  info_snapshot(&info);
+  if (info_shown == 0 || info.generation == info_shown)
+    return;
+  werase(info_win);
+  show_file_info(name);
+  draw_overlay();
+  box(info_win, '|', '-');
+  wnoutrefresh(info_win);
+  doupdate();
+}
+
+// Tells whether inotify has queued changes for the cached listings.
+int listing_changed() {
+  struct pollfd pfd = {dircache_fd(), POLLIN, 0};
+  return pfd.fd >= 0 && poll(&pfd, 1, 0) > 0;
+}
+
+// Copies up to 16 unfinished jobs into jobs and finds the one the job line
+// shows: job_focus, or the oldest once that one is over. Returns how many
+// were copied, and the index of that one in *shown.
+int list_jobs(job_info_t *jobs, int *shown) {
+  int n = jobs_list(jobs, 16);
+  if (n > 16)
+    n = 16;
+  *shown = 0;
+  for (int i = 0; i < n; i++)
+    if (jobs[i].id == job_focus)
+      *shown = i;
+  if (n > 0)
+    job_focus = jobs[*shown].id;
+  return n;
+}
+
+// Shows one unfinished job, with how many others are running or queued, or
+// how the last one ended, on the top line of path_win.
+void draw_jobs() {
+  static const char *verbs[] = {"copy", "move", "delete", "chmod"};
+  job_info_t jobs[16], done;
+  char a[32], b[32], r[32];
+  int shown, n = list_jobs(jobs, &shown), running = 0, queued = 0;
+
+  jobs_shown = jobs_generation();
+  wmove(path_win, 0, 0);
+  wclrtoeol(path_win);
+  if (n > 0) {
+    job_info_t *j = &jobs[shown];
+    for (int i = 0; i < n; i++) {
+      if (i != shown && jobs[i].state == JOB_QUEUED)
+        queued++;
+      else if (i != shown)
+        running++;
+    }
+    if (n > 1)
+      wprintw(path_win, " [%d/%d]", shown + 1, n);
+    wprintw(path_win, " %s %s", verbs[j->kind], j->name);
+    if (j->state == JOB_QUEUED)
+      wprintw(path_win, ": waiting");
+    else if (j->count > 1)
+      wprintw(path_win, ": %llu of %d", (unsigned long long)j->files, j->count);
+    else if (j->bytes_total > 0)
+      wprintw(path_win, ": %d%% %s/%s",
+              (int)(j->bytes * 100 / j->bytes_total) > 100
+                  ? 100 : (int)(j->bytes * 100 / j->bytes_total),
+              du_format_size(j->bytes, a, sizeof(a)),
+              du_format_size(j->bytes_total, b, sizeof(b)));
+    else if (j->files > 0)
+      wprintw(path_win, ": %s entries", du_format_count(j->files, a, sizeof(a)));
+    if (j->rate > 0)
+      wprintw(path_win, " %s/s", du_format_size((uint64_t)j->rate, r, sizeof(r)));
+    if (j->eta >= 0)
+      wprintw(path_win, " ETA %ld:%02ld", j->eta / 60, j->eta % 60);
+    if (running > 0)
+      wprintw(path_win, " (+%d running)", running);
+    if (queued > 0)
+      wprintw(path_win, " (+%d queued)", queued);
+    if (n > 1)
+      wprintw(path_win, "  [%c: next, %c: cancel]", KEY_NEXT_JOB, KEY_CANCEL_JOB);
+    else
+      wprintw(path_win, "  [%c: cancel]", KEY_CANCEL_JOB);
+  } else if (jobs_last_done(&done)) {
+    wprintw(path_win, " %s %s: ", verbs[done.kind], done.name);
+    if (done.state == JOB_DONE && done.count > 1)
+      wprintw(path_win, "%llu of %d done", (unsigned long long)done.files, done.count);
+    else if (done.state == JOB_DONE && done.kind == JOB_DELETE)
+      wprintw(path_win, "%s entries removed", du_format_count(done.files, a, sizeof(a)));
+    else if (done.state == JOB_DONE)
+      wprintw(path_win, "done");
+    else if (done.state == JOB_CANCELLED)
+      wprintw(path_win, "cancelled");
+    else
+      wprintw(path_win, "%s", strerror(done.error));
+    if (done.errors)
+      wprintw(path_win, ", %llu entries failed", (unsigned long long)done.errors);
   }
 }
 
+// Redraws the job line if any job moved on.
+void update_jobs() {
+  if (jobs_generation() == jobs_shown)
+    return;
+  draw_jobs();
+  wnoutrefresh(path_win);
+  doupdate();
+}
+
 // Creates a new file.
 void create_file() {
     char new_file_name[100];
     int i = 0, c;
 
-    wclear(path_win);
+    werase(path_win);
     wmove(path_win, 1, 0);
     wprintw(path_win, "Enter new file name: ");
     wrefresh(path_win);
@@ -588,14 +1112,14 @@ void create_file() {
             new_file_name[i++] = c;
             new_file_name[i] = '\0';
         }
-        wclear(path_win);
+        werase(path_win);
         wmove(path_win, 1, 0);
         wprintw(path_win, "Enter new file name: %s", new_file_name);
         wrefresh(path_win);
     }
 
     if (i == 0) {
-        wclear(path_win);
+        werase(path_win);
         wmove(path_win, 1, 0);
         wprintw(path_win, "File name cannot be empty.");
         wrefresh(path_win);
@@ -603,12 +1127,12 @@ void create_file() {
         return;
     }
 
-    char new_file_path[1000];
+    char new_file_path[PATH_MAX];
     snprintf(new_file_path, sizeof(new_file_path), "%s%s", current_directory_->cwd, new_file_name);
 
     FILE *new_file = fopen(new_file_path, "w");
     if (new_file == NULL) {
-        wclear(path_win);
+        werase(path_win);
         wmove(path_win, 1, 0);
         wprintw(path_win, "Error creating file.");
         wrefresh(path_win);
@@ -617,7 +1141,7 @@ void create_file() {
     }
 
     fclose(new_file);
-    wclear(path_win);
+    werase(path_win);
     wmove(path_win, 1, 0);
     wprintw(path_win, "File created: %s", new_file_name);
     wrefresh(path_win);
@@ -625,11 +1149,11 @@ void create_file() {
 }
 
 // Searches for a file.
-void search_file(char *files[], int len) {
+void search_file(dir_listing_t *listing) {
     char search_term[100];
     int i = 0, c;
 
-    wclear(path_win);
+    werase(path_win);
     wmove(path_win, 1, 0);
     wprintw(path_win, "Enter search term: ");
     wrefresh(path_win);
@@ -642,14 +1166,14 @@ void search_file(char *files[], int len) {
             search_term[i++] = c;
             search_term[i] = '\0';
         }
-        wclear(path_win);
+        werase(path_win);
         wmove(path_win, 1, 0);
         wprintw(path_win, "Enter search term: %s", search_term);
         wrefresh(path_win);
     }
 
-    for (int j = 0; j < len; j++) {
-        if (strstr(files[j], search_term) != NULL) {
+    for (int j = 0; listing != NULL && j < listing->len; j++) {
+        if (strstr(dir_listing_name(listing, j), search_term) != NULL) {
             selection = j;  
             if (selection >= maxy) {
                 start = selection - maxy / 2;
@@ -660,101 +1184,405 @@ void search_file(char *files[], int len) {
         }
     }
 
-    wclear(path_win);
+    werase(path_win);
     wmove(path_win, 1, 0);
     wprintw(path_win, "No match found for: %s", search_term);
     wrefresh(path_win);
     wgetch(path_win); 
 }
 
-int main() {
-    int i = 0;
+// Opens the directory holding rel, a path below the current directory, with
+// the cursor on rel.
+void jump_to(const char *rel) {
+  const char *base = strrchr(rel, '/');
+  if (base != NULL) {
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%.*s", (int)(base - rel), rel);
+    path_t *p = path_child(current_directory_->dir, dir);
+    if (p == NULL || set_directory(p) < 0)
+      return;
+    base++;
+  } else {
+    base = rel;
+  }
+  selection = start = 0;
+  dir_listing_t *listing = dircache_get(current_directory_->cwd);
+  if (listing == NULL)
+    return;
+  if (!listing->sorted)
+    sort_listing(listing);
+  int index = dir_listing_find(listing, base);
+  for (int i = 0; index >= 0 && i < listing->len; i++) {
+    if (dir_listing_index(listing, i) == index) {
+      selection = i;
+      break;
+    }
+  }
+  start = selection >= maxy - 1 ? selection - maxy / 2 : 0;
+}
+
+// Lists the results of a search as they come in until one is picked with
+// enter, which jumps to it, or the list is left with q or escape. Stops and
+// frees the search.
+void browse_results(search_t *search, const char *term, const char *unit) {
+  char hit[PATH_MAX];
+  int c, sel = 0, top = 0, done;
+  size_t n, progress;
+
+  for (;;) {
+    int rows = maxy - 2;
+    n = search_poll(search, &done, &progress);
+    werase(current_win);
+    for (int r = 0; r < rows && top + r < (int)n; r++) {
+      if (search_result(search, top + r, hit, sizeof(hit)) < 0)
+        break;
+      if (top + r == sel)
+        wattron(current_win, A_STANDOUT);
+      mvwprintw(current_win, r + 1, 2, "%.*s", maxx / 2 - 4, hit);
+      wattroff(current_win, A_STANDOUT);
+    }
+    box(current_win, '|', '-');
+    wrefresh(current_win);
+    werase(path_win);
+    mvwprintw(path_win, 1, 0, " '%s': %zu match%s, %zu %s%s", term, n,
+              n == 1 ? "" : "es", progress, unit, done ? "" : " (searching)");
+    wrefresh(path_win);
+
+    c = wgetch(current_win);
+    if (c == KEY_UP || c == KEY_NAVUP) {
+      sel = sel > 0 ? sel - 1 : 0;
+    } else if (c == KEY_DOWN || c == KEY_NAVDOWN) {
+      sel = sel + 1 < (int)n ? sel + 1 : sel;
+    } else if (c == KEY_ENTER) {
+      if (search_result_path(search, sel, hit, sizeof(hit)) == 0) {
+        search_stop(search);
+        jump_to(hit);
+        werase(current_win);
+        return;
+      }
+    } else if (c == 'q' || c == 27) {
+      break;
+    }
+    if (sel < top)
+      top = sel;
+    else if (sel >= top + rows)
+      top = sel - rows + 1;
+  }
+  search_stop(search);
+  werase(current_win);
+}
+
+// Finds names containing a term anywhere below the current directory. Hits
+// are listed as the index and the crawl produce them.
+void find_files() {
+  char term[100], label[1100];
+  snprintf(label, sizeof(label), "Find below %s", current_directory_->cwd);
+  if (prompt_term(label, term, sizeof(term)) < 0)
+    return;
+  search_t *search = search_start(current_directory_->cwd, term);
+  if (search == NULL) {
+    werase(path_win);
+    mvwprintw(path_win, 1, 0, "Cannot search %s", current_directory_->cwd);
+    wrefresh(path_win);
+    wgetch(path_win);
+    return;
+  }
+  browse_results(search, term, "dirs");
+}
+
+// Lists the lines containing a string in the files below the current
+// directory.
+void grep_files() {
+  char term[100], label[1100];
+  snprintf(label, sizeof(label), "Grep below %s", current_directory_->cwd);
+  if (prompt_term(label, term, sizeof(term)) < 0 || term[0] == '\0')
+    return;
+  search_t *search = search_grep(current_directory_->cwd, term);
+  if (search == NULL) {
+    werase(path_win);
+    mvwprintw(path_win, 1, 0, "Cannot search %s", current_directory_->cwd);
+    wrefresh(path_win);
+    wgetch(path_win);
+    return;
+  }
+  browse_results(search, term, "files");
+}
+
+// Puts back the entry last deleted on the current directory's filesystem,
+// with the cursor on it if it is below the current directory.
+void restore_file() {
+  char path[PATH_MAX];
+  size_t len = strlen(current_directory_->cwd);
+
+  if (trash_restore(current_directory_->cwd, path, sizeof(path)) < 0) {
+    werase(path_win);
+    if (errno == ENOENT)
+      mvwprintw(path_win, 1, 0, "Nothing to restore.");
+    else
+      mvwprintw(path_win, 1, 0, "Cannot restore: %s", strerror(errno));
+    wrefresh(path_win);
+    wgetch(path_win);
+    return;
+  }
+  if (strncmp(path, current_directory_->cwd, len) == 0) {
+    jump_to(path + len);
+    return;
+  }
+  werase(path_win);
+  mvwprintw(path_win, 1, 0, "Restored %s", path);
+  wrefresh(path_win);
+  wgetch(path_win);
+}
+
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "--batch") == 0)
+        return batch_main(argc - 2, argv + 2);
     init();
     init_curses();
-    getcwd(current_directory_->cwd, sizeof(current_directory_->cwd));
-    strcat(current_directory_->cwd, "/");
-    current_directory_->parent_dir = strdup(get_parent_directory(current_directory_->cwd));
+    dircache_init();
+    ducache_open();
+    info_init();
+    jobs_init();
+    filetype_init();
+    trash_init();
+    trace_init(getenv("FSM_TRACE"));
+    char *cwd = getcwd(NULL, 0);
+    path_t *dir = cwd != NULL ? path_intern(cwd) : NULL;
+    free(cwd);
+    if (dir == NULL || set_directory(dir) < 0) {
+        endwin();
+        printf("Cannot open the current directory.\n");
+        exit(1);
+    }
     int ch;
+    // When the key whose effect the next frame shows was read, or 0.
+    uint64_t key_time = 0;
     do {
-        len = get_no_files_in_directory(current_directory_->cwd);
-        len = len <= 0 ? 1 : len;
-        char *files[len], *temp_dir;
-        get_files(current_directory_->cwd, files);
+        uint64_t frame_start = trace_now(), counts[TRACE_COUNTERS], t;
+        for (int c = 0; c < TRACE_COUNTERS; c++)
+            counts[c] = trace_counter(c);
+        memset(&last_frame, 0, sizeof(last_frame));
+
+        dir_listing_t *listing = dircache_get(current_directory_->cwd);
+        last_frame.list = trace_now() - frame_start;
+        trace_span("list", frame_start);
+        char *name;
+        if (listing == NULL || listing->len == 0) {
+            listing = NULL;
+            len = 1;
+        } else {
+            len = listing->len;
+            if (!listing->sorted) {
+                t = trace_now();
+                sort_listing(listing);
+                last_frame.sort = trace_now() - t;
+                trace_span("sort", t);
+            }
+        }
         if (selection > len - 1) {
             selection = len - 1;
         }
+        name = listing ? dir_listing_name(listing, dir_listing_index(listing, selection)) : "..";
+
+        uint64_t render_start = trace_now();
+        layout_windows();
+        if (!rows_valid) {
+            // Something drew over the panes; paint them from scratch.
+            werase(current_win);
+            werase(path_win);
+            box(current_win, '|', '-');
+        }
 
-        getmaxyx(stdscr, maxy, maxx);
-        maxy -= 2;
-        int t = 0;
-        init_windows();
+        if (listing != NULL) {
+            t = trace_now();
+            dir_listing_prefetch(listing, start, start + maxy - 1,
+                                 show_details || FILETYPE_COLORS);
+            last_frame.stat = trace_now() - t;
+            trace_span("stat", t);
+        }
+        types_shown = filetype_generation();
+        draw_list(listing);
+        wmove(path_win, 1, 0);
+        wclrtoeol(path_win);
+        wprintw(path_win, " %s", current_directory_->cwd);
+        if (listing != NULL)
+            wprintw(path_win, "  [sort: %s%s]", sort_mode_name(listing->sort_mode),
+                    listing->dirs_first ? ", dirs first" : "");
+        int marks = count_marks(listing);
+        if (marks > 0)
+            wprintw(path_win, "  [%d marked]", marks);
+        draw_jobs();
+        werase(info_win);
+        show_file_info(name);
+        box(info_win, '|', '-');
+        refresh_windows();
+
+        t = trace_now();
+        trace_span("render", render_start);
+        trace_span("frame", frame_start);
+        last_frame.render = t - render_start - last_frame.stat;
+        last_frame.total = t - frame_start;
+        for (int c = 0; c < TRACE_COUNTERS; c++)
+            last_frame.counts[c] = trace_counter(c) - counts[c];
+        trace_counters("frame", last_frame.counts);
+        if (key_time != 0)
+            trace_latency(t - key_time);
+        key_time = 0;
+        if (show_overlay) {
+            // Shows this frame's own numbers; curses sends just this corner.
+            draw_overlay();
+            box(info_win, '|', '-');
+            refresh_windows();
+        }
 
-        for (i = start; i < len; i++) {
-            if (t == maxy - 1)
+        while ((ch = wgetch(current_win)) == ERR) {
+            // A batch touching thousands of entries is shown once, when it
+            // is over, not entry by entry as inotify reports them.
+            if (batch_finished()) {
+                dircache_invalidate(current_directory_->cwd);
                 break;
-            int size = snprintf(NULL, 0, "%s%s", current_directory_->cwd, files[i]);
-            if (i == selection) {
-                wattron(current_win, A_STANDOUT);
-            } else {
-                wattroff(current_win, A_STANDOUT);
             }
-
-            temp_dir = malloc(size + 1);
-            snprintf(temp_dir, size + 1, "%s%s", current_directory_->cwd, files[i]);
-
-            stat(temp_dir, &file_stats);
-            isDir(file_stats.st_mode) ? wattron(current_win, COLOR_PAIR(1))
-                                      : wattroff(current_win, COLOR_PAIR(1));
-            wmove(current_win, t + 1, 2);
-            wprintw(current_win, "%.*s\n", maxx, files[i]);
-            free(temp_dir);
-            t++;
+            if ((listing_changed() && !batch_busy()) ||
+                filetype_generation() != types_shown)
+                break;
+            update_file_info(name);
+            update_jobs();
         }
-        wmove(path_win, 1, 0);
-        wprintw(path_win, " %s", current_directory_->cwd);
-        show_file_info(files);
-        refreshWindows();
+        uint64_t key_read = trace_now();
 
-        switch ((ch = wgetch(current_win))) {
+        switch (ch) {
             case KEY_UP:
             case KEY_NAVUP:
                 scroll_up();
+                key_time = key_read;
                 break;
             case KEY_DOWN:
             case KEY_NAVDOWN:
                 scroll_down();
+                key_time = key_read;
                 break;
             case KEY_ENTER:
-                handle_enter(files);
+                // Time spent in the file viewer is not the frame's latency.
+                if (handle_enter(name))
+                    key_time = key_read;
+                break;
+            case KEY_OVERLAY:
+                show_overlay = !show_overlay;
+                key_time = key_read;
                 break;
             case 'r':
             case 'R':
-                rename_file(files);
+                rename_file(name);
                 break;
             case 'c':
             case 'C':
-                copy_files(files);
+                if (count_marks(listing) > 0)
+                    bulk_op(listing, JOB_COPY, name);
+                else
+                    copy_files(name);
                 break;
             case 'm':
             case 'M':
-                move_file(files);
+                if (count_marks(listing) > 0)
+                    bulk_op(listing, JOB_MOVE, name);
+                else
+                    move_file(name);
                 break;
             case 'd':
             case 'D':
-                delete_file(files);
+                if (count_marks(listing) > 0)
+                    bulk_op(listing, JOB_DELETE, name);
+                else
+                    delete_file(name);
+                break;
+            case KEY_CHMOD:
+                bulk_op(listing, JOB_CHMOD, name);
+                break;
+            case KEY_TOGGLE_MARK:
+                if (listing != NULL) {
+                    int index = dir_listing_index(listing, selection);
+                    set_mark(listing, index,
+                             !(listing->entries[index].flags & ENTRY_MARKED));
+                    scroll_down();
+                    key_time = key_read;
+                }
+                break;
+            case KEY_MARK_PATTERN:
+                if (listing != NULL)
+                    mark_pattern(listing);
+                break;
+            case KEY_INVERT_MARKS:
+                if (listing != NULL)
+                    invert_marks(listing);
+                key_time = key_read;
                 break;
             case 's':
             case 'S':
-                search_file(files, len);
+                search_file(listing);
                 break;
             case 'n':
             case 'N':
                 create_file();
                 break;
+            case KEY_FIND_FILES:
+                find_files();
+                break;
+            case KEY_GREP:
+                grep_files();
+                break;
+            case KEY_RESTORE:
+                restore_file();
+                break;
+            case KEY_CANCEL_JOB: {
+                job_info_t jobs[16];
+                int shown;
+                if (list_jobs(jobs, &shown) > 0)
+                    job_cancel(jobs[shown].id);
+                break;
+            }
+            case KEY_NEXT_JOB: {
+                job_info_t jobs[16];
+                int shown, n = list_jobs(jobs, &shown);
+                if (n > 0)
+                    job_focus = jobs[(shown + 1) % n].id;
+                draw_jobs();
+                break;
+            }
+            case 'q':
+                if (jobs_list(NULL, 0) > 0 && !confirm("Jobs are still running. Quit anyway? (y/n)"))
+                    ch = 0;
+                break;
+            case KEY_SORT:
+                if (listing != NULL) {
+                    listing->sort_mode = (listing->sort_mode + 1) % SORT_MODES;
+                    resort(listing);
+                }
+                key_time = key_read;
+                break;
+            case KEY_DETAILS:
+                show_details = !show_details;
+                key_time = key_read;
+                break;
+            case KEY_DIRS_FIRST:
+                if (listing != NULL) {
+                    listing->dirs_first = !listing->dirs_first;
+                    resort(listing);
+                }
+                key_time = key_read;
+                break;
         }
-        for (i = 0; i < len; i++) {
-            free(files[i]);
-        }
+        // Prompts and viewers draw over the panes; only moving the cursor
+        // leaves them as they were.
+        if (ch != ERR && ch != KEY_UP && ch != KEY_NAVUP && ch != KEY_DOWN &&
+            ch != KEY_NAVDOWN && ch != KEY_TOGGLE_MARK && ch != KEY_INVERT_MARKS)
+            rows_valid = 0;
     } while (ch != 'q');
+    jobs_shutdown();
+    trash_shutdown();
+    filetype_shutdown();
+    info_shutdown();
+    dircache_shutdown();
+    ducache_close();
+    trace_shutdown();
     endwin();
 }
\ No newline at end of file
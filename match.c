@@ -0,0 +1,105 @@
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "match.h"
+
+typedef const char *(*find_fn)(const char *, size_t, const char *, size_t);
+
+static const char *find_scalar(const char *hay, size_t n, const char *needle,
+                               size_t m) {
+  const char *end = hay + n - m + 1, *p = hay;
+  while (p < end && (p = memchr(p, needle[0], end - p)) != NULL) {
+    if (memcmp(p + 1, needle + 1, m - 1) == 0)
+      return p;
+    p++;
+  }
+  return NULL;
+}
+
+#if defined(__x86_64__)
+// Bit i of mask is set where hay[i] matches the first needle byte and
+// hay[i + m - 1] the last one; only those positions are compared in full.
+static const char *find_sse2(const char *hay, size_t n, const char *needle,
+                             size_t m) {
+  const __m128i first = _mm_set1_epi8(needle[0]);
+  const __m128i last = _mm_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+
+  for (; i + m - 1 + 16 <= n; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i *)(hay + i));
+    __m128i b = _mm_loadu_si128((const __m128i *)(hay + i + m - 1));
+    unsigned mask = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i + m <= n ? find_scalar(hay + i, n - i, needle, m) : NULL;
+}
+
+__attribute__((target("avx2")))
+static const char *find_avx2(const char *hay, size_t n, const char *needle,
+                             size_t m) {
+  const __m256i first = _mm256_set1_epi8(needle[0]);
+  const __m256i last = _mm256_set1_epi8(needle[m - 1]);
+  size_t i = 0;
+
+  for (; i + m - 1 + 32 <= n; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(hay + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(hay + i + m - 1));
+    unsigned mask = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(a, first), _mm256_cmpeq_epi8(b, last)));
+    while (mask != 0) {
+      int bit = __builtin_ctz(mask);
+      if (memcmp(hay + i + bit + 1, needle + 1, m - 2) == 0)
+        return hay + i + bit;
+      mask &= mask - 1;
+    }
+  }
+  return i + m <= n ? find_sse2(hay + i, n - i, needle, m) : NULL;
+}
+#endif
+
+static find_fn pick(void) {
+#if defined(__x86_64__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return find_avx2;
+  return find_sse2;
+#else
+  return find_scalar;
+#endif
+}
+
+const char *match_find(const char *hay, size_t n, const char *needle, size_t m) {
+  static find_fn find = NULL;
+  find_fn f = __atomic_load_n(&find, __ATOMIC_RELAXED);
+
+  if (m == 0)
+    return hay;
+  if (m > n)
+    return NULL;
+  if (m == 1)
+    return memchr(hay, needle[0], n);
+  if (f == NULL) {
+    f = pick();
+    __atomic_store_n(&find, f, __ATOMIC_RELAXED);
+  }
+  return f(hay, n, needle, m);
+}
+
+size_t match_count(const char *p, size_t n, char c) {
+  const char *end = p + n;
+  size_t count = 0;
+  while (p < end && (p = memchr(p, c, end - p)) != NULL) {
+    count++;
+    p++;
+  }
+  return count;
+}
@@ -0,0 +1,15 @@
+#ifndef MATCH_H
+#define MATCH_H
+
+#include <stddef.h>
+
+// Returns the first occurrence of needle (m bytes) in hay (n bytes), or
+// NULL. Candidates are found a vector at a time by comparing the first and
+// last byte of the needle at every position; AVX2 is used when the CPU has
+// it, SSE2 otherwise on x86-64, and a memchr() loop elsewhere.
+const char *match_find(const char *hay, size_t n, const char *needle, size_t m);
+
+// Number of c bytes in the n bytes at p.
+size_t match_count(const char *p, size_t n, char c);
+
+#endif
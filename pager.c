@@ -0,0 +1,418 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "match.h"
+#include "pager.h"
+
+// Address space mapped past the end of a file, so that it can grow that
+// much before it has to be mapped again.
+#define MAP_RESERVE ((uint64_t)1 << 32)
+
+// The indexer publishes its progress every INDEX_BLOCK bytes, and counts
+// newlines INDEX_RUN bytes at a time.
+#define INDEX_BLOCK (64 * 1024)
+#define INDEX_RUN 256
+
+// Mappings the SIGBUS handler may patch. Pages of a mapping past the end of
+// a file that was truncated under it fault with SIGBUS when read, from the
+// indexer or the UI; the handler maps a page of zeros over the one that
+// faulted and notes the hit, and pager_refresh() then maps the file again.
+#define MAX_MAPS 8
+
+static struct {
+  char *start;
+  uint64_t len;
+  int hit;
+} maps[MAX_MAPS];
+
+static struct sigaction old_sigbus;
+static long page_size;
+static pthread_once_t sigbus_once = PTHREAD_ONCE_INIT;
+
+struct pager_ {
+  char path[PATH_MAX];
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  char *data;
+  uint64_t size;
+  // Length of the mapping; 0 when data is a copy read into memory.
+  uint64_t map_len;
+  // The slot in maps, or -1.
+  int slot;
+  pthread_mutex_t lock;
+  pthread_t indexer;
+  int started, running, stop;
+  // marks[i] is the offset of line i * PAGER_STRIDE. The index has read
+  // indexed bytes and found lines newlines in them.
+  uint64_t *marks;
+  size_t nmarks, cap;
+  uint64_t indexed, lines;
+};
+
+static int add_mark(pager_t *p, uint64_t off) {
+  if (p->nmarks == p->cap) {
+    size_t cap = p->cap ? p->cap * 2 : 1024;
+    uint64_t *grown = realloc(p->marks, cap * sizeof(uint64_t));
+    if (grown == NULL)
+      return -1;
+    p->marks = grown;
+    p->cap = cap;
+  }
+  p->marks[p->nmarks++] = off;
+  return 0;
+}
+
+// Counts newlines from where the index stopped to the end of the file,
+// noting where every PAGER_STRIDE-th line starts. Runs of bytes are counted
+// with match_count() until one holds the newline ending such a line, which
+// memchr() then finds.
+static void *index_main(void *arg) {
+  pager_t *p = arg;
+  uint64_t found[INDEX_BLOCK / PAGER_STRIDE + 1];
+
+  pthread_mutex_lock(&p->lock);
+  uint64_t pos = p->indexed, lines = p->lines;
+  while (!p->stop) {
+    uint64_t size = p->size;
+    if (pos >= size) {
+      // Checked under the lock pager_refresh() takes to grow the file, so
+      // new data either is seen here or starts a new indexer.
+      p->running = 0;
+      break;
+    }
+    pthread_mutex_unlock(&p->lock);
+
+    const char *q = p->data + pos;
+    const char *end = q + (size - pos < INDEX_BLOCK ? size - pos : INDEX_BLOCK);
+    uint64_t need = PAGER_STRIDE - lines % PAGER_STRIDE;
+    size_t nfound = 0;
+    while (q < end) {
+      size_t step = end - q < INDEX_RUN ? end - q : INDEX_RUN;
+      size_t c = match_count(q, step, '\n');
+      if (c < need) {
+        need -= c;
+        lines += c;
+        q += step;
+        continue;
+      }
+      lines += need;
+      for (; need > 0; need--)
+        q = (const char *)memchr(q, '\n', end - q) + 1;
+      found[nfound++] = q - p->data;
+      need = PAGER_STRIDE;
+    }
+    pos = end - p->data;
+
+    pthread_mutex_lock(&p->lock);
+    for (size_t i = 0; i < nfound; i++)
+      if (add_mark(p, found[i]) < 0)
+        p->stop = 1;
+    p->indexed = pos;
+    p->lines = lines;
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+// Patches the page that faulted if it belongs to a pager's mapping. Any
+// other fault gets the action there was before, and faults again.
+static void on_sigbus(int sig, siginfo_t *si, void *ctx) {
+  char *addr = si->si_addr;
+  (void)ctx;
+  for (int i = 0; i < MAX_MAPS; i++) {
+    char *start = __atomic_load_n(&maps[i].start, __ATOMIC_ACQUIRE);
+    if (start == NULL || addr < start || addr >= start + maps[i].len)
+      continue;
+    char *page = start + (addr - start) / page_size * page_size;
+    if (mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) !=
+        MAP_FAILED) {
+      __atomic_store_n(&maps[i].hit, 1, __ATOMIC_RELEASE);
+      return;
+    }
+  }
+  if (sig == SIGBUS)
+    sigaction(SIGBUS, &old_sigbus, NULL);
+}
+
+static void install_sigbus(void) {
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_sigaction = on_sigbus;
+  sa.sa_flags = SA_SIGINFO | SA_RESTART;
+  sigemptyset(&sa.sa_mask);
+  page_size = sysconf(_SC_PAGESIZE);
+  sigaction(SIGBUS, &sa, &old_sigbus);
+}
+
+// Lets the SIGBUS handler patch the mapping. Without a free slot a
+// truncation still kills the process, as it would have anyway.
+static void guard_map(pager_t *p) {
+  pthread_once(&sigbus_once, install_sigbus);
+  for (int i = 0; i < MAX_MAPS; i++) {
+    char *none = NULL;
+    if (__atomic_load_n(&maps[i].start, __ATOMIC_ACQUIRE) != NULL)
+      continue;
+    maps[i].len = p->map_len;
+    maps[i].hit = 0;
+    if (__atomic_compare_exchange_n(&maps[i].start, &none, p->data, 0, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED)) {
+      p->slot = i;
+      return;
+    }
+  }
+}
+
+// Whether a read of the mapping has faulted since it was made.
+static int map_hit(const pager_t *p) {
+  return p->slot >= 0 && __atomic_load_n(&maps[p->slot].hit, __ATOMIC_ACQUIRE);
+}
+
+// Starts indexing from where the index stopped. Called with the lock held.
+static void start_indexer(pager_t *p) {
+  if (p->running)
+    return;
+  if (p->started)
+    pthread_join(p->indexer, NULL);
+  p->started = pthread_create(&p->indexer, NULL, index_main, p) == 0;
+  p->running = p->started;
+}
+
+static void stop_indexer(pager_t *p) {
+  pthread_mutex_lock(&p->lock);
+  p->stop = 1;
+  pthread_mutex_unlock(&p->lock);
+  if (p->started)
+    pthread_join(p->indexer, NULL);
+  p->started = p->running = p->stop = 0;
+}
+
+static void unload(pager_t *p) {
+  if (p->slot >= 0)
+    __atomic_store_n(&maps[p->slot].start, NULL, __ATOMIC_RELEASE);
+  p->slot = -1;
+  if (p->map_len > 0)
+    munmap(p->data, p->map_len);
+  else
+    free(p->data);
+  p->data = NULL;
+  p->size = p->map_len = 0;
+}
+
+// Reads a file that cannot be mapped into memory.
+static int read_all(pager_t *p) {
+  size_t cap = 64 * 1024;
+  ssize_t n;
+
+  p->data = malloc(cap);
+  if (p->data == NULL)
+    return -1;
+  while ((n = read(p->fd, p->data + p->size, cap - p->size)) > 0) {
+    p->size += n;
+    if (p->size == cap) {
+      char *grown = realloc(p->data, cap * 2);
+      if (grown == NULL)
+        return -1;
+      p->data = grown;
+      cap *= 2;
+    }
+  }
+  return n < 0 ? -1 : 0;
+}
+
+// Maps the open file with room to grow.
+static int load(pager_t *p) {
+  struct stat st;
+  long page = sysconf(_SC_PAGESIZE);
+
+  if (fstat(p->fd, &st) < 0)
+    return -1;
+  p->dev = st.st_dev;
+  p->ino = st.st_ino;
+  if (S_ISREG(st.st_mode)) {
+    uint64_t len = ((uint64_t)st.st_size + MAP_RESERVE + page - 1) / page * page;
+    void *m = mmap(NULL, len, PROT_READ, MAP_SHARED, p->fd, 0);
+    if (m != MAP_FAILED) {
+      p->data = m;
+      p->map_len = len;
+      p->size = st.st_size;
+      guard_map(p);
+      return 0;
+    }
+  }
+  return read_all(p);
+}
+
+static void reset_index(pager_t *p) {
+  p->nmarks = 0;
+  p->indexed = p->lines = 0;
+  add_mark(p, 0);
+}
+
+pager_t *pager_open(const char *path) {
+  pager_t *p = calloc(1, sizeof(pager_t));
+  if (p == NULL)
+    return NULL;
+  snprintf(p->path, sizeof(p->path), "%s", path);
+  pthread_mutex_init(&p->lock, NULL);
+  p->slot = -1;
+  p->fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (p->fd < 0 || load(p) < 0) {
+    int err = errno;
+    pager_close(p);
+    errno = err;
+    return NULL;
+  }
+  reset_index(p);
+  pthread_mutex_lock(&p->lock);
+  start_indexer(p);
+  pthread_mutex_unlock(&p->lock);
+  return p;
+}
+
+const char *pager_data(const pager_t *p) {
+  return p->data;
+}
+
+uint64_t pager_size(const pager_t *p) {
+  return p->size;
+}
+
+int pager_is_binary(const pager_t *p) {
+  size_t n = p->size < VIEW_BINARY_PROBE ? p->size : VIEW_BINARY_PROBE;
+  return n > 0 && memchr(p->data, '\0', n) != NULL;
+}
+
+uint64_t pager_line_start(const pager_t *p, uint64_t off) {
+  if (off > p->size)
+    off = p->size;
+  const char *nl = off > 0 ? memrchr(p->data, '\n', off) : NULL;
+  return nl != NULL ? (uint64_t)(nl - p->data) + 1 : 0;
+}
+
+uint64_t pager_next_line(const pager_t *p, uint64_t off) {
+  if (off >= p->size)
+    return p->size;
+  const char *nl = memchr(p->data + off, '\n', p->size - off);
+  return nl != NULL ? (uint64_t)(nl - p->data) + 1 : p->size;
+}
+
+uint64_t pager_prev_line(const pager_t *p, uint64_t off) {
+  uint64_t start = pager_line_start(p, off);
+  return start > 0 ? pager_line_start(p, start - 1) : 0;
+}
+
+int pager_line_offset(pager_t *p, uint64_t line, uint64_t *off) {
+  int ok = -1;
+
+  pthread_mutex_lock(&p->lock);
+  size_t k = line / PAGER_STRIDE;
+  if (k < p->nmarks) {
+    const char *q = p->data + p->marks[k];
+    const char *end = p->data + p->indexed;
+    uint64_t skip = line % PAGER_STRIDE;
+    for (; skip > 0 && q != NULL; skip--) {
+      q = q < end ? memchr(q, '\n', end - q) : NULL;
+      if (q != NULL)
+        q++;
+    }
+    // A line starting at the very end only exists in an empty file.
+    if (q != NULL && ((uint64_t)(q - p->data) < p->size || line == 0)) {
+      *off = q - p->data;
+      ok = 0;
+    }
+  }
+  pthread_mutex_unlock(&p->lock);
+  return ok;
+}
+
+int pager_line_number(pager_t *p, uint64_t off, uint64_t *line) {
+  int ok = -1;
+
+  pthread_mutex_lock(&p->lock);
+  if (off <= p->indexed) {
+    size_t lo = 0, hi = p->nmarks;
+    while (hi - lo > 1) {
+      size_t mid = lo + (hi - lo) / 2;
+      if (p->marks[mid] <= off)
+        lo = mid;
+      else
+        hi = mid;
+    }
+    *line = (uint64_t)lo * PAGER_STRIDE +
+            match_count(p->data + p->marks[lo], off - p->marks[lo], '\n');
+    ok = 0;
+  }
+  pthread_mutex_unlock(&p->lock);
+  return ok;
+}
+
+int pager_progress(pager_t *p, uint64_t *lines, uint64_t *indexed) {
+  pthread_mutex_lock(&p->lock);
+  int done = p->indexed >= p->size;
+  *lines = p->lines;
+  // The last line counts even without a newline at its end.
+  if (done && p->size > 0 && p->data[p->size - 1] != '\n')
+    (*lines)++;
+  *indexed = p->indexed;
+  pthread_mutex_unlock(&p->lock);
+  return done;
+}
+
+int pager_refresh(pager_t *p) {
+  struct stat st, now;
+  int changed = 1;
+
+  if (p->map_len == 0 || stat(p->path, &st) < 0 || fstat(p->fd, &now) < 0)
+    return 0;
+  if (st.st_dev != p->dev || st.st_ino != p->ino || (uint64_t)now.st_size < p->size ||
+      map_hit(p)) {
+    // Rotated or truncated: start over on whatever the path holds now.
+    int fd = open(p->path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      return 0;
+    stop_indexer(p);
+    unload(p);
+    close(p->fd);
+    p->fd = fd;
+    reset_index(p);
+    load(p);
+    changed = 2;
+  } else if ((uint64_t)now.st_size == p->size) {
+    return 0;
+  } else if ((uint64_t)now.st_size > p->map_len) {
+    // Grown past the reserve. The index still holds.
+    stop_indexer(p);
+    unload(p);
+    load(p);
+  } else {
+    pthread_mutex_lock(&p->lock);
+    p->size = now.st_size;
+    pthread_mutex_unlock(&p->lock);
+  }
+  pthread_mutex_lock(&p->lock);
+  start_indexer(p);
+  pthread_mutex_unlock(&p->lock);
+  return changed;
+}
+
+void pager_close(pager_t *p) {
+  stop_indexer(p);
+  unload(p);
+  if (p->fd >= 0)
+    close(p->fd);
+  pthread_mutex_destroy(&p->lock);
+  free(p->marks);
+  free(p);
+}
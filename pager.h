@@ -0,0 +1,54 @@
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A file mapped for viewing. Lines are found on demand from byte offsets,
+// so any part of the file can be shown at once; a background thread builds
+// an index of every PAGER_STRIDE-th line start for going to a line number.
+// The mapping reserves room past the end so that a growing file can be
+// followed without remapping or indexing it again.
+typedef struct pager_ pager_t;
+
+// Maps path and starts indexing it. Files that cannot be mapped, such as
+// those in /proc, are read into memory instead. Returns NULL with errno set
+// on failure.
+pager_t *pager_open(const char *path);
+
+// The bytes currently in view of the pager, valid until the next
+// pager_refresh().
+const char *pager_data(const pager_t *p);
+uint64_t pager_size(const pager_t *p);
+
+// Whether the first VIEW_BINARY_PROBE bytes hold a NUL.
+int pager_is_binary(const pager_t *p);
+
+// Offset of the start of the line holding off, of the line after it (the
+// size if there is none), and of the line before it.
+uint64_t pager_line_start(const pager_t *p, uint64_t off);
+uint64_t pager_next_line(const pager_t *p, uint64_t off);
+uint64_t pager_prev_line(const pager_t *p, uint64_t off);
+
+// Offset of the first byte of line (from 0). Returns -1 while the index has
+// not got that far, or if the file has fewer lines.
+int pager_line_offset(pager_t *p, uint64_t line, uint64_t *off);
+
+// Number of the line starting at or holding off. Returns -1 while the index
+// has not got that far.
+int pager_line_number(pager_t *p, uint64_t off, uint64_t *line);
+
+// How far the index has got: lines found and bytes read. Returns 1 once it
+// has read the whole file, when lines is the line count.
+int pager_progress(pager_t *p, uint64_t *lines, uint64_t *indexed);
+
+// Checks whether the file changed. Appended data is taken in and indexed
+// from where the index stopped; a file that shrank or was replaced is
+// mapped and indexed again. A file truncated while mapped reads as zeros,
+// rather than faulting, until then. Returns 2 if the file was mapped
+// again, 1 if data was appended, 0 if nothing changed.
+int pager_refresh(pager_t *p);
+
+void pager_close(pager_t *p);
+
+#endif
@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "paths.h"
+
+#define NODES_PER_BLOCK 1024
+
+#define NAMES_PER_BLOCK (64 * 1024)
+
+static path_t root = {&root, NULL, "", 0, 1};
+
+// Nodes chained by hash of (parent, name), and the blocks they and their
+// names are carved from. Blocks are never freed or moved.
+static path_t **buckets = NULL;
+static size_t nbuckets = 0, nnodes = 0;
+static path_t *nodes = NULL;
+static size_t nodes_left = 0;
+static char *names = NULL;
+static size_t names_left = 0;
+
+static size_t hash_key(const path_t *parent, const char *name, size_t len) {
+  uint64_t h = 1469598103934665603ull ^ (uintptr_t)parent;
+  for (size_t i = 0; i < len; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 1099511628211ull;
+  }
+  return h ^ (h >> 32);
+}
+
+static int rehash(void) {
+  size_t n = nbuckets ? nbuckets * 2 : 256;
+  path_t **b = calloc(n, sizeof(path_t *));
+  if (b == NULL)
+    return -1;
+  for (size_t i = 0; i < nbuckets; i++) {
+    while (buckets[i] != NULL) {
+      path_t *p = buckets[i];
+      buckets[i] = p->next;
+      size_t j = hash_key(p->parent, p->name, p->name_len) & (n - 1);
+      p->next = b[j];
+      b[j] = p;
+    }
+  }
+  free(buckets);
+  buckets = b;
+  nbuckets = n;
+  return 0;
+}
+
+// Finds or adds the node for the len bytes of name inside dir.
+static path_t *lookup(path_t *dir, const char *name, size_t len) {
+  if (len > NAME_MAX) {
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+  if (nbuckets > 0) {
+    size_t i = hash_key(dir, name, len) & (nbuckets - 1);
+    for (path_t *p = buckets[i]; p != NULL; p = p->next)
+      if (p->parent == dir && p->name_len == len && memcmp(p->name, name, len) == 0)
+        return p;
+  }
+  if ((nnodes + 1) * 2 > nbuckets && rehash() < 0)
+    return NULL;
+  if (nodes_left == 0) {
+    nodes = malloc(NODES_PER_BLOCK * sizeof(path_t));
+    if (nodes == NULL)
+      return NULL;
+    nodes_left = NODES_PER_BLOCK;
+  }
+  if (names_left < len + 1) {
+    names = malloc(NAMES_PER_BLOCK);
+    if (names == NULL)
+      return NULL;
+    names_left = NAMES_PER_BLOCK;
+  }
+  path_t *p = nodes++;
+  nodes_left--;
+  memcpy(names, name, len);
+  names[len] = '\0';
+  p->name = names;
+  names += len + 1;
+  names_left -= len + 1;
+  p->name_len = len;
+  p->parent = dir;
+  p->len = dir->len + len + 1;
+  size_t i = hash_key(dir, name, len) & (nbuckets - 1);
+  p->next = buckets[i];
+  buckets[i] = p;
+  nnodes++;
+  return p;
+}
+
+path_t *path_child(path_t *dir, const char *name) {
+  while (dir != NULL && *name != '\0') {
+    size_t len = strcspn(name, "/");
+    if (len == 2 && name[0] == '.' && name[1] == '.')
+      dir = dir->parent;
+    else if (len > 0 && !(len == 1 && name[0] == '.'))
+      dir = lookup(dir, name, len);
+    name += len;
+    name += *name == '/';
+  }
+  return dir;
+}
+
+path_t *path_intern(const char *path) {
+  if (path[0] != '/') {
+    errno = EINVAL;
+    return NULL;
+  }
+  return path_child(&root, path);
+}
+
+size_t path_format(const path_t *p, char *buf, size_t size) {
+  if (size > p->len) {
+    // Filled from the end, one component at a time.
+    char *end = buf + p->len;
+    *end = '\0';
+    for (; p->parent != p; p = p->parent) {
+      *--end = '/';
+      end -= p->name_len;
+      memcpy(end, p->name, p->name_len);
+    }
+    *--end = '/';
+  } else if (size > 0) {
+    // Rare enough to spell out in full first.
+    char *full = malloc(p->len + 1);
+    if (full != NULL) {
+      path_format(p, full, p->len + 1);
+      memcpy(buf, full, size - 1);
+      free(full);
+    }
+    buf[full != NULL ? size - 1 : 0] = '\0';
+  }
+  return p->len;
+}
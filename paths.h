@@ -0,0 +1,37 @@
+#ifndef PATHS_H
+#define PATHS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// An interned directory path: a name and a link to the parent's node, so
+// that every directory is stored once and shares its prefix with its
+// parent. Nodes live until exit; the same path always gives the same node,
+// so nodes can be compared by pointer. Only the UI thread uses them.
+typedef struct path_ {
+  struct path_ *parent;
+  struct path_ *next;
+  const char *name;
+  uint16_t name_len;
+  // Length of the path spelt out by path_format(), without the NUL.
+  uint32_t len;
+} path_t;
+
+// Returns the node of the absolute path. Empty components and "." are
+// skipped and ".." goes up a level; symlinks are not resolved. Returns
+// NULL with errno set if path is relative or memory runs out.
+path_t *path_intern(const char *path);
+
+// Returns the node of the directory name inside dir.
+path_t *path_child(path_t *dir, const char *name);
+
+// The root's parent is the root.
+static inline path_t *path_parent(path_t *p) {
+  return p->parent;
+}
+
+// Writes p with a trailing '/' ("/" for the root) to buf, as far as it
+// fits. Returns p->len, as snprintf() would.
+size_t path_format(const path_t *p, char *buf, size_t size);
+
+#endif
@@ -0,0 +1,238 @@
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+typedef struct task_ {
+  pool_fn fn;
+  void *arg;
+} task_t;
+
+// Growable ring buffer of tasks. The owner pushes and pops at the head,
+// thieves take from the tail.
+typedef struct deque_ {
+  pthread_mutex_t lock;
+  task_t *tasks;
+  size_t head, tail, cap;
+} deque_t;
+
+typedef struct worker_ {
+  pool_t *pool;
+  int index;
+  pthread_t thread;
+} worker_t;
+
+struct pool_ {
+  int nthreads;
+  worker_t *workers;
+  deque_t *deques;
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv, idle_cv;
+  unsigned long pending;
+  unsigned long queued;
+  int shutdown;
+  unsigned next;
+};
+
+static __thread worker_t *current_worker = NULL;
+
+static int deque_push(deque_t *d, task_t t) {
+  pthread_mutex_lock(&d->lock);
+  if (d->head - d->tail == d->cap) {
+    size_t cap = d->cap ? d->cap * 2 : 64;
+    task_t *tasks = malloc(cap * sizeof(task_t));
+    if (tasks == NULL) {
+      pthread_mutex_unlock(&d->lock);
+      return -1;
+    }
+    for (size_t i = d->tail; i != d->head; i++)
+      tasks[i % cap] = d->tasks[i % d->cap];
+    free(d->tasks);
+    d->tasks = tasks;
+    d->cap = cap;
+  }
+  d->tasks[d->head++ % d->cap] = t;
+  pthread_mutex_unlock(&d->lock);
+  return 0;
+}
+
+static int deque_pop(deque_t *d, task_t *t) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->head != d->tail) {
+    *t = d->tasks[--d->head % d->cap];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+static int deque_steal(deque_t *d, task_t *t) {
+  int found = 0;
+  pthread_mutex_lock(&d->lock);
+  if (d->head != d->tail) {
+    *t = d->tasks[d->tail++ % d->cap];
+    found = 1;
+  }
+  pthread_mutex_unlock(&d->lock);
+  return found;
+}
+
+// Takes a task from the worker's own deque, or steals one from a victim.
+static int find_task(pool_t *p, int self, task_t *t) {
+  if (deque_pop(&p->deques[self], t))
+    return 1;
+  for (int i = 1; i < p->nthreads; i++)
+    if (deque_steal(&p->deques[(self + i) % p->nthreads], t))
+      return 1;
+  return 0;
+}
+
+static void *worker_main(void *arg) {
+  worker_t *w = arg;
+  pool_t *p = w->pool;
+  task_t t;
+
+  current_worker = w;
+  for (;;) {
+    if (find_task(p, w->index, &t)) {
+      pthread_mutex_lock(&p->lock);
+      p->queued--;
+      pthread_mutex_unlock(&p->lock);
+      t.fn(t.arg, w->index);
+      pthread_mutex_lock(&p->lock);
+      if (--p->pending == 0)
+        pthread_cond_broadcast(&p->idle_cv);
+      pthread_mutex_unlock(&p->lock);
+      continue;
+    }
+    pthread_mutex_lock(&p->lock);
+    while (p->queued == 0 && !p->shutdown)
+      pthread_cond_wait(&p->work_cv, &p->lock);
+    if (p->queued == 0 && p->shutdown) {
+      pthread_mutex_unlock(&p->lock);
+      return NULL;
+    }
+    pthread_mutex_unlock(&p->lock);
+  }
+}
+
+pool_t *pool_create(int threads) {
+  pool_t *p = calloc(1, sizeof(pool_t));
+  if (p == NULL)
+    return NULL;
+  if (threads <= 0)
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads <= 0)
+    threads = 1;
+  p->nthreads = threads;
+  p->workers = calloc(threads, sizeof(worker_t));
+  p->deques = calloc(threads, sizeof(deque_t));
+  if (p->workers == NULL || p->deques == NULL) {
+    free(p->workers);
+    free(p->deques);
+    free(p);
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->work_cv, NULL);
+  pthread_cond_init(&p->idle_cv, NULL);
+  for (int i = 0; i < threads; i++)
+    pthread_mutex_init(&p->deques[i].lock, NULL);
+  for (int i = 0; i < threads; i++) {
+    p->workers[i].pool = p;
+    p->workers[i].index = i;
+    if (pthread_create(&p->workers[i].thread, NULL, worker_main,
+                       &p->workers[i]) != 0) {
+      // Run with however many workers could be started.
+      p->nthreads = i;
+      break;
+    }
+  }
+  if (p->nthreads == 0) {
+    pool_destroy(p);
+    return NULL;
+  }
+  return p;
+}
+
+int pool_threads(const pool_t *p) { return p->nthreads; }
+
+int pool_submit(pool_t *p, pool_fn fn, void *arg) {
+  task_t t = {fn, arg};
+  int target;
+
+  if (current_worker != NULL && current_worker->pool == p) {
+    target = current_worker->index;
+  } else {
+    pthread_mutex_lock(&p->lock);
+    target = p->next++ % p->nthreads;
+    pthread_mutex_unlock(&p->lock);
+  }
+  pthread_mutex_lock(&p->lock);
+  p->pending++;
+  p->queued++;
+  pthread_mutex_unlock(&p->lock);
+  if (deque_push(&p->deques[target], t) < 0) {
+    pthread_mutex_lock(&p->lock);
+    p->queued--;
+    if (--p->pending == 0)
+      pthread_cond_broadcast(&p->idle_cv);
+    pthread_mutex_unlock(&p->lock);
+    return -1;
+  }
+  pthread_mutex_lock(&p->lock);
+  pthread_cond_signal(&p->work_cv);
+  pthread_mutex_unlock(&p->lock);
+  return 0;
+}
+
+int pool_wait(pool_t *p, int timeout_ms) {
+  struct timespec deadline;
+  int idle;
+
+  if (timeout_ms >= 0) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  }
+  pthread_mutex_lock(&p->lock);
+  while (p->pending != 0) {
+    if (timeout_ms < 0) {
+      pthread_cond_wait(&p->idle_cv, &p->lock);
+    } else if (pthread_cond_timedwait(&p->idle_cv, &p->lock, &deadline) ==
+               ETIMEDOUT) {
+      break;
+    }
+  }
+  idle = p->pending == 0;
+  pthread_mutex_unlock(&p->lock);
+  return idle;
+}
+
+void pool_destroy(pool_t *p) {
+  pool_wait(p, -1);
+  pthread_mutex_lock(&p->lock);
+  p->shutdown = 1;
+  pthread_cond_broadcast(&p->work_cv);
+  pthread_mutex_unlock(&p->lock);
+  for (int i = 0; i < p->nthreads; i++)
+    pthread_join(p->workers[i].thread, NULL);
+  for (int i = 0; i < p->nthreads; i++) {
+    pthread_mutex_destroy(&p->deques[i].lock);
+    free(p->deques[i].tasks);
+  }
+  pthread_mutex_destroy(&p->lock);
+  pthread_cond_destroy(&p->work_cv);
+  pthread_cond_destroy(&p->idle_cv);
+  free(p->workers);
+  free(p->deques);
+  free(p);
+}
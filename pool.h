@@ -0,0 +1,27 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Task run by a pool worker; worker is the index of the running thread, in
+// [0, pool_threads()).
+typedef void (*pool_fn)(void *arg, int worker);
+
+typedef struct pool_ pool_t;
+
+// Starts a work-stealing pool. threads <= 0 means one per online CPU.
+pool_t *pool_create(int threads);
+
+int pool_threads(const pool_t *p);
+
+// Queues a task. From inside a task it goes to the front of the calling
+// worker's own deque; idle workers steal from the back of busy ones.
+int pool_submit(pool_t *p, pool_fn fn, void *arg);
+
+// Waits until every submitted task, including the ones they submitted, has
+// finished. With timeout_ms >= 0 it gives up after that long. Returns 1
+// when the pool is idle and 0 on timeout.
+int pool_wait(pool_t *p, int timeout_ms);
+
+// Waits for the pool to drain and joins the workers.
+void pool_destroy(pool_t *p);
+
+#endif
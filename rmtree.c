@@ -0,0 +1,284 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "pool.h"
+#include "rmtree.h"
+#include "uring.h"
+
+// Directory being emptied. It stays open until its own scan and every
+// subdirectory under it are done, since those are removed relative to fd;
+// then it is removed from its parent, which may complete in turn.
+typedef struct rm_dir_ {
+  struct rm_dir_ *parent;
+  struct rm_walk_ *w;
+  int fd;
+  int pending;
+  int top;
+  char name[];
+} rm_dir_t;
+
+// Per-worker counts, padded so workers never share a cache line.
+typedef struct rm_counters_ {
+  uint64_t files, dirs, errors;
+  char *buf;
+  char pad[64];
+} rm_counters_t;
+
+typedef struct rm_walk_ {
+  pool_t *pool;
+  const rm_options_t *opt;
+  int nthreads;
+  int top_error;
+  rm_counters_t *counters;
+} rm_walk_t;
+
+static void add(uint64_t *counter, uint64_t n) {
+  __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static int cancelled(const rm_walk_t *w) {
+  return w->opt->cancel != NULL &&
+         __atomic_load_n(w->opt->cancel, __ATOMIC_RELAXED);
+}
+
+// Drops one pending unit of d. The last one removes d from its parent.
+static void finish_dir(rm_walk_t *w, rm_dir_t *d, rm_counters_t *c) {
+  while (__atomic_sub_fetch(&d->pending, 1, __ATOMIC_ACQ_REL) == 0) {
+    rm_dir_t *p = d->parent;
+    if (d->top)
+      return;
+    if (d->fd >= 0)
+      close(d->fd);
+    if (!cancelled(w)) {
+      if (unlinkat(p->fd, d->name, AT_REMOVEDIR) == 0) {
+        add(&c->dirs, 1);
+      } else {
+        add(&c->errors, 1);
+        if (p->top)
+          w->top_error = errno;
+      }
+    }
+    free(d);
+    d = p;
+  }
+}
+
+static void empty_dir(void *arg, int worker);
+
+static void spawn(rm_walk_t *w, rm_dir_t *parent, const char *name,
+                  rm_counters_t *c) {
+  size_t n = strlen(name) + 1;
+  rm_dir_t *d = malloc(sizeof(rm_dir_t) + n);
+  if (d == NULL) {
+    add(&c->errors, 1);
+    return;
+  }
+  d->parent = parent;
+  d->w = w;
+  d->fd = -1;
+  d->pending = 1;
+  d->top = 0;
+  memcpy(d->name, name, n);
+  __atomic_add_fetch(&parent->pending, 1, __ATOMIC_ACQ_REL);
+  if (pool_submit(w->pool, empty_dir, d) < 0) {
+    free(d);
+    add(&c->errors, 1);
+    finish_dir(w, parent, c);
+  }
+}
+
+typedef struct rm_scan_ {
+  rm_walk_t *w;
+  rm_dir_t *d;
+  rm_counters_t *c;
+} rm_scan_t;
+
+// Tallies the result of unlinking name from d.
+static void unlinked(rm_scan_t *s, const char *name, int res) {
+  if (res == 0) {
+    add(&s->c->files, 1);
+  } else if (res == -EISDIR) {
+    // DT_UNKNOWN on a filesystem without d_type.
+    spawn(s->w, s->d, name, s->c);
+  } else {
+    add(&s->c->errors, 1);
+  }
+}
+
+// Completion of an unlinkat queued by empty_dir(); the tag is the name.
+static void unlink_done(void *arg, uint64_t tag, int res, const struct statx *stx) {
+  rm_scan_t *s = arg;
+  const char *name = (const char *)(uintptr_t)tag;
+
+  // Dropped by a ring that failed; made here instead.
+  if (res == -ECANCELED)
+    res = unlinkat(s->d->fd, name, 0) == 0 ? 0 : -errno;
+  unlinked(s, name, res);
+}
+
+// Unlinks every non-directory entry of d and queues its subdirectories.
+// With a ring the unlinks of each getdents64 batch go through it, and all
+// of them complete before c->buf, which holds their names, is reused.
+static void empty_dir(void *arg, int worker) {
+  rm_dir_t *d = arg;
+  rm_walk_t *w = d->w;
+  rm_counters_t *c = &w->counters[worker];
+  rm_scan_t scan = {w, d, c};
+  uring_t *ring = uring_get();
+  long n;
+
+  if (cancelled(w))
+    goto out;
+  d->fd = openat(d->parent->fd, d->name,
+                 O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (d->fd < 0) {
+    add(&c->errors, 1);
+    goto out;
+  }
+  while (!cancelled(w) && (n = getdents64(d->fd, c->buf, DIRENT_BUF_SIZE)) > 0) {
+    for (long off = 0; off < n;) {
+      struct dirent64 *e = (struct dirent64 *)(c->buf + off);
+      off += e->d_reclen;
+      if (e->d_name[0] == '.' &&
+          (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+        continue;
+      if (e->d_type == DT_DIR) {
+        spawn(w, d, e->d_name, c);
+        continue;
+      }
+      if (ring != NULL) {
+        while (ring != NULL &&
+               uring_unlinkat(ring, d->fd, e->d_name, 0, (uintptr_t)e->d_name) < 0)
+          if (uring_wait(ring, 1, unlink_done, &scan) < 0)
+            ring = NULL;
+        if (ring != NULL)
+          continue;
+      }
+      unlinked(&scan, e->d_name, unlinkat(d->fd, e->d_name, 0) == 0 ? 0 : -errno);
+    }
+    if (ring != NULL && uring_drain(ring, unlink_done, &scan) < 0)
+      ring = NULL;
+  }
+out:
+  finish_dir(w, d, c);
+}
+
+static void sum(const rm_walk_t *w, rm_result_t *out) {
+  memset(out, 0, sizeof(*out));
+  for (int i = 0; i < w->nthreads; i++) {
+    const rm_counters_t *c = &w->counters[i];
+    out->files += __atomic_load_n(&c->files, __ATOMIC_RELAXED);
+    out->dirs += __atomic_load_n(&c->dirs, __ATOMIC_RELAXED);
+    out->errors += __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+  }
+}
+
+// Every directory being emptied keeps a descriptor open.
+static void raise_fd_limit(void) {
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+  }
+}
+
+int rm_tree(const char *path, const rm_options_t *opt, rm_result_t *out) {
+  static const rm_options_t defaults = {0};
+  char buf[PATH_MAX], name[NAME_MAX + 1];
+  struct stat st;
+  rm_walk_t w;
+  rm_dir_t *top = NULL;
+  int ok = -1, err = ENOMEM;
+
+  memset(out, 0, sizeof(*out));
+  if (opt == NULL)
+    opt = &defaults;
+  if (lstat(path, &st) < 0)
+    return -1;
+  if (!S_ISDIR(st.st_mode)) {
+    if (unlink(path) < 0)
+      return -1;
+    out->files = 1;
+    return 0;
+  }
+  raise_fd_limit();
+
+  memset(&w, 0, sizeof(w));
+  w.opt = opt;
+  w.pool = pool_create(opt->threads > 0 ? opt->threads : RM_THREADS);
+  top = calloc(1, sizeof(rm_dir_t));
+  if (top != NULL)
+    top->fd = -1;
+  if (w.pool == NULL || top == NULL)
+    goto out;
+  w.nthreads = pool_threads(w.pool);
+  w.counters = calloc(w.nthreads, sizeof(rm_counters_t));
+  if (w.counters == NULL)
+    goto out;
+  for (int i = 0; i < w.nthreads; i++) {
+    w.counters[i].buf = malloc(DIRENT_BUF_SIZE);
+    if (w.counters[i].buf == NULL)
+      goto out;
+  }
+
+  // The directory itself is emptied like any other, under a placeholder
+  // parent that holds the descriptor of the directory containing it.
+  snprintf(buf, sizeof(buf), "%s", path);
+  snprintf(name, sizeof(name), "%s", basename(buf));
+  snprintf(buf, sizeof(buf), "%s", path);
+  top->fd = open(dirname(buf), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (top->fd < 0) {
+    err = errno;
+    goto out;
+  }
+  top->w = &w;
+  top->pending = 1;
+  top->top = 1;
+  spawn(&w, top, name, &w.counters[0]);
+  finish_dir(&w, top, &w.counters[0]);
+
+  if (opt->progress != NULL) {
+    int interval = opt->progress_ms > 0 ? opt->progress_ms : 100;
+    rm_result_t partial;
+    while (!pool_wait(w.pool, interval)) {
+      sum(&w, &partial);
+      opt->progress(&partial, opt->progress_arg);
+    }
+  }
+  pool_wait(w.pool, -1);
+  sum(&w, out);
+  if (cancelled(&w)) {
+    err = ECANCELED;
+  } else if (w.top_error || lstat(path, &st) == 0) {
+    // Something below could not be removed, so neither could the top.
+    err = w.top_error ? w.top_error : ENOTEMPTY;
+  } else {
+    ok = 0;
+  }
+
+out:
+  if (w.pool != NULL)
+    pool_destroy(w.pool);
+  if (w.counters != NULL) {
+    for (int i = 0; i < w.nthreads; i++)
+      free(w.counters[i].buf);
+    free(w.counters);
+  }
+  if (top != NULL && top->fd >= 0)
+    close(top->fd);
+  free(top);
+  if (ok < 0)
+    errno = err;
+  return ok;
+}
@@ -0,0 +1,32 @@
+#ifndef RMTREE_H
+#define RMTREE_H
+
+#include <stdint.h>
+
+typedef struct rm_result_ {
+  uint64_t files;
+  uint64_t dirs;
+  uint64_t errors;
+} rm_result_t;
+
+typedef struct rm_options_ {
+  // Worker threads; <= 0 means one per online CPU.
+  int threads;
+  // Polled by the workers; once non-zero nothing more is removed.
+  const int *cancel;
+  // Called from the thread running rm_tree() every progress_ms with the
+  // counts so far.
+  void (*progress)(const rm_result_t *partial, void *arg);
+  void *progress_arg;
+  int progress_ms;
+} rm_options_t;
+
+// Removes path and, if it is a directory, everything below it. Directories
+// are read with getdents64() and emptied with unlinkat() relative to their
+// own descriptors, many at once on a thread pool; each is removed as soon
+// as its last entry is. Symlinks are removed, not followed. Returns -1 with
+// errno set if path itself could not be removed; out->errors counts the
+// entries below it that could not be.
+int rm_tree(const char *path, const rm_options_t *opt, rm_result_t *out);
+
+#endif
@@ -0,0 +1,1061 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "ducache.h"
+#include "match.h"
+#include "pool.h"
+#include "search.h"
+
+#define INDEX_MAGIC 0x3130584449534d46ull /* "FMSIDX01" */
+#define NONE UINT32_MAX
+
+// On-disk index: the header, the root path padded to 8 bytes, then the
+// dirs, entries, trigram keys, trigram offsets, postings and names arrays.
+// Names are NUL-terminated and referenced by offset; the root directory has
+// the empty name at offset 0.
+typedef struct idx_header_ {
+  uint64_t magic;
+  uint64_t size;
+  uint32_t root_len;
+  uint32_t ndirs;
+  uint32_t nentries;
+  uint32_t ntrigrams;
+  uint32_t npostings;
+  uint32_t names_len;
+} idx_header_t;
+
+// A directory and the range of entries read from it. mtime_nsec is -1 when
+// the directory could not be read, so that the next crawl retries it.
+typedef struct idx_dir_ {
+  int64_t mtime_sec, mtime_nsec;
+  uint32_t parent, name;
+  uint32_t first, count;
+} idx_dir_t;
+
+// child is the directory record of a subdirectory, NONE for anything else.
+typedef struct idx_entry_ {
+  uint32_t name;
+  uint32_t dir;
+  uint32_t child;
+} idx_entry_t;
+
+typedef struct index_ {
+  void *map;
+  size_t size;
+  const idx_header_t *h;
+  const idx_dir_t *dirs;
+  const idx_entry_t *entries;
+  const uint32_t *trigrams, *offsets, *postings;
+  const char *names;
+} index_t;
+
+// Index being built by the crawl; only touched with lock held.
+typedef struct builder_ {
+  pthread_mutex_t lock;
+  idx_dir_t *dirs;
+  idx_entry_t *entries;
+  char *names;
+  uint32_t ndirs, dirs_cap;
+  uint32_t nentries, entries_cap;
+  size_t names_len, names_cap;
+} builder_t;
+
+// Per-worker buffers. items holds the entries of the directory being read
+// as [is_dir byte][old child, 4 bytes][name NUL], in readdir order; file
+// holds small files read whole by the content search.
+typedef struct scratch_ {
+  char *buf;
+  char *file;
+  char *items;
+  size_t len, cap;
+  uint32_t n;
+  char pad[64];
+} scratch_t;
+
+struct search_ {
+  char root[PATH_MAX];
+  char query[256];
+  size_t qlen;
+  int root_fd;
+  dev_t root_dev;
+  int grep;
+  int cancel;
+  pthread_t thread;
+  int started;
+  pool_t *pool;
+  scratch_t *scratch;
+  int nthreads;
+  index_t old;
+  builder_t b;
+  size_t progress;
+  int done;
+  int full;
+
+  pthread_mutex_t results_lock;
+  char *rbuf;
+  size_t rlen, rcap;
+  size_t *roff;
+  size_t nresults, roff_cap;
+  uint64_t *seen;
+  size_t seen_cap;
+};
+
+typedef struct crawl_task_ {
+  search_t *s;
+  uint32_t id;
+  uint32_t old;
+  char path[];
+} crawl_task_t;
+
+static int cancelled(const search_t *s) {
+  return __atomic_load_n(&s->cancel, __ATOMIC_RELAXED);
+}
+
+static uint64_t hash_bytes(const char *p, size_t n, uint64_t h) {
+  for (size_t i = 0; i < n; i++) {
+    h ^= (unsigned char)p[i];
+    h *= 0x100000001b3ull;
+  }
+  return h;
+}
+
+static uint32_t trigram(const char *p) {
+  unsigned char a = p[0], b = p[1], c = p[2];
+  if (a < 128) a = tolower(a);
+  if (b < 128) b = tolower(b);
+  if (c < 128) c = tolower(c);
+  return (uint32_t)a << 16 | (uint32_t)b << 8 | c;
+}
+
+static int matches(const search_t *s, const char *name) {
+  return s->qlen == 0 || strcasestr(name, s->query) != NULL;
+}
+
+static size_t align8(size_t n) {
+  return (n + 7) & ~(size_t)7;
+}
+
+static int index_file(const char *root, char *buf, size_t size) {
+  char name[64];
+  snprintf(name, sizeof(name), "index-%016llx",
+           (unsigned long long)hash_bytes(root, strlen(root), 0xcbf29ce484222325ull));
+  return ducache_path(buf, size, name);
+}
+
+// Adds dir/name to the results unless it is already there. Each result is
+// stored as the path and the detail (the matching line for a content
+// search), both NUL-terminated.
+static void add_result(search_t *s, const char *dir, const char *name,
+                       const char *detail) {
+  size_t dlen = strlen(dir), nlen = strlen(name), tlen = strlen(detail);
+  size_t n = dlen + (dlen ? 1 : 0) + nlen + 1 + tlen + 1;
+  uint64_t h = hash_bytes(dir, dlen, 0xcbf29ce484222325ull);
+  h = hash_bytes("/", dlen ? 1 : 0, h);
+  h = hash_bytes(name, nlen, h);
+  h = hash_bytes(detail, tlen + 1, h) | 1;
+
+  pthread_mutex_lock(&s->results_lock);
+  if (s->nresults >= SEARCH_MAX_RESULTS) {
+    __atomic_store_n(&s->full, 1, __ATOMIC_RELAXED);
+    goto out;
+  }
+  if ((s->nresults + 1) * 2 > s->seen_cap) {
+    size_t cap = s->seen_cap ? s->seen_cap * 2 : 1024;
+    uint64_t *seen = calloc(cap, sizeof(uint64_t));
+    if (seen == NULL)
+      goto out;
+    for (size_t i = 0; i < s->seen_cap; i++) {
+      if (s->seen[i] == 0)
+        continue;
+      size_t j = s->seen[i] & (cap - 1);
+      while (seen[j] != 0)
+        j = (j + 1) & (cap - 1);
+      seen[j] = s->seen[i];
+    }
+    free(s->seen);
+    s->seen = seen;
+    s->seen_cap = cap;
+  }
+  // Paths are told apart by a 64-bit hash alone; a collision only hides a
+  // duplicate-looking result.
+  size_t j = h & (s->seen_cap - 1);
+  while (s->seen[j] != 0) {
+    if (s->seen[j] == h)
+      goto out;
+    j = (j + 1) & (s->seen_cap - 1);
+  }
+  if (s->rlen + n > s->rcap) {
+    size_t cap = s->rcap ? s->rcap * 2 : 64 * 1024;
+    while (cap < s->rlen + n)
+      cap *= 2;
+    char *rbuf = realloc(s->rbuf, cap);
+    if (rbuf == NULL)
+      goto out;
+    s->rbuf = rbuf;
+    s->rcap = cap;
+  }
+  if (s->nresults == s->roff_cap) {
+    size_t cap = s->roff_cap ? s->roff_cap * 2 : 1024;
+    size_t *roff = realloc(s->roff, cap * sizeof(size_t));
+    if (roff == NULL)
+      goto out;
+    s->roff = roff;
+    s->roff_cap = cap;
+  }
+  s->seen[j] = h;
+  s->roff[s->nresults++] = s->rlen;
+  if (dlen)
+    s->rlen += sprintf(s->rbuf + s->rlen, "%s/%s", dir, name) + 1;
+  else
+    s->rlen += sprintf(s->rbuf + s->rlen, "%s", name) + 1;
+  memcpy(s->rbuf + s->rlen, detail, tlen + 1);
+  s->rlen += tlen + 1;
+out:
+  pthread_mutex_unlock(&s->results_lock);
+}
+
+static void index_unmap(index_t *x) {
+  if (x->map != NULL)
+    munmap(x->map, x->size);
+  memset(x, 0, sizeof(*x));
+}
+
+// Maps the index of root and checks that it is whole and consistent enough
+// to be walked without bounds checks.
+static int index_load(index_t *x, const char *root) {
+  char path[PATH_MAX];
+  struct stat st;
+  size_t off, len = strlen(root);
+  int fd;
+
+  memset(x, 0, sizeof(*x));
+  if (index_file(root, path, sizeof(path)) < 0)
+    return -1;
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(idx_header_t)) {
+    close(fd);
+    return -1;
+  }
+  x->size = st.st_size;
+  x->map = mmap(NULL, x->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (x->map == MAP_FAILED) {
+    x->map = NULL;
+    return -1;
+  }
+  const idx_header_t *h = x->h = x->map;
+  off = align8(sizeof(*h) + h->root_len);
+  size_t dirs_off = off;
+  off += (size_t)h->ndirs * sizeof(idx_dir_t);
+  size_t entries_off = off;
+  off = align8(off + (size_t)h->nentries * sizeof(idx_entry_t));
+  size_t trigrams_off = off;
+  off += (size_t)h->ntrigrams * 4;
+  size_t offsets_off = off;
+  off += ((size_t)h->ntrigrams + 1) * 4;
+  size_t postings_off = off;
+  off += (size_t)h->npostings * 4;
+  size_t names_off = off;
+  off += h->names_len;
+  if (h->magic != INDEX_MAGIC || h->size != x->size || off != x->size ||
+      h->root_len != len || memcmp(h + 1, root, len) != 0 || h->ndirs == 0 ||
+      h->names_len == 0)
+    goto bad;
+  x->dirs = (const idx_dir_t *)((char *)x->map + dirs_off);
+  x->entries = (const idx_entry_t *)((char *)x->map + entries_off);
+  x->trigrams = (const uint32_t *)((char *)x->map + trigrams_off);
+  x->offsets = (const uint32_t *)((char *)x->map + offsets_off);
+  x->postings = (const uint32_t *)((char *)x->map + postings_off);
+  x->names = (const char *)x->map + names_off;
+  if (x->names[h->names_len - 1] != '\0' || x->offsets[h->ntrigrams] != h->npostings)
+    goto bad;
+  for (uint32_t i = 0; i < h->ndirs; i++) {
+    const idx_dir_t *d = &x->dirs[i];
+    if ((i > 0 && d->parent >= i) || d->name >= h->names_len ||
+        d->first > h->nentries || d->count > h->nentries - d->first)
+      goto bad;
+  }
+  for (uint32_t i = 0; i < h->nentries; i++) {
+    const idx_entry_t *e = &x->entries[i];
+    if (e->name >= h->names_len || e->dir >= h->ndirs ||
+        (e->child != NONE && e->child >= h->ndirs))
+      goto bad;
+  }
+  for (uint32_t i = 0; i < h->ntrigrams; i++)
+    if (x->offsets[i] > x->offsets[i + 1])
+      goto bad;
+  return 0;
+
+bad:
+  index_unmap(x);
+  return -1;
+}
+
+// Puts the path of directory d relative to the root into buf.
+static void index_dir_path(const index_t *x, uint32_t d, char *buf, size_t size) {
+  uint32_t chain[PATH_MAX / 2];
+  int n = 0;
+  size_t len = 0;
+
+  buf[0] = '\0';
+  for (; d != 0 && n < (int)(sizeof(chain) / sizeof(chain[0])); d = x->dirs[d].parent)
+    chain[n++] = d;
+  while (n-- > 0 && len < size) {
+    len += snprintf(buf + len, size - len, "%s%s", len ? "/" : "",
+                    x->names + x->dirs[chain[n]].name);
+  }
+}
+
+static void add_index_result(search_t *s, const index_t *x, uint32_t e) {
+  char dir[PATH_MAX];
+  index_dir_path(x, x->entries[e].dir, dir, sizeof(dir));
+  add_result(s, dir, x->names + x->entries[e].name, "");
+}
+
+static int trigram_cmp(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+// Answers the query from a loaded index. Every trigram of the query must
+// occur in a matching name, so only the entries on the shortest posting
+// list are checked.
+static void index_query(search_t *s, const index_t *x) {
+  const idx_header_t *h = x->h;
+
+  if (s->qlen < 3) {
+    for (uint32_t e = 0; e < h->nentries && !cancelled(s); e++)
+      if (matches(s, x->names + x->entries[e].name))
+        add_index_result(s, x, e);
+    return;
+  }
+  uint32_t best_from = 0, best_to = UINT32_MAX;
+  for (size_t i = 0; i + 3 <= s->qlen; i++) {
+    uint32_t key = trigram(s->query + i);
+    const uint32_t *k = bsearch(&key, x->trigrams, h->ntrigrams, 4, trigram_cmp);
+    if (k == NULL)
+      return;
+    size_t r = k - x->trigrams;
+    if (x->offsets[r + 1] - x->offsets[r] < best_to - best_from) {
+      best_from = x->offsets[r];
+      best_to = x->offsets[r + 1];
+    }
+  }
+  for (uint32_t i = best_from; i < best_to && !cancelled(s); i++) {
+    uint32_t e = x->postings[i];
+    if (e < h->nentries && matches(s, x->names + x->entries[e].name))
+      add_index_result(s, x, e);
+  }
+}
+
+static void scratch_add(scratch_t *sc, int is_dir, uint32_t old, const char *name) {
+  size_t n = strlen(name) + 1;
+  if (sc->len + 5 + n > sc->cap) {
+    size_t cap = sc->cap ? sc->cap * 2 : 64 * 1024;
+    while (cap < sc->len + 5 + n)
+      cap *= 2;
+    char *items = realloc(sc->items, cap);
+    if (items == NULL)
+      return;
+    sc->items = items;
+    sc->cap = cap;
+  }
+  sc->items[sc->len] = is_dir;
+  memcpy(sc->items + sc->len + 1, &old, 4);
+  memcpy(sc->items + sc->len + 5, name, n);
+  sc->len += 5 + n;
+  sc->n++;
+}
+
+static int grow(void **p, uint32_t *cap, uint32_t need, size_t size) {
+  if (need <= *cap)
+    return 0;
+  uint64_t n = *cap ? *cap : 1024;
+  while (n < need)
+    n *= 2;
+  if (n > NONE)
+    n = NONE;
+  void *q = realloc(*p, (size_t)n * size);
+  if (q == NULL)
+    return -1;
+  *p = q;
+  *cap = n;
+  return 0;
+}
+
+// Appends the entries gathered in sc as the contents of directory id and
+// allocates records for its subdirectories, numbered from the returned id
+// in order. Returns NONE if the index could not grow.
+static uint32_t commit(search_t *s, uint32_t id, const struct statx *stx,
+                       scratch_t *sc, uint32_t ndirs) {
+  builder_t *b = &s->b;
+  uint32_t first_child = NONE;
+
+  pthread_mutex_lock(&b->lock);
+  if ((size_t)b->nentries + sc->n >= NONE || (size_t)b->ndirs + ndirs >= NONE ||
+      b->names_len + sc->len >= NONE ||
+      grow((void **)&b->entries, &b->entries_cap, b->nentries + sc->n,
+           sizeof(idx_entry_t)) < 0 ||
+      grow((void **)&b->dirs, &b->dirs_cap, b->ndirs + ndirs, sizeof(idx_dir_t)) < 0)
+    goto out;
+  if (b->names_len + sc->len > b->names_cap) {
+    size_t cap = b->names_cap * 2;
+    while (cap < b->names_len + sc->len)
+      cap *= 2;
+    char *names = realloc(b->names, cap);
+    if (names == NULL)
+      goto out;
+    b->names = names;
+    b->names_cap = cap;
+  }
+  first_child = b->ndirs;
+  b->dirs[id].first = b->nentries;
+  b->dirs[id].count = sc->n;
+  b->dirs[id].mtime_sec = stx->stx_mtime.tv_sec;
+  b->dirs[id].mtime_nsec = stx->stx_mtime.tv_nsec;
+  for (size_t off = 0; off < sc->len;) {
+    const char *name = sc->items + off + 5;
+    size_t n = strlen(name) + 1;
+    idx_entry_t *e = &b->entries[b->nentries++];
+    e->name = b->names_len;
+    e->dir = id;
+    e->child = NONE;
+    if (sc->items[off]) {
+      idx_dir_t *d = &b->dirs[b->ndirs];
+      e->child = b->ndirs++;
+      d->parent = id;
+      d->name = e->name;
+      d->first = d->count = 0;
+      d->mtime_sec = 0;
+      d->mtime_nsec = -1;
+    }
+    memcpy(b->names + b->names_len, name, n);
+    b->names_len += n;
+    off += 5 + n;
+  }
+out:
+  pthread_mutex_unlock(&b->lock);
+  return first_child;
+}
+
+static void crawl_dir(void *arg, int worker);
+
+// Queues fn on parent/name, a path relative to the root.
+static void spawn_fn(search_t *s, pool_fn fn, const char *parent,
+                     const char *name, uint32_t id, uint32_t old) {
+  size_t plen = strlen(parent), n = strlen(name);
+  crawl_task_t *t = malloc(sizeof(crawl_task_t) + plen + n + 2);
+  if (t == NULL)
+    return;
+  t->s = s;
+  t->id = id;
+  t->old = old;
+  if (plen == 1 && parent[0] == '.')
+    memcpy(t->path, name, n + 1);
+  else
+    sprintf(t->path, "%s/%s", parent, name);
+  if (pool_submit(s->pool, fn, t) < 0)
+    free(t);
+}
+
+static void spawn(search_t *s, const char *parent, const char *name,
+                  uint32_t id, uint32_t old) {
+  spawn_fn(s, crawl_dir, parent, name, id, old);
+}
+
+// Index of the old entries of directory od, by name, so that a changed
+// directory can still find the records of its unchanged subdirectories.
+static uint32_t *old_names(const index_t *x, const idx_dir_t *od, size_t *mask) {
+  size_t cap = 16;
+  while (cap < (size_t)od->count * 2)
+    cap *= 2;
+  uint32_t *tab = calloc(cap, sizeof(uint32_t));
+  if (tab == NULL)
+    return NULL;
+  for (uint32_t i = od->first; i < od->first + od->count; i++) {
+    if (x->entries[i].child == NONE)
+      continue;
+    const char *name = x->names + x->entries[i].name;
+    size_t j = hash_bytes(name, strlen(name), 0xcbf29ce484222325ull) & (cap - 1);
+    while (tab[j] != 0)
+      j = (j + 1) & (cap - 1);
+    tab[j] = i + 1;
+  }
+  *mask = cap - 1;
+  return tab;
+}
+
+static uint32_t old_child(const index_t *x, const uint32_t *tab, size_t mask,
+                          const char *name) {
+  size_t j = hash_bytes(name, strlen(name), 0xcbf29ce484222325ull) & mask;
+  for (; tab[j] != 0; j = (j + 1) & mask) {
+    const idx_entry_t *e = &x->entries[tab[j] - 1];
+    if (strcmp(x->names + e->name, name) == 0)
+      return e->child;
+  }
+  return NONE;
+}
+
+// Reads one directory into scratch, or copies its entries from the old
+// index when its mtime says nothing was added, removed or renamed.
+static void read_entries(search_t *s, int fd, const idx_dir_t *od,
+                         const struct statx *stx, scratch_t *sc, uint32_t *ndirs) {
+  const index_t *x = &s->old;
+
+  if (od != NULL && od->mtime_sec == stx->stx_mtime.tv_sec &&
+      od->mtime_nsec == stx->stx_mtime.tv_nsec) {
+    for (uint32_t i = od->first; i < od->first + od->count; i++) {
+      const idx_entry_t *e = &x->entries[i];
+      scratch_add(sc, e->child != NONE, e->child, x->names + e->name);
+      *ndirs += e->child != NONE;
+    }
+    return;
+  }
+
+  size_t mask = 0;
+  uint32_t *tab = od != NULL ? old_names(x, od, &mask) : NULL;
+  long n;
+  while (!cancelled(s) && (n = getdents64(fd, sc->buf, DIRENT_BUF_SIZE)) > 0) {
+    for (long off = 0; off < n;) {
+      struct dirent64 *e = (struct dirent64 *)(sc->buf + off);
+      off += e->d_reclen;
+      if (e->d_name[0] == '.' &&
+          (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+        continue;
+      int is_dir = e->d_type == DT_DIR;
+      if (e->d_type == DT_UNKNOWN) {
+        struct stat st;
+        is_dir = fstatat(fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) == 0 &&
+                 S_ISDIR(st.st_mode);
+      }
+      uint32_t old = is_dir && tab != NULL ? old_child(x, tab, mask, e->d_name) : NONE;
+      scratch_add(sc, is_dir, old, e->d_name);
+      *ndirs += is_dir;
+    }
+  }
+  free(tab);
+}
+
+static void crawl_dir(void *arg, int worker) {
+  crawl_task_t *t = arg;
+  search_t *s = t->s;
+  scratch_t *sc = &s->scratch[worker];
+  const idx_dir_t *od = NULL;
+  struct statx stx;
+  uint32_t ndirs = 0, child;
+  int fd;
+
+  if (cancelled(s))
+    goto out;
+  fd = openat(s->root_fd, t->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    goto out;
+  if (statx(fd, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, STATX_MTIME, &stx) < 0 ||
+      (SEARCH_ONE_FILESYSTEM &&
+       makedev(stx.stx_dev_major, stx.stx_dev_minor) != s->root_dev)) {
+    close(fd);
+    goto out;
+  }
+  if (t->old != NONE)
+    od = &s->old.dirs[t->old];
+  sc->len = 0;
+  sc->n = 0;
+  read_entries(s, fd, od, &stx, sc, &ndirs);
+  close(fd);
+  if (cancelled(s))
+    goto out;
+
+  child = commit(s, t->id, &stx, sc, ndirs);
+  if (child == NONE)
+    goto out;
+  for (size_t off = 0; off < sc->len;) {
+    const char *name = sc->items + off + 5;
+    if (sc->items[off]) {
+      uint32_t old;
+      memcpy(&old, sc->items + off + 1, 4);
+      spawn(s, t->path, name, child++, old);
+    }
+    if (matches(s, name))
+      add_result(s, strcmp(t->path, ".") == 0 ? "" : t->path, name, "");
+    off += 5 + strlen(name) + 1;
+  }
+  __atomic_add_fetch(&s->progress, 1, __ATOMIC_RELAXED);
+out:
+  free(t);
+}
+
+// Builds the trigram posting lists over the crawled names in two passes:
+// one counting the entries per distinct trigram, one filling the lists.
+// Entry ids are visited in order, so every list comes out sorted.
+static int build_trigrams(const builder_t *b, uint32_t **keys_out,
+                          uint32_t **offsets_out, uint32_t **postings_out,
+                          uint32_t *nkeys_out, uint32_t *npostings_out) {
+  size_t cap = 1 << 16, nkeys = 0, npostings = 0;
+  uint32_t *key = NULL, *count = NULL, *last = NULL, *keys = NULL;
+  uint32_t *offsets = NULL, *postings = NULL;
+  int ok = -1;
+
+  key = calloc(cap, sizeof(uint32_t));
+  count = calloc(cap, sizeof(uint32_t));
+  last = calloc(cap, sizeof(uint32_t));
+  if (key == NULL || count == NULL || last == NULL)
+    goto out;
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      // Order the distinct keys and turn the counts into list offsets.
+      keys = malloc((nkeys + 1) * sizeof(uint32_t));
+      offsets = malloc((nkeys + 1) * sizeof(uint32_t));
+      postings = malloc((npostings + 1) * sizeof(uint32_t));
+      if (keys == NULL || offsets == NULL || postings == NULL)
+        goto out;
+      size_t k = 0;
+      for (size_t i = 0; i < cap; i++)
+        if (key[i] != 0)
+          keys[k++] = key[i];
+      qsort(keys, nkeys, sizeof(uint32_t), trigram_cmp);
+      uint32_t pos = 0;
+      for (size_t i = 0; i < nkeys; i++) {
+        size_t j = keys[i] * 0x9E3779B1u & (cap - 1);
+        while (key[j] != keys[i])
+          j = (j + 1) & (cap - 1);
+        offsets[i] = pos;
+        pos += count[j];
+        count[j] = offsets[i];
+      }
+      offsets[nkeys] = pos;
+      memset(last, 0, cap * sizeof(uint32_t));
+    }
+    for (uint32_t e = 0; e < b->nentries; e++) {
+      const char *name = b->names + b->entries[e].name;
+      size_t len = strlen(name);
+      for (size_t i = 0; i + 3 <= len; i++) {
+        uint32_t t = trigram(name + i);
+        if (pass == 0 && (nkeys + 1) * 2 > cap) {
+          size_t ncap = cap * 2;
+          uint32_t *nkey = calloc(ncap, sizeof(uint32_t));
+          uint32_t *ncount = calloc(ncap, sizeof(uint32_t));
+          uint32_t *nlast = calloc(ncap, sizeof(uint32_t));
+          if (nkey == NULL || ncount == NULL || nlast == NULL) {
+            free(nkey);
+            free(ncount);
+            free(nlast);
+            goto out;
+          }
+          for (size_t j = 0; j < cap; j++) {
+            if (key[j] == 0)
+              continue;
+            size_t m = key[j] * 0x9E3779B1u & (ncap - 1);
+            while (nkey[m] != 0)
+              m = (m + 1) & (ncap - 1);
+            nkey[m] = key[j];
+            ncount[m] = count[j];
+            nlast[m] = last[j];
+          }
+          free(key);
+          free(count);
+          free(last);
+          key = nkey;
+          count = ncount;
+          last = nlast;
+          cap = ncap;
+        }
+        // Names never contain NUL, so no trigram is zero.
+        size_t j = t * 0x9E3779B1u & (cap - 1);
+        while (key[j] != 0 && key[j] != t)
+          j = (j + 1) & (cap - 1);
+        if (last[j] == e + 1)
+          continue;
+        last[j] = e + 1;
+        if (pass == 0) {
+          if (key[j] == 0)
+            nkeys++;
+          key[j] = t;
+          count[j]++;
+          npostings++;
+        } else {
+          postings[count[j]++] = e;
+        }
+      }
+    }
+  }
+  *keys_out = keys;
+  *offsets_out = offsets;
+  *postings_out = postings;
+  *nkeys_out = nkeys;
+  *npostings_out = npostings;
+  keys = offsets = postings = NULL;
+  ok = 0;
+out:
+  free(key);
+  free(count);
+  free(last);
+  free(keys);
+  free(offsets);
+  free(postings);
+  return ok;
+}
+
+// Writes n bytes followed by zeros up to a multiple of align.
+static int write_all(int fd, const void *p, size_t n, size_t align) {
+  static const char zeros[8];
+  size_t pad = (align - n % align) % align;
+  while (n > 0) {
+    ssize_t w = write(fd, p, n);
+    if (w < 0) {
+      if (errno == EINTR)
+        continue;
+      return -1;
+    }
+    p = (const char *)p + w;
+    n -= w;
+  }
+  return pad ? write_all(fd, zeros, pad, 1) : 0;
+}
+
+// Writes the crawled index next to its final path and renames it over the
+// old one, which stays valid for anyone who still has it mapped.
+static int index_save(search_t *s) {
+  const builder_t *b = &s->b;
+  uint32_t *keys = NULL, *offsets = NULL, *postings = NULL, nkeys = 0, npostings = 0;
+  char path[PATH_MAX], tmp[PATH_MAX + 8];
+  idx_header_t h = {0};
+  int fd, ok = -1;
+
+  if (index_file(s->root, path, sizeof(path)) < 0 ||
+      build_trigrams(b, &keys, &offsets, &postings, &nkeys, &npostings) < 0)
+    goto out;
+  h.magic = INDEX_MAGIC;
+  h.root_len = strlen(s->root);
+  h.ndirs = b->ndirs;
+  h.nentries = b->nentries;
+  h.ntrigrams = nkeys;
+  h.npostings = npostings;
+  h.names_len = b->names_len;
+  // Only the root and the entries array need padding to keep the arrays
+  // after them aligned.
+  h.size = align8(sizeof(h) + h.root_len) + (size_t)h.ndirs * sizeof(idx_dir_t) +
+           align8((size_t)h.nentries * sizeof(idx_entry_t)) +
+           ((size_t)nkeys * 2 + 1 + npostings) * 4 + h.names_len;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0)
+    goto out;
+  // Header and root go out as one block so the root can be padded.
+  char head[sizeof(h) + PATH_MAX];
+  memcpy(head, &h, sizeof(h));
+  memcpy(head + sizeof(h), s->root, h.root_len);
+  if (write_all(fd, head, sizeof(h) + h.root_len, 8) < 0 ||
+      write_all(fd, b->dirs, (size_t)h.ndirs * sizeof(idx_dir_t), 8) < 0 ||
+      write_all(fd, b->entries, (size_t)h.nentries * sizeof(idx_entry_t), 8) < 0 ||
+      write_all(fd, keys, (size_t)nkeys * 4, 1) < 0 ||
+      write_all(fd, offsets, ((size_t)nkeys + 1) * 4, 1) < 0 ||
+      write_all(fd, postings, (size_t)npostings * 4, 1) < 0 ||
+      write_all(fd, b->names, h.names_len, 1) < 0 || close(fd) < 0) {
+    unlink(tmp);
+    goto out;
+  }
+  if (rename(tmp, path) < 0) {
+    unlink(tmp);
+    goto out;
+  }
+  ok = 0;
+out:
+  free(keys);
+  free(offsets);
+  free(postings);
+  return ok;
+}
+
+// Adds one result per line of data holding the pattern, with the line
+// number and text as the detail. *line is the number of the first line of
+// data, and is moved on past it.
+static void grep_buffer(search_t *s, const char *path, const char *data, size_t n,
+                        size_t *line) {
+  const char *p = data, *end = data + n, *counted = data, *hit;
+  char detail[GREP_LINE_MAX + 32];
+
+  while (p < end && !cancelled(s) && !__atomic_load_n(&s->full, __ATOMIC_RELAXED) &&
+         (hit = match_find(p, end - p, s->query, s->qlen)) != NULL) {
+    const char *start = memrchr(data, '\n', hit - data);
+    const char *stop = memchr(hit, '\n', end - hit);
+    start = start ? start + 1 : data;
+    stop = stop ? stop : end;
+    *line += match_count(counted, hit - counted, '\n');
+    counted = hit;
+    while (start < hit && (*start == ' ' || *start == '\t'))
+      start++;
+    int len = snprintf(detail, sizeof(detail), "%zu: ", *line);
+    for (const char *c = start; c < stop && len < (int)sizeof(detail) - 1; c++)
+      detail[len++] = (unsigned char)*c < 0x20 ? ' ' : *c;
+    detail[len] = '\0';
+    add_result(s, "", path, detail);
+    p = stop + 1;
+  }
+  *line += match_count(counted, end - counted, '\n');
+}
+
+// Reads a regular file GREP_READ_MAX bytes at a time into the worker's
+// buffer, as far as the size it had when opened, and greps it unless it
+// looks binary. Lines are searched whole: the unfinished last line of a
+// read is carried over to the next, and a line too long for the buffer is
+// searched in pieces that overlap by one byte less than the pattern. A file
+// that shrinks meanwhile just ends early.
+static void grep_file(void *arg, int worker) {
+  crawl_task_t *t = arg;
+  search_t *s = t->s;
+  scratch_t *sc = &s->scratch[worker];
+  char *buf;
+  struct stat st;
+  size_t line = 1, keep = 0;
+  uint64_t off = 0;
+  int fd;
+
+  if (cancelled(s) || __atomic_load_n(&s->full, __ATOMIC_RELAXED))
+    goto out;
+  fd = openat(s->root_fd, t->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    goto out;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0)
+    goto done;
+  if (sc->file == NULL && (sc->file = malloc(GREP_READ_MAX)) == NULL)
+    goto done;
+  buf = sc->file;
+  if (st.st_size > GREP_READ_MAX)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  while (!cancelled(s) && !__atomic_load_n(&s->full, __ATOMIC_RELAXED)) {
+    size_t want = GREP_READ_MAX - keep;
+    if ((uint64_t)st.st_size - off < want)
+      want = st.st_size - off;
+    ssize_t r = want > 0 ? pread(fd, buf + keep, want, off) : 0;
+    if (r <= 0) {
+      if (keep > 0)
+        grep_buffer(s, t->path, buf, keep, &line);
+      break;
+    }
+    // Like grep, a NUL byte near the start marks the file as binary.
+    if (off == 0 && memchr(buf, '\0', r < GREP_BINARY_PROBE ? r : GREP_BINARY_PROBE) != NULL)
+      break;
+    off += r;
+    size_t n = keep + r, upto = 0;
+    const char *nl = memrchr(buf, '\n', n);
+    if (nl != NULL)
+      upto = nl - buf + 1;
+    else if (n == GREP_READ_MAX && s->qlen <= n)
+      upto = n - s->qlen + 1;
+    if (upto > 0)
+      grep_buffer(s, t->path, buf, upto, &line);
+    keep = n - upto;
+    memmove(buf, buf + upto, keep);
+  }
+  __atomic_add_fetch(&s->progress, 1, __ATOMIC_RELAXED);
+done:
+  close(fd);
+out:
+  free(t);
+}
+
+// Queues a grep of every regular file in a directory and a walk of every
+// subdirectory. Symlinks are not followed.
+static void grep_dir(void *arg, int worker) {
+  crawl_task_t *t = arg;
+  search_t *s = t->s;
+  scratch_t *sc = &s->scratch[worker];
+  struct statx stx;
+  long n;
+  int fd;
+
+  if (cancelled(s) || __atomic_load_n(&s->full, __ATOMIC_RELAXED))
+    goto out;
+  fd = openat(s->root_fd, t->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    goto out;
+  if (statx(fd, "", AT_EMPTY_PATH | AT_STATX_DONT_SYNC, 0, &stx) < 0 ||
+      (SEARCH_ONE_FILESYSTEM &&
+       makedev(stx.stx_dev_major, stx.stx_dev_minor) != s->root_dev)) {
+    close(fd);
+    goto out;
+  }
+  while (!cancelled(s) && (n = getdents64(fd, sc->buf, DIRENT_BUF_SIZE)) > 0) {
+    for (long off = 0; off < n;) {
+      struct dirent64 *e = (struct dirent64 *)(sc->buf + off);
+      off += e->d_reclen;
+      if (e->d_name[0] == '.' &&
+          (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+        continue;
+      unsigned char type = e->d_type;
+      if (type == DT_UNKNOWN) {
+        struct stat st;
+        if (fstatat(fd, e->d_name, &st, AT_SYMLINK_NOFOLLOW) < 0)
+          continue;
+        type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+      }
+      if (type == DT_DIR)
+        spawn_fn(s, grep_dir, t->path, e->d_name, 0, NONE);
+      else if (type == DT_REG)
+        spawn_fn(s, grep_file, t->path, e->d_name, 0, NONE);
+    }
+  }
+  close(fd);
+out:
+  free(t);
+}
+
+static void *search_main(void *arg) {
+  search_t *s = arg;
+  builder_t *b = &s->b;
+
+  if (s->grep) {
+    spawn_fn(s, grep_dir, ".", ".", 0, NONE);
+    pool_wait(s->pool, -1);
+    goto out;
+  }
+
+  // A warm index answers right away; the crawl below then only adds what
+  // changed since it was written.
+  if (index_load(&s->old, s->root) == 0)
+    index_query(s, &s->old);
+
+  b->names_cap = 64 * 1024;
+  b->names = malloc(b->names_cap);
+  if (b->names == NULL || grow((void **)&b->dirs, &b->dirs_cap, 1, sizeof(idx_dir_t)) < 0)
+    goto out;
+  b->names[0] = '\0';
+  b->names_len = 1;
+  b->ndirs = 1;
+  memset(&b->dirs[0], 0, sizeof(idx_dir_t));
+  b->dirs[0].parent = NONE;
+  b->dirs[0].mtime_nsec = -1;
+  spawn(s, ".", ".", 0, s->old.map != NULL ? 0 : NONE);
+  pool_wait(s->pool, -1);
+  if (!cancelled(s))
+    index_save(s);
+
+out:
+  __atomic_store_n(&s->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static search_t *start(const char *root, const char *query, int grep) {
+  struct stat st;
+  search_t *s = calloc(1, sizeof(search_t));
+
+  if (s == NULL)
+    return NULL;
+  s->root_fd = -1;
+  pthread_mutex_init(&s->b.lock, NULL);
+  pthread_mutex_init(&s->results_lock, NULL);
+  if (realpath(root, s->root) == NULL)
+    goto fail;
+  snprintf(s->query, sizeof(s->query), "%s", query);
+  s->qlen = strlen(s->query);
+  s->grep = grep;
+  s->root_fd = open(s->root, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (s->root_fd < 0 || fstat(s->root_fd, &st) < 0)
+    goto fail;
+  s->root_dev = st.st_dev;
+  s->pool = pool_create(SEARCH_THREADS);
+  if (s->pool == NULL)
+    goto fail;
+  s->nthreads = pool_threads(s->pool);
+  s->scratch = calloc(s->nthreads, sizeof(scratch_t));
+  if (s->scratch == NULL)
+    goto fail;
+  for (int i = 0; i < s->nthreads; i++)
+    if ((s->scratch[i].buf = malloc(DIRENT_BUF_SIZE)) == NULL)
+      goto fail;
+  if (pthread_create(&s->thread, NULL, search_main, s) != 0)
+    goto fail;
+  s->started = 1;
+  return s;
+
+fail:
+  search_stop(s);
+  return NULL;
+}
+
+search_t *search_start(const char *root, const char *query) {
+  return start(root, query, 0);
+}
+
+search_t *search_grep(const char *root, const char *pattern) {
+  if (pattern[0] == '\0')
+    return NULL;
+  return start(root, pattern, 1);
+}
+
+size_t search_poll(search_t *s, int *done, size_t *progress) {
+  size_t n;
+  *done = __atomic_load_n(&s->done, __ATOMIC_ACQUIRE);
+  *progress = __atomic_load_n(&s->progress, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&s->results_lock);
+  n = s->nresults;
+  pthread_mutex_unlock(&s->results_lock);
+  return n;
+}
+
+int search_result(search_t *s, size_t i, char *buf, size_t size) {
+  int ok = -1;
+  pthread_mutex_lock(&s->results_lock);
+  if (i < s->nresults) {
+    const char *path = s->rbuf + s->roff[i], *detail = path + strlen(path) + 1;
+    snprintf(buf, size, "%s%s%s", path, detail[0] ? ":" : "", detail);
+    ok = 0;
+  }
+  pthread_mutex_unlock(&s->results_lock);
+  return ok;
+}
+
+int search_result_path(search_t *s, size_t i, char *buf, size_t size) {
+  int ok = -1;
+  pthread_mutex_lock(&s->results_lock);
+  if (i < s->nresults) {
+    snprintf(buf, size, "%s", s->rbuf + s->roff[i]);
+    ok = 0;
+  }
+  pthread_mutex_unlock(&s->results_lock);
+  return ok;
+}
+
+void search_stop(search_t *s) {
+  __atomic_store_n(&s->cancel, 1, __ATOMIC_RELAXED);
+  if (s->started)
+    pthread_join(s->thread, NULL);
+  if (s->pool != NULL)
+    pool_destroy(s->pool);
+  if (s->scratch != NULL) {
+    for (int i = 0; i < s->nthreads; i++) {
+      free(s->scratch[i].buf);
+      free(s->scratch[i].file);
+      free(s->scratch[i].items);
+    }
+    free(s->scratch);
+  }
+  if (s->root_fd >= 0)
+    close(s->root_fd);
+  index_unmap(&s->old);
+  free(s->b.dirs);
+  free(s->b.entries);
+  free(s->b.names);
+  free(s->rbuf);
+  free(s->roff);
+  free(s->seen);
+  pthread_mutex_destroy(&s->b.lock);
+  pthread_mutex_destroy(&s->results_lock);
+  free(s);
+}
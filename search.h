@@ -0,0 +1,39 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include <stddef.h>
+
+// Recursive filename search backed by a per-root index of every name under
+// the root. The index is kept in $XDG_CACHE_HOME/fsm and memory-mapped; a
+// trigram table over the lowercased names narrows a query down to a few
+// candidates. Directories whose mtime did not change since the last crawl
+// are not read again when the index is refreshed.
+typedef struct search_ search_t;
+
+// Starts looking for names containing query (case-insensitively) anywhere
+// under root. Runs in the background: a warm index answers at once, and
+// the index is then refreshed with new matches streamed in as the crawl
+// finds them.
+search_t *search_start(const char *root, const char *query);
+
+// Starts a content search: every regular file under root that does not look
+// binary is read in GREP_READ_MAX chunks and each line holding pattern,
+// case-sensitively, becomes a result. Returns NULL for an empty pattern.
+search_t *search_grep(const char *root, const char *pattern);
+
+// Number of results so far. *done is set once the crawl has finished and
+// *progress to the number of directories crawled, or files read by a
+// content search, so far.
+size_t search_poll(search_t *s, int *done, size_t *progress);
+
+// Copies result i into buf for display: a path relative to the root,
+// followed by ":line: text" for a content search.
+int search_result(search_t *s, size_t i, char *buf, size_t size);
+
+// Copies just the path of result i into buf.
+int search_result_path(search_t *s, size_t i, char *buf, size_t size);
+
+// Cancels the search and frees it.
+void search_stop(search_t *s);
+
+#endif
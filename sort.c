@@ -0,0 +1,258 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sort.h"
+
+// Precomputed ordering key of one entry. Most comparisons are decided by
+// the integer fields; the names are only consulted on a tie.
+typedef struct sort_key_ {
+  uint64_t primary;
+  uint64_t prefix;
+  uint32_t index;
+  uint32_t group;
+} sort_key_t;
+
+typedef struct sort_ctx_ {
+  const dir_listing_t *l;
+  int mode;
+} sort_ctx_t;
+
+static const char *mode_names[SORT_MODES] = {"name", "natural", "size",
+                                             "mtime", "extension"};
+
+const char *sort_mode_name(int mode) {
+  return mode >= 0 && mode < SORT_MODES ? mode_names[mode] : "?";
+}
+
+int natural_compare(const char *a, const char *b) {
+  while (*a && *b) {
+    if (isdigit((unsigned char)*a) && isdigit((unsigned char)*b)) {
+      const char *za = a, *zb = b, *da, *db;
+      while (*a == '0')
+        a++;
+      while (*b == '0')
+        b++;
+      da = a;
+      db = b;
+      while (isdigit((unsigned char)*a))
+        a++;
+      while (isdigit((unsigned char)*b))
+        b++;
+      if (a - da != b - db)
+        return a - da < b - db ? -1 : 1;
+      int c = memcmp(da, db, a - da);
+      if (c != 0)
+        return c;
+      // Same value: the spelling with fewer leading zeros goes first.
+      if (da - za != db - zb)
+        return da - za < db - zb ? -1 : 1;
+      continue;
+    }
+    if (*a != *b)
+      return (unsigned char)*a - (unsigned char)*b;
+    a++;
+    b++;
+  }
+  return (unsigned char)*a - (unsigned char)*b;
+}
+
+// Extension of name without the dot; dotfiles have none.
+static const char *extension(const char *name) {
+  const char *dot = strrchr(name, '.');
+  return dot == NULL || dot == name ? "" : dot + 1;
+}
+
+// First eight bytes of s as a big-endian integer, so that integer order
+// matches strcmp() order.
+static uint64_t prefix_of(const char *s) {
+  uint64_t p = 0;
+  for (int i = 0; i < 8; i++) {
+    p <<= 8;
+    if (*s)
+      p |= (unsigned char)*s++;
+  }
+  return p;
+}
+
+static int full_compare(const sort_key_t *a, const sort_key_t *b,
+                        const sort_ctx_t *c) {
+  const char *na = dir_listing_name(c->l, a->index);
+  const char *nb = dir_listing_name(c->l, b->index);
+  int r;
+
+  switch (c->mode) {
+    case SORT_NATURAL:
+      return natural_compare(na, nb);
+    case SORT_EXTENSION:
+      r = strcmp(extension(na), extension(nb));
+      if (r != 0)
+        return r;
+      return strcmp(na, nb);
+    default:
+      return strcmp(na, nb);
+  }
+}
+
+static inline int key_compare(const sort_key_t *a, const sort_key_t *b,
+                              const sort_ctx_t *c) {
+  if (a->group != b->group)
+    return a->group < b->group ? -1 : 1;
+  if (a->primary != b->primary)
+    return a->primary < b->primary ? -1 : 1;
+  if (a->prefix != b->prefix)
+    return a->prefix < b->prefix ? -1 : 1;
+  return full_compare(a, b, c);
+}
+
+static inline void swap_keys(sort_key_t *a, sort_key_t *b) {
+  sort_key_t t = *a;
+  *a = *b;
+  *b = t;
+}
+
+static void insertion_sort(sort_key_t *a, size_t n, const sort_ctx_t *c) {
+  for (size_t i = 1; i < n; i++) {
+    sort_key_t k = a[i];
+    size_t j = i;
+    while (j > 0 && key_compare(&k, &a[j - 1], c) < 0) {
+      a[j] = a[j - 1];
+      j--;
+    }
+    a[j] = k;
+  }
+}
+
+static void sift_down(sort_key_t *a, size_t root, size_t n,
+                      const sort_ctx_t *c) {
+  for (;;) {
+    size_t child = 2 * root + 1;
+    if (child >= n)
+      return;
+    if (child + 1 < n && key_compare(&a[child], &a[child + 1], c) < 0)
+      child++;
+    if (key_compare(&a[root], &a[child], c) >= 0)
+      return;
+    swap_keys(&a[root], &a[child]);
+    root = child;
+  }
+}
+
+static void heap_sort(sort_key_t *a, size_t n, const sort_ctx_t *c) {
+  for (size_t i = n / 2; i-- > 0;)
+    sift_down(a, i, n, c);
+  for (size_t i = n; i-- > 1;) {
+    swap_keys(&a[0], &a[i]);
+    sift_down(a, 0, i, c);
+  }
+}
+
+// Quicksort with median-of-three pivots that falls back to heapsort when
+// the recursion gets too deep, so the worst case stays O(n log n).
+static void introsort(sort_key_t *a, size_t n, int depth, const sort_ctx_t *c) {
+  while (n > 16) {
+    if (depth-- == 0) {
+      heap_sort(a, n, c);
+      return;
+    }
+    size_t mid = (n - 1) / 2;
+    if (key_compare(&a[mid], &a[0], c) < 0)
+      swap_keys(&a[mid], &a[0]);
+    if (key_compare(&a[n - 1], &a[0], c) < 0)
+      swap_keys(&a[n - 1], &a[0]);
+    if (key_compare(&a[n - 1], &a[mid], c) < 0)
+      swap_keys(&a[n - 1], &a[mid]);
+
+    sort_key_t pivot = a[mid];
+    size_t i = 0, j = n - 1;
+    for (;;) {
+      while (key_compare(&a[i], &pivot, c) < 0)
+        i++;
+      while (key_compare(&a[j], &pivot, c) > 0)
+        j--;
+      if (i >= j)
+        break;
+      swap_keys(&a[i], &a[j]);
+      i++;
+      j--;
+    }
+    // a[0..j] <= pivot <= a[j+1..n); recurse into the smaller half.
+    size_t left = j + 1;
+    if (left < n - left) {
+      introsort(a, left, depth, c);
+      a += left;
+      n -= left;
+    } else {
+      introsort(a + left, n - left, depth, c);
+      n = left;
+    }
+  }
+  insertion_sort(a, n, c);
+}
+
+int sort_listing(dir_listing_t *l) {
+  sort_ctx_t c = {l, l->sort_mode};
+  sort_key_t *keys;
+  uint32_t *order;
+  int depth = 0;
+
+  l->sorted = 0;
+  if (l->len == 0)
+    return 0;
+  keys = malloc(l->len * sizeof(sort_key_t));
+  order = realloc(l->order, l->len * sizeof(uint32_t));
+  if (keys == NULL || order == NULL) {
+    free(keys);
+    if (order != NULL)
+      l->order = order;
+    return -1;
+  }
+  l->order = order;
+  if (c.mode == SORT_SIZE || c.mode == SORT_MTIME)
+    dir_listing_stat_all(l);
+
+  for (int i = 0; i < l->len; i++) {
+    const char *name = dir_listing_name(l, i);
+    sort_key_t *k = &keys[i];
+
+    k->index = i;
+    k->primary = 0;
+    if (strcmp(name, "..") == 0)
+      k->group = 0;
+    else
+      k->group = l->dirs_first && dir_listing_is_dir(l, i) ? 1 : 2;
+
+    switch (c.mode) {
+      case SORT_SIZE:
+        // Largest first.
+        k->primary = ~(dir_listing_stat(l, i, NULL) == 0 ? l->meta.size[i] : 0);
+        k->prefix = prefix_of(name);
+        break;
+      case SORT_MTIME:
+        // Newest first; flipping the sign bit orders signed times unsigned.
+        k->primary = ~((uint64_t)(dir_listing_stat(l, i, NULL) == 0 ? l->meta.mtime[i] : 0) ^
+                       (1ULL << 63));
+        k->prefix = prefix_of(name);
+        break;
+      case SORT_EXTENSION:
+        k->prefix = prefix_of(extension(name));
+        break;
+      case SORT_NATURAL:
+        // Digit runs break byte order, so natural mode has no prefix.
+        k->prefix = 0;
+        break;
+      default:
+        k->prefix = prefix_of(name);
+        break;
+    }
+  }
+
+  for (int n = l->len; n > 1; n >>= 1)
+    depth += 2;
+  introsort(keys, l->len, depth, &c);
+  for (int i = 0; i < l->len; i++)
+    l->order[i] = keys[i].index;
+  free(keys);
+  l->sorted = 1;
+  return 0;
+}
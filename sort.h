@@ -0,0 +1,24 @@
+#ifndef SORT_H
+#define SORT_H
+
+#include "dirlist.h"
+
+#define SORT_NAME 0
+#define SORT_NATURAL 1
+#define SORT_SIZE 2
+#define SORT_MTIME 3
+#define SORT_EXTENSION 4
+#define SORT_MODES 5
+
+// Short label for a sort mode, for the status line.
+const char *sort_mode_name(int mode);
+
+// Orders l by l->sort_mode (and l->dirs_first) into l->order without moving
+// any names. ".." always stays first. Returns -1 on allocation failure, in
+// which case the listing is left in directory order.
+int sort_listing(dir_listing_t *l);
+
+// Compares two names the way a person would: digit runs by numeric value.
+int natural_compare(const char *a, const char *b);
+
+#endif
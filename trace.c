@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "trace.h"
+
+// A span ('X') or a sample of the counters ('C'), as Chrome traces have them.
+typedef struct trace_event_ {
+  const char *name;
+  uint64_t start, dur;
+  uint64_t values[TRACE_COUNTERS];
+  uint32_t tid;
+  char phase;
+} trace_event_t;
+
+// Spans go into a ring of TRACE_EVENTS; once it is full the oldest are
+// overwritten, so a long session keeps its last stretch.
+static trace_event_t *events = NULL;
+static uint64_t next_event = 0;
+static char *trace_path = NULL;
+static uint64_t origin;
+
+// Each counter on its own cache line, since workers bump them concurrently.
+static struct {
+  uint64_t n;
+  char pad[56];
+} counters[TRACE_COUNTERS];
+
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t latencies[TRACE_LATENCY_SAMPLES];
+static size_t nlatencies = 0, next_latency = 0;
+
+static __thread uint32_t thread_id;
+
+uint64_t trace_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void trace_init(const char *path) {
+  origin = trace_now();
+  if (path == NULL || path[0] == '\0')
+    return;
+  events = calloc(TRACE_EVENTS, sizeof(trace_event_t));
+  if (events != NULL)
+    trace_path = strdup(path);
+}
+
+static trace_event_t *new_event(void) {
+  if (events == NULL)
+    return NULL;
+  if (thread_id == 0)
+    thread_id = gettid();
+  uint64_t i = __atomic_fetch_add(&next_event, 1, __ATOMIC_RELAXED);
+  trace_event_t *e = &events[i % TRACE_EVENTS];
+  e->tid = thread_id;
+  return e;
+}
+
+void trace_span(const char *name, uint64_t start) {
+  trace_event_t *e = new_event();
+  if (e == NULL)
+    return;
+  e->name = name;
+  e->start = start;
+  e->dur = trace_now() - start;
+  e->phase = 'X';
+}
+
+void trace_counters(const char *name, const uint64_t *values) {
+  trace_event_t *e = new_event();
+  if (e == NULL)
+    return;
+  e->name = name;
+  e->start = trace_now();
+  memcpy(e->values, values, sizeof(e->values));
+  e->phase = 'C';
+}
+
+void trace_count(int counter, uint64_t n) {
+  __atomic_fetch_add(&counters[counter].n, n, __ATOMIC_RELAXED);
+}
+
+uint64_t trace_counter(int counter) {
+  return __atomic_load_n(&counters[counter].n, __ATOMIC_RELAXED);
+}
+
+void trace_latency(uint64_t ns) {
+  pthread_mutex_lock(&latency_lock);
+  latencies[next_latency] = ns;
+  next_latency = (next_latency + 1) % TRACE_LATENCY_SAMPLES;
+  if (nlatencies < TRACE_LATENCY_SAMPLES)
+    nlatencies++;
+  pthread_mutex_unlock(&latency_lock);
+}
+
+static int compare_u64(const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+size_t trace_latency_stats(uint64_t *p50, uint64_t *p99) {
+  static uint64_t sorted[TRACE_LATENCY_SAMPLES];
+
+  pthread_mutex_lock(&latency_lock);
+  size_t n = nlatencies;
+  memcpy(sorted, latencies, n * sizeof(uint64_t));
+  pthread_mutex_unlock(&latency_lock);
+  if (n == 0)
+    return 0;
+  qsort(sorted, n, sizeof(uint64_t), compare_u64);
+  *p50 = sorted[n / 2];
+  *p99 = sorted[n * 99 / 100];
+  return n;
+}
+
+void trace_shutdown(void) {
+  static const char *counter_names[] = {"getdents", "statx", "allocs"};
+
+  if (events == NULL)
+    return;
+  FILE *f = fopen(trace_path, "w");
+  if (f != NULL) {
+    uint64_t end = __atomic_load_n(&next_event, __ATOMIC_ACQUIRE);
+    uint64_t first = end > TRACE_EVENTS ? end - TRACE_EVENTS : 0;
+    pid_t pid = getpid();
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (uint64_t i = first; i < end; i++) {
+      trace_event_t *e = &events[i % TRACE_EVENTS];
+      // Timestamps are in microseconds from trace_init().
+      fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"%c\", \"pid\": %d, \"tid\": %u, "
+              "\"ts\": %.3f",
+              i > first ? ",\n" : "", e->name, e->phase, pid, e->tid,
+              (e->start - origin) / 1e3);
+      if (e->phase == 'X') {
+        fprintf(f, ", \"dur\": %.3f}", e->dur / 1e3);
+        continue;
+      }
+      fprintf(f, ", \"args\": {");
+      for (int c = 0; c < TRACE_COUNTERS; c++)
+        fprintf(f, "%s\"%s\": %llu", c ? ", " : "", counter_names[c],
+                (unsigned long long)e->values[c]);
+      fprintf(f, "}}");
+    }
+    fprintf(f, "\n]}\n");
+    fclose(f);
+  }
+  free(events);
+  free(trace_path);
+  events = NULL;
+}
+
+#if TRACE_COUNT_ALLOCS
+// Counts every allocation in the process, ncurses' included, by standing in
+// for glibc's allocator entry points and passing the calls on to it.
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+  trace_count(TRACE_ALLOCS, 1);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  trace_count(TRACE_ALLOCS, 1);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  trace_count(TRACE_ALLOCS, 1);
+  return __libc_realloc(p, size);
+}
+#endif
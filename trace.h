@@ -0,0 +1,46 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Counters bumped on hot paths, read before and after a frame to see what
+// it cost.
+#define TRACE_GETDENTS 0
+#define TRACE_STATX 1
+#define TRACE_ALLOCS 2
+#define TRACE_COUNTERS 3
+
+// Starts keeping spans for a Chrome trace written to path (chrome://tracing
+// or Perfetto) by trace_shutdown(). With path NULL spans cost a clock read
+// and are dropped; counters and latencies are kept either way.
+void trace_init(const char *path);
+
+// Monotonic clock in nanoseconds.
+uint64_t trace_now(void);
+
+// Records a span called name, a string literal, from start to now on the
+// calling thread:
+//   uint64_t t = trace_now();
+//   sort_listing(l);
+//   trace_span("sort", t);
+void trace_span(const char *name, uint64_t start);
+
+// Records the values of the counters under name, as a counter track.
+void trace_counters(const char *name, const uint64_t *values);
+
+void trace_count(int counter, uint64_t n);
+uint64_t trace_counter(int counter);
+
+// Keeps the time from a key press to the frame showing its effect. The last
+// TRACE_LATENCY_SAMPLES are kept.
+void trace_latency(uint64_t ns);
+
+// Median and 99th percentile of the kept latencies. Returns how many there
+// are; p50 and p99 are left alone when there are none.
+size_t trace_latency_stats(uint64_t *p50, uint64_t *p99);
+
+// Writes the trace file if trace_init() was given one.
+void trace_shutdown(void);
+
+#endif
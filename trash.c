@@ -0,0 +1,522 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <limits.h>
+#include <mntent.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "du.h"
+#include "rmtree.h"
+#include "trash.h"
+
+// Each user has a trash of their own: $XDG_DATA_HOME/Trash for the
+// filesystem holding the home directory, and .fsm-trash-UID at the top of
+// any other.
+#define TRASH_NAME ".fsm-trash-"
+#define MAX_TRASHES 32
+
+// Not exported by the C library.
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+// Trash directory of one filesystem, kept open so entries can be renamed in
+// and out relative to it. Each entry is named after the time it was trashed,
+// so names sort oldest first, and has a NAME.path file beside it holding its
+// original path and, once the purge thread has measured it, its size. Any
+// other name, such as the files and info directories desktops keep in the
+// home trash, is left alone.
+typedef struct trash_ {
+  dev_t dev;
+  int fd;
+  char path[PATH_MAX];
+} trash_t;
+
+typedef struct entry_ {
+  char name[32];
+  uint64_t size;
+  int sized;
+  int orphan;
+} entry_t;
+
+static pthread_t worker;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static trash_t trashes[MAX_TRASHES];
+static int ntrashes = 0, dirty = 1, quit = 0, started = 0;
+static int cancel = 0;
+
+// Whether name is that of a trashed entry, as trash_put() makes them.
+static int entry_name(const char *name, size_t len) {
+  if (len != 20 || name[10] != '.')
+    return 0;
+  for (size_t i = 0; i < len; i++)
+    if (i != 10 && (name[i] < '0' || name[i] > '9'))
+      return 0;
+  return 1;
+}
+
+// Writes the path of the trash on the home filesystem to buf. Returns -1
+// without a home directory.
+static int home_trash(char *buf, size_t size) {
+  const char *data = getenv("XDG_DATA_HOME"), *home = getenv("HOME");
+
+  if (data != NULL && data[0] == '/')
+    snprintf(buf, size, "%s/Trash", data);
+  else if (home != NULL && home[0] == '/')
+    snprintf(buf, size, "%s/.local/share/Trash", home);
+  else
+    return -1;
+  return 0;
+}
+
+// Makes the directories of path that are missing, with mode.
+static int make_dirs(char *path, mode_t mode) {
+  for (char *p = strchr(path + 1, '/');; p = strchr(p + 1, '/')) {
+    if (p != NULL)
+      *p = '\0';
+    int rc = mkdir(path, mode);
+    if (p != NULL)
+      *p = '/';
+    if (rc < 0 && errno != EEXIST)
+      return -1;
+    if (p == NULL)
+      return 0;
+  }
+}
+
+// Registers the trash at path, which must live on dev. Called with the lock
+// held. Returns its index or -1.
+static int add_trash(const char *path, dev_t dev) {
+  struct stat st;
+
+  if (ntrashes == MAX_TRASHES) {
+    errno = ENOSPC;
+    return -1;
+  }
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  // Something else mounted over the trash would make renames fail anyway.
+  if (fstat(fd, &st) < 0 || st.st_dev != dev) {
+    close(fd);
+    errno = EXDEV;
+    return -1;
+  }
+  // Nor is anything trashed where someone else could get at it.
+  if (st.st_uid != getuid() || (st.st_mode & 022) != 0) {
+    close(fd);
+    errno = EACCES;
+    return -1;
+  }
+  trashes[ntrashes].dev = dev;
+  trashes[ntrashes].fd = fd;
+  snprintf(trashes[ntrashes].path, sizeof(trashes[ntrashes].path), "%s", path);
+  return ntrashes++;
+}
+
+// Finds the trash of the filesystem holding dir, which is on dev, creating
+// it if create is set. Called with the lock held.
+static int trash_for(const char *dir, dev_t dev, int create) {
+  char top[PATH_MAX], up[PATH_MAX], path[PATH_MAX + sizeof(TRASH_NAME) + 16];
+  const char *home = getenv("HOME");
+  struct stat st;
+
+  for (int i = 0; i < ntrashes; i++)
+    if (trashes[i].dev == dev)
+      return i;
+  if (home != NULL && stat(home, &st) == 0 && st.st_dev == dev &&
+      home_trash(path, sizeof(path)) == 0) {
+    if (create && make_dirs(path, 0700) < 0)
+      return -1;
+    return add_trash(path, dev);
+  }
+  if (realpath(dir, top) == NULL)
+    return -1;
+  while (strcmp(top, "/") != 0) {
+    snprintf(up, sizeof(up), "%s", top);
+    dirname(up);
+    if (stat(up, &st) < 0 || st.st_dev != dev)
+      break;
+    snprintf(top, sizeof(top), "%s", up);
+  }
+  snprintf(path, sizeof(path), "%s/%s%u", strcmp(top, "/") == 0 ? "" : top, TRASH_NAME,
+           (unsigned)getuid());
+  if (create && mkdir(path, 0700) < 0 && errno != EEXIST)
+    return -1;
+  return add_trash(path, dev);
+}
+
+// Reads the original path and, if recorded, the size of a trashed entry
+// from its .path file. Returns -1 if the file is gone.
+static int read_info(int dirfd, const char *name, char *path, size_t size,
+                     entry_t *e) {
+  char info[NAME_MAX + 1], buf[PATH_MAX + 32];
+  ssize_t n;
+
+  snprintf(info, sizeof(info), "%s.path", name);
+  int fd = openat(dirfd, info, O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  n = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (n <= 0)
+    return -1;
+  buf[n] = '\0';
+  char *nl = strchr(buf, '\n');
+  if (nl == NULL)
+    return -1;
+  *nl = '\0';
+  if (path != NULL)
+    snprintf(path, size, "%s", buf);
+  // A size line cut short by a failed write does not count.
+  size_t rest = strlen(nl + 1);
+  if (e != NULL)
+    e->sized = rest > 0 && nl[rest] == '\n' &&
+               sscanf(nl + 1, "%" SCNu64, &e->size) == 1;
+  return 0;
+}
+
+int trash_put(const char *path) {
+  char buf[PATH_MAX], real[PATH_MAX], full[PATH_MAX], name[32], info[64];
+  struct stat st;
+  struct timespec ts;
+  int t, fd, ok;
+
+  if (lstat(path, &st) < 0)
+    return -1;
+  snprintf(buf, sizeof(buf), "%s", path);
+  if (realpath(dirname(buf), real) == NULL)
+    return -1;
+  snprintf(buf, sizeof(buf), "%s", path);
+  snprintf(full, sizeof(full), "%s/%s", strcmp(real, "/") == 0 ? "" : real,
+           basename(buf));
+
+  pthread_mutex_lock(&lock);
+  t = trash_for(real, st.st_dev, 1);
+  if (t < 0)
+    goto fail;
+  // Whatever is already in the trash is deleted for real.
+  size_t len = strlen(trashes[t].path);
+  if (strncmp(full, trashes[t].path, len) == 0 &&
+      (full[len] == '\0' || full[len] == '/')) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  for (;;) {
+    snprintf(name, sizeof(name), "%010lld.%09ld", (long long)ts.tv_sec, ts.tv_nsec);
+    snprintf(info, sizeof(info), "%s.path", name);
+    fd = openat(trashes[t].fd, info, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+    if (fd >= 0 || errno != EEXIST)
+      break;
+    if (++ts.tv_nsec == 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec = 0;
+    }
+  }
+  if (fd < 0)
+    goto fail;
+  len = strlen(full);
+  full[len] = '\n';
+  ok = write(fd, full, len + 1) == (ssize_t)(len + 1);
+  close(fd);
+  if (!ok)
+    errno = EIO;
+  if (!ok || renameat2(AT_FDCWD, path, trashes[t].fd, name, RENAME_NOREPLACE) < 0) {
+    int err = errno;
+    unlinkat(trashes[t].fd, info, 0);
+    errno = err;
+    goto fail;
+  }
+  dirty = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  return 0;
+
+fail:
+  pthread_mutex_unlock(&lock);
+  return -1;
+}
+
+int trash_restore(const char *dir, char *restored, size_t size) {
+  char newest[NAME_MAX + 1] = "", info[NAME_MAX + 1], path[PATH_MAX];
+  struct stat st;
+  struct dirent *de;
+  int t;
+
+  if (stat(dir, &st) < 0)
+    return -1;
+  pthread_mutex_lock(&lock);
+  t = trash_for(dir, st.st_dev, 0);
+  if (t < 0) {
+    errno = ENOENT;
+    goto fail;
+  }
+  int fd = openat(trashes[t].fd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+  if (d == NULL) {
+    if (fd >= 0)
+      close(fd);
+    goto fail;
+  }
+  while ((de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (len < 6 || strcmp(de->d_name + len - 5, ".path") != 0 ||
+        !entry_name(de->d_name, len - 5))
+      continue;
+    snprintf(info, sizeof(info), "%.*s", (int)(len - 5), de->d_name);
+    if (strcmp(info, newest) > 0 &&
+        fstatat(trashes[t].fd, info, &st, AT_SYMLINK_NOFOLLOW) == 0)
+      snprintf(newest, sizeof(newest), "%s", info);
+  }
+  closedir(d);
+  if (newest[0] == '\0') {
+    errno = ENOENT;
+    goto fail;
+  }
+  if (read_info(trashes[t].fd, newest, path, sizeof(path), NULL) < 0) {
+    errno = EIO;
+    goto fail;
+  }
+  if (renameat2(trashes[t].fd, newest, AT_FDCWD, path, RENAME_NOREPLACE) < 0) {
+    // The directory it came from is gone; make it again.
+    char parent[PATH_MAX];
+    snprintf(parent, sizeof(parent), "%s", path);
+    if (errno != ENOENT || make_dirs(dirname(parent), 0777) < 0 ||
+        renameat2(trashes[t].fd, newest, AT_FDCWD, path, RENAME_NOREPLACE) < 0) {
+      // ENOENT is kept for an empty trash.
+      if (errno == ENOENT)
+        errno = ENOTDIR;
+      goto fail;
+    }
+  }
+  snprintf(info, sizeof(info), "%s.path", newest);
+  unlinkat(trashes[t].fd, info, 0);
+  pthread_mutex_unlock(&lock);
+  snprintf(restored, size, "%s", path);
+  return 0;
+
+fail:
+  pthread_mutex_unlock(&lock);
+  return -1;
+}
+
+static int by_name_desc(const void *a, const void *b) {
+  return strcmp(((const entry_t *)b)->name, ((const entry_t *)a)->name);
+}
+
+// Removes an entry of trash t with everything below it.
+static void remove_entry(int t, const char *name) {
+  char path[PATH_MAX + NAME_MAX + 2];
+  rm_options_t opt = {0};
+  rm_result_t out;
+
+  snprintf(path, sizeof(path), "%s/%s", trashes[t].path, name);
+  opt.threads = 1;
+  opt.cancel = &cancel;
+  rm_tree(path, &opt, &out);
+}
+
+// Records the size of an entry in its .path file, so the next pass, or the
+// next run, need not walk it again. Returns -1 if the entry was restored in
+// the meantime.
+static int record_size(int dirfd, const entry_t *e) {
+  char info[NAME_MAX + 1], line[32];
+
+  snprintf(info, sizeof(info), "%s.path", e->name);
+  int fd = openat(dirfd, info, O_WRONLY | O_APPEND | O_CLOEXEC);
+  if (fd < 0)
+    return -1;
+  int len = snprintf(line, sizeof(line), "%" PRIu64 "\n", e->size);
+  // Should the write fail, the entry is simply measured again next time.
+  ssize_t written = write(fd, line, len);
+  close(fd);
+  (void)written;
+  return 0;
+}
+
+// Measures the new entries of trash t and purges the oldest ones beyond
+// TRASH_MAX_BYTES, along with anything an interrupted purge left behind.
+static void purge(int t) {
+  entry_t *v = NULL;
+  size_t n = 0, cap = 0;
+  char info[NAME_MAX + 1];
+  struct dirent *de;
+  struct stat st;
+  uint64_t kept = 0;
+
+  // The lock keeps trash_put() and trash_restore() from changing the
+  // directory while it is read.
+  pthread_mutex_lock(&lock);
+  int dirfd = trashes[t].fd;
+  int fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  DIR *d = fd >= 0 ? fdopendir(fd) : NULL;
+  if (d == NULL) {
+    if (fd >= 0)
+      close(fd);
+    pthread_mutex_unlock(&lock);
+    return;
+  }
+  while ((de = readdir(d)) != NULL) {
+    const char *name = de->d_name;
+    size_t len = strlen(name);
+    if (len > 5 && strcmp(name + len - 5, ".path") == 0) {
+      if (!entry_name(name, len - 5))
+        continue;
+      // The record of an entry since removed by hand.
+      snprintf(info, sizeof(info), "%.*s", (int)(len - 5), name);
+      if (fstatat(dirfd, info, &st, AT_SYMLINK_NOFOLLOW) < 0)
+        unlinkat(dirfd, name, 0);
+      continue;
+    }
+    if (!entry_name(name, len))
+      continue;
+    if (n == cap) {
+      entry_t *grown = realloc(v, (cap ? cap * 2 : 64) * sizeof(entry_t));
+      if (grown == NULL)
+        break;
+      v = grown;
+      cap = cap ? cap * 2 : 64;
+    }
+    entry_t *e = &v[n++];
+    snprintf(e->name, sizeof(e->name), "%s", name);
+    // Without a record it is the remains of a purge cut short.
+    e->orphan = read_info(dirfd, name, NULL, 0, e) < 0;
+  }
+  closedir(d);
+  pthread_mutex_unlock(&lock);
+
+  qsort(v, n, sizeof(entry_t), by_name_desc);
+  for (size_t i = 0; i < n && !__atomic_load_n(&cancel, __ATOMIC_RELAXED); i++) {
+    entry_t *e = &v[i];
+    if (e->orphan) {
+      remove_entry(t, e->name);
+      continue;
+    }
+    if (!e->sized) {
+      char path[PATH_MAX + NAME_MAX + 2];
+      du_options_t opt = {0};
+      du_result_t du;
+      snprintf(path, sizeof(path), "%s/%s", trashes[t].path, e->name);
+      opt.threads = 1;
+      opt.one_filesystem = 1;
+      opt.cancel = &cancel;
+      if (du_walk(path, &opt, &du) < 0 || __atomic_load_n(&cancel, __ATOMIC_RELAXED))
+        continue;
+      e->size = du.blocks * 512;
+      pthread_mutex_lock(&lock);
+      int gone = record_size(dirfd, e) < 0;
+      pthread_mutex_unlock(&lock);
+      if (gone)
+        continue;
+    }
+    if (kept + e->size <= (uint64_t)TRASH_MAX_BYTES) {
+      kept += e->size;
+      continue;
+    }
+    // Once its record is gone the entry can no longer be restored, and if
+    // the purge is cut short the next pass finishes it.
+    pthread_mutex_lock(&lock);
+    snprintf(info, sizeof(info), "%s.path", e->name);
+    int gone = unlinkat(dirfd, info, 0) < 0;
+    pthread_mutex_unlock(&lock);
+    if (!gone)
+      remove_entry(t, e->name);
+  }
+  free(v);
+}
+
+// Registers the trash at path if it is there and its filesystem has none
+// yet.
+static void found_trash(const char *path) {
+  struct stat st;
+
+  if (lstat(path, &st) < 0 || !S_ISDIR(st.st_mode))
+    return;
+  pthread_mutex_lock(&lock);
+  int known = 0;
+  for (int i = 0; i < ntrashes; i++)
+    known |= trashes[i].dev == st.st_dev;
+  if (!known)
+    add_trash(path, st.st_dev);
+  pthread_mutex_unlock(&lock);
+}
+
+// Picks up the user's trashes left on mounted filesystems by earlier runs.
+static void find_trashes(void) {
+  char path[PATH_MAX];
+  struct mntent *m;
+
+  if (home_trash(path, sizeof(path)) == 0)
+    found_trash(path);
+  FILE *f = setmntent("/proc/self/mounts", "r");
+  if (f == NULL)
+    return;
+  while ((m = getmntent(f)) != NULL) {
+    snprintf(path, sizeof(path), "%s/%s%u", strcmp(m->mnt_dir, "/") == 0 ? "" : m->mnt_dir,
+             TRASH_NAME, (unsigned)getuid());
+    found_trash(path);
+  }
+  endmntent(f);
+}
+
+static void *worker_main(void *arg) {
+  // Purging competes with the user for the disk, so it only gets idle time.
+  // The walkers it starts inherit both settings.
+  setpriority(PRIO_PROCESS, syscall(SYS_gettid), 19);
+  syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+          IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+  find_trashes();
+
+  pthread_mutex_lock(&lock);
+  for (;;) {
+    while (!dirty && !quit)
+      pthread_cond_wait(&wake, &lock);
+    if (quit)
+      break;
+    dirty = 0;
+    int n = ntrashes;
+    pthread_mutex_unlock(&lock);
+    for (int t = 0; t < n; t++)
+      purge(t);
+    pthread_mutex_lock(&lock);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+int trash_init(void) {
+  if (pthread_create(&worker, NULL, worker_main, NULL) != 0)
+    return -1;
+  started = 1;
+  return 0;
+}
+
+void trash_shutdown(void) {
+  if (!started)
+    return;
+  pthread_mutex_lock(&lock);
+  quit = 1;
+  __atomic_store_n(&cancel, 1, __ATOMIC_RELAXED);
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(worker, NULL);
+  for (int i = 0; i < ntrashes; i++)
+    close(trashes[i].fd);
+  ntrashes = 0;
+  started = 0;
+}
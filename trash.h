@@ -0,0 +1,28 @@
+#ifndef TRASH_H
+#define TRASH_H
+
+#include <stddef.h>
+
+// Starts the purge thread. Trashes left by earlier runs on mounted
+// filesystems are picked up and trimmed too.
+int trash_init(void);
+
+// Moves path into the user's trash on its filesystem with a single
+// renameat2(), so it is gone from view at once whatever its
+// size. The purge thread then keeps the newest entries whose total size
+// stays within TRASH_MAX_BYTES and removes the rest at idle I/O priority.
+// Returns -1 with errno set if path cannot be moved there, e.g. EXDEV across
+// a bind mount; the caller should then ask before deleting it outright.
+int trash_put(const char *path);
+
+// Moves the most recently trashed entry of the filesystem holding dir back
+// to where it came from, making its directory again if that is gone, and
+// puts that path into restored. Returns -1 with errno set; ENOENT means
+// only that there is nothing left to restore.
+int trash_restore(const char *dir, char *restored, size_t size);
+
+// Stops the purge, leaving whatever is still in the trash for next time,
+// and joins the thread.
+void trash_shutdown(void);
+
+#endif
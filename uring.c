@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "config.h"
+#include "uring.h"
+
+struct uring_ {
+  int fd;
+  unsigned depth;
+  // Shared with the kernel: it consumes sq entries from sq_head and posts
+  // completions at cq_tail.
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *sq_ring, *cq_ring;
+  size_t sq_size, cq_size, sqes_size;
+  // Entries written to the sq ring but not yet submitted.
+  unsigned queued;
+  // Slots: the caller's tag and, for statx, the buffer of each request.
+  // user_data is the slot index.
+  uint64_t *tags;
+  struct statx *stx;
+  unsigned *free_slots;
+  unsigned nfree;
+  // Set once io_uring_enter() has failed; no request is queued after that.
+  int dead;
+};
+
+// The operations used by callers; a kernel without any of them gets none.
+static const int needed_ops[] = {
+    IORING_OP_STATX, IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE,
+    IORING_OP_FSYNC, IORING_OP_CLOSE, IORING_OP_UNLINKAT, IORING_OP_RENAMEAT,
+};
+
+static pthread_once_t once = PTHREAD_ONCE_INIT;
+static pthread_key_t key;
+// 0 until a ring has been set up, 1 once one has, -1 if none can be.
+static int state = 0;
+static __thread uring_t *ring = NULL;
+
+static void destroy(void *arg) {
+  uring_t *r = arg;
+
+  if (r->sqes != NULL)
+    munmap(r->sqes, r->sqes_size);
+  if (r->cq_ring != NULL && r->cq_ring != r->sq_ring)
+    munmap(r->cq_ring, r->cq_size);
+  if (r->sq_ring != NULL)
+    munmap(r->sq_ring, r->sq_size);
+  if (r->fd >= 0)
+    close(r->fd);
+  free(r->tags);
+  free(r->stx);
+  free(r->free_slots);
+  free(r);
+}
+
+static int supported(int fd) {
+  size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, size);
+  int ok = probe != NULL &&
+           syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+
+  for (size_t i = 0; ok && i < sizeof(needed_ops) / sizeof(needed_ops[0]); i++)
+    ok = needed_ops[i] <= probe->last_op &&
+         (probe->ops[needed_ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+static uring_t *create(void) {
+  struct io_uring_params p;
+  uring_t *r = calloc(1, sizeof(uring_t));
+
+  if (r == NULL)
+    return NULL;
+  memset(&p, 0, sizeof(p));
+  r->fd = syscall(__NR_io_uring_setup, URING_DEPTH, &p);
+  if (r->fd < 0 || !supported(r->fd))
+    goto fail;
+  r->depth = p.sq_entries;
+  r->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  r->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (r->cq_size > r->sq_size)
+      r->sq_size = r->cq_size;
+    r->cq_size = r->sq_size;
+  }
+  r->sq_ring = mmap(NULL, r->sq_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (r->sq_ring == MAP_FAILED) {
+    r->sq_ring = NULL;
+    goto fail;
+  }
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    r->cq_ring = r->sq_ring;
+  } else {
+    r->cq_ring = mmap(NULL, r->cq_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (r->cq_ring == MAP_FAILED) {
+      r->cq_ring = NULL;
+      goto fail;
+    }
+  }
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED) {
+    r->sqes = NULL;
+    goto fail;
+  }
+  r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+  r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+  r->sq_mask = (unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+  r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+  r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+  r->cq_mask = (unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+
+  // No more requests than sq entries are ever outstanding, so neither
+  // ring can overflow.
+  r->tags = malloc(r->depth * sizeof(uint64_t));
+  r->stx = malloc(r->depth * sizeof(struct statx));
+  r->free_slots = malloc(r->depth * sizeof(unsigned));
+  if (r->tags == NULL || r->stx == NULL || r->free_slots == NULL)
+    goto fail;
+  for (unsigned i = 0; i < r->depth; i++)
+    r->free_slots[i] = r->depth - 1 - i;
+  r->nfree = r->depth;
+  return r;
+
+fail:
+  destroy(r);
+  return NULL;
+}
+
+static void init(void) {
+  const char *env = getenv("FSM_URING");
+
+  pthread_key_create(&key, destroy);
+  if (env != NULL && strcmp(env, "0") == 0)
+    state = -1;
+}
+
+uring_t *uring_get(void) {
+  if (ring != NULL || !URING_ENABLE)
+    return ring;
+  pthread_once(&once, init);
+  if (__atomic_load_n(&state, __ATOMIC_ACQUIRE) < 0)
+    return NULL;
+  ring = create();
+  if (ring == NULL) {
+    // Only the first failure says io_uring cannot be had at all; a later
+    // one is a thread running out of descriptors or memory.
+    int unknown = 0;
+    __atomic_compare_exchange_n(&state, &unknown, -1, 0, __ATOMIC_ACQ_REL,
+                                __ATOMIC_ACQUIRE);
+    return NULL;
+  }
+  __atomic_store_n(&state, 1, __ATOMIC_RELEASE);
+  pthread_setspecific(key, ring);
+  return ring;
+}
+
+// Takes a slot and the next sq entry, cleared, for a request.
+static struct io_uring_sqe *next_sqe(uring_t *r, int op, uint64_t tag) {
+  if (r->dead) {
+    errno = ECANCELED;
+    return NULL;
+  }
+  if (r->nfree == 0) {
+    errno = EBUSY;
+    return NULL;
+  }
+  unsigned slot = r->free_slots[--r->nfree];
+  unsigned tail = *r->sq_tail;
+  unsigned index = tail & *r->sq_mask;
+  struct io_uring_sqe *sqe = &r->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = op;
+  sqe->user_data = slot;
+  r->tags[slot] = tag;
+  r->sq_array[index] = index;
+  // The entry must be complete before the kernel can see the new tail.
+  __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  r->queued++;
+  return sqe;
+}
+
+int uring_statx(uring_t *r, int dirfd, const char *path, int flags,
+                unsigned mask, uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_STATX, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = dirfd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = mask;
+  sqe->off = (uintptr_t)&r->stx[sqe->user_data];
+  sqe->statx_flags = flags;
+  return 0;
+}
+
+int uring_openat(uring_t *r, int dirfd, const char *path, int flags,
+                 mode_t mode, uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_OPENAT, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = dirfd;
+  sqe->addr = (uintptr_t)path;
+  sqe->len = mode;
+  sqe->open_flags = flags;
+  return 0;
+}
+
+int uring_read(uring_t *r, int fd, void *buf, unsigned len, uint64_t off,
+               uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_READ, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  return 0;
+}
+
+int uring_write(uring_t *r, int fd, const void *buf, unsigned len,
+                uint64_t off, uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_WRITE, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = fd;
+  sqe->addr = (uintptr_t)buf;
+  sqe->len = len;
+  sqe->off = off;
+  return 0;
+}
+
+int uring_fsync(uring_t *r, int fd, uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_FSYNC, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = fd;
+  return 0;
+}
+
+int uring_close(uring_t *r, int fd, uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_CLOSE, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = fd;
+  return 0;
+}
+
+int uring_unlinkat(uring_t *r, int dirfd, const char *path, int flags,
+                   uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_UNLINKAT, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = dirfd;
+  sqe->addr = (uintptr_t)path;
+  sqe->unlink_flags = flags;
+  return 0;
+}
+
+int uring_renameat(uring_t *r, int olddir, const char *oldpath, int newdir,
+                   const char *newpath, uint64_t tag) {
+  struct io_uring_sqe *sqe = next_sqe(r, IORING_OP_RENAMEAT, tag);
+  if (sqe == NULL)
+    return -1;
+  sqe->fd = olddir;
+  sqe->addr = (uintptr_t)oldpath;
+  sqe->len = newdir;
+  sqe->addr2 = (uintptr_t)newpath;
+  return 0;
+}
+
+unsigned uring_pending(const uring_t *r) {
+  return r->depth - r->nfree;
+}
+
+// Hands every posted completion to fn. Returns how many there were.
+static int reap(uring_t *r, uring_fn fn, void *arg) {
+  unsigned head = *r->cq_head;
+  int n = 0;
+
+  while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    unsigned slot = (unsigned)cqe->user_data;
+    int res = cqe->res;
+
+    __atomic_store_n(r->cq_head, ++head, __ATOMIC_RELEASE);
+    r->free_slots[r->nfree++] = slot;
+    // The slot's statx buffer is only rewritten by a request submitted
+    // after fn returns.
+    fn(arg, r->tags[slot], res, res >= 0 ? &r->stx[slot] : NULL);
+    n++;
+  }
+  return n;
+}
+
+// Ends a ring whose io_uring_enter() failed, so that none of its
+// completions is left for the thread's next caller. Requests the kernel
+// never got are handed to fn as cancelled; those it has are waited for, for
+// up to a second. The thread gets a new ring from its next uring_get(). A
+// ring with requests still out is leaked rather than have the kernel write
+// into freed memory.
+static void teardown(uring_t *r, uring_fn fn, void *arg) {
+  struct timespec ms = {0, 1000000};
+  unsigned tail = *r->sq_tail;
+  int err = errno;
+
+  r->dead = 1;
+  if (r == ring) {
+    ring = NULL;
+    pthread_setspecific(key, NULL);
+  }
+  for (; r->queued > 0; r->queued--) {
+    unsigned slot = (unsigned)r->sqes[r->sq_array[--tail & *r->sq_mask]].user_data;
+    r->free_slots[r->nfree++] = slot;
+    fn(arg, r->tags[slot], -ECANCELED, NULL);
+  }
+  for (int i = 0; i < 1000 && uring_pending(r) > 0; i++) {
+    // Sleeping enters the kernel, which runs any completion work queued
+    // for this thread.
+    if (reap(r, fn, arg) == 0)
+      nanosleep(&ms, NULL);
+  }
+  if (uring_pending(r) == 0)
+    destroy(r);
+  errno = err;
+}
+
+int uring_wait(uring_t *r, unsigned min, uring_fn fn, void *arg) {
+  unsigned done = 0;
+
+  if (min > uring_pending(r))
+    min = uring_pending(r);
+  for (;;) {
+    done += reap(r, fn, arg);
+    if (done >= min && r->queued == 0)
+      return done;
+    unsigned want = done < min ? min - done : 0;
+    long n = syscall(__NR_io_uring_enter, r->fd, r->queued, want,
+                     want > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    if (n < 0) {
+      // EAGAIN and EBUSY mean completions must be reaped first.
+      if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+        continue;
+      teardown(r, fn, arg);
+      return -1;
+    }
+    r->queued -= n;
+  }
+}
+
+int uring_drain(uring_t *r, uring_fn fn, void *arg) {
+  while (uring_pending(r) > 0)
+    if (uring_wait(r, uring_pending(r), fn, arg) < 0)
+      return -1;
+  return 0;
+}
@@ -0,0 +1,60 @@
+#ifndef URING_H
+#define URING_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+// A thread's io_uring: requests are queued without a system call and a
+// whole batch is submitted, and its completions collected, with one
+// io_uring_enter(). Each request holds one of URING_DEPTH slots from when
+// it is queued until its completion has been handled.
+typedef struct uring_ uring_t;
+
+// Gets the result of a request: what the system call would have returned,
+// or -errno. stx is the buffer a successful statx request filled, and
+// NULL after a failure. fn may queue further requests; the slot of the
+// request being handled is free again by then.
+typedef void (*uring_fn)(void *arg, uint64_t tag, int res, const struct statx *stx);
+
+// Returns the calling thread's ring, set up on first use and closed when
+// the thread exits. Returns NULL when io_uring is not there, is refused
+// (seccomp, io_uring_disabled), lacks one of the operations below, or was
+// turned off with URING_ENABLE or FSM_URING=0; callers then make the plain
+// system calls themselves.
+uring_t *uring_get(void);
+
+// Queue one request each; tag is handed back with its result. Paths and
+// buffers must stay valid until the request completes. Return -1 with
+// errno EBUSY when every slot is taken.
+int uring_statx(uring_t *r, int dirfd, const char *path, int flags,
+                unsigned mask, uint64_t tag);
+int uring_openat(uring_t *r, int dirfd, const char *path, int flags,
+                 mode_t mode, uint64_t tag);
+int uring_read(uring_t *r, int fd, void *buf, unsigned len, uint64_t off,
+               uint64_t tag);
+int uring_write(uring_t *r, int fd, const void *buf, unsigned len,
+                uint64_t off, uint64_t tag);
+int uring_fsync(uring_t *r, int fd, uint64_t tag);
+int uring_close(uring_t *r, int fd, uint64_t tag);
+int uring_unlinkat(uring_t *r, int dirfd, const char *path, int flags,
+                   uint64_t tag);
+int uring_renameat(uring_t *r, int olddir, const char *oldpath, int newdir,
+                   const char *newpath, uint64_t tag);
+
+// Requests queued or in flight.
+unsigned uring_pending(const uring_t *r);
+
+// Submits the queued requests and waits until at least min of the pending
+// ones have completed, passing every completion at hand to fn. Returns how
+// many were handled, or -1 with errno set. On failure the ring is closed,
+// after handing every pending request to fn, with -ECANCELED for those the
+// kernel never got; r must not be used again, and the caller gets a new
+// ring from uring_get(). Requests fn queues meanwhile fail with ECANCELED.
+int uring_wait(uring_t *r, unsigned min, uring_fn fn, void *arg);
+
+// Waits for every pending request, including those queued by fn. Fails as
+// uring_wait() does.
+int uring_drain(uring_t *r, uring_fn fn, void *arg);
+
+#endif